@@ -0,0 +1,180 @@
+// MRBus host benchmark
+// Times the hot paths of the core as built for the build machine, for comparing build options
+// without the AVR toolchain - "make bench-host" builds it once for each variant in
+// BENCH_HOST_VARIANTS: the queue backends, and the CRC engines that run on the host (the type 2
+// assembly is AVR only, see "make bench-crc").  Times are x86 time stamp counter cycles where there
+// is one, otherwise nanoseconds, and are the best of several trials so a stray interrupt or context
+// switch doesn't count.  They only rank the options against each other on this machine - the host
+// HAL's ATOMIC_BLOCK costs nothing, where on AVR it's a cli and an SREG restore, so the queue
+// numbers understate what the lock-free backends save.  AVR cycle counts come from "make bench".
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#include "mrbus.h"
+
+#define BENCH_HOST_BYTES   4096
+#define BENCH_HOST_REPS    64
+#define BENCH_HOST_TRIALS  25
+#define BENCH_HOST_BATCHES 1024
+#define BENCH_HOST_QUEUE   4
+
+#ifndef MRBUS_BENCH_HOST_VARIANT
+#define MRBUS_BENCH_HOST_VARIANT "default"
+#endif
+
+// Same default as mrbus-crc.c
+#ifndef MRBUS_CRC_TYPE
+#define MRBUS_CRC_TYPE 0
+#endif
+
+#if defined(__x86_64__) || defined(__i386__)
+#define BENCH_HOST_UNIT "cycles"
+static inline uint64_t benchHostNow(void)
+{
+	return(__rdtsc());
+}
+#else
+#define BENCH_HOST_UNIT "ns"
+static inline uint64_t benchHostNow(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return((uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec);
+}
+#endif
+
+static uint8_t benchHostData[BENCH_HOST_BYTES];
+
+// Keeps the compiler from throwing away results nobody looks at
+static volatile uint16_t benchHostSink;
+
+static void benchHostFill(uint8_t* data, uint16_t len, uint32_t seed)
+{
+	while (len--)
+	{
+		seed = seed * 1103515245UL + 12345;
+		*data++ = seed >> 16;
+	}
+}
+
+static double benchHostCrcUpdate(void)
+{
+	uint64_t start, best = ~0ULL;
+	uint16_t crc, i;
+	uint8_t trial, rep;
+
+	for (trial=0; trial<BENCH_HOST_TRIALS; trial++)
+	{
+		crc = 0;
+		start = benchHostNow();
+		for (rep=0; rep<BENCH_HOST_REPS; rep++)
+			for (i=0; i<BENCH_HOST_BYTES; i++)
+				crc = mrbusCRC16Update(crc, benchHostData[i]);
+		start = benchHostNow() - start;
+		benchHostSink = crc;
+		if (start < best)
+			best = start;
+	}
+	return((double)best / ((double)BENCH_HOST_BYTES * BENCH_HOST_REPS));
+}
+
+static double benchHostCrcValid(void)
+{
+	uint8_t pkt[MRBUS_BUFFER_SIZE];
+	uint64_t start, best = ~0ULL;
+	uint16_t i;
+	uint8_t trial, valid = 0;
+
+	memcpy(pkt, benchHostData, sizeof(pkt));
+	pkt[MRBUS_PKT_LEN] = MRBUS_BUFFER_SIZE;
+
+	for (trial=0; trial<BENCH_HOST_TRIALS; trial++)
+	{
+		start = benchHostNow();
+		for (i=0; i<BENCH_HOST_BYTES; i++)
+			valid += mrbusIsCrcValid(pkt);
+		start = benchHostNow() - start;
+		benchHostSink = valid;
+		if (start < best)
+			best = start;
+	}
+	return((double)best / BENCH_HOST_BYTES);
+}
+
+// Cost of an empty timed region, taken off the queue times
+static uint64_t benchHostOverhead(void)
+{
+	uint64_t start, best = ~0ULL;
+	uint16_t i;
+
+	for (i=0; i<BENCH_HOST_BATCHES; i++)
+	{
+		start = benchHostNow();
+		start = benchHostNow() - start;
+		if (start < best)
+			best = start;
+	}
+	return(best);
+}
+
+// Fills the queue and drains it again, timing the pushes and the pops separately.  Lengths vary
+// so the copies aren't all the same size.
+static void benchHostQueue(double* push, double* pop)
+{
+	MRBusPacket buffer[BENCH_HOST_QUEUE];
+	MRBusPktQueue q;
+	uint8_t pkt[MRBUS_BUFFER_SIZE];
+	uint64_t start, overhead = benchHostOverhead(), pushTotal, popTotal, bestPush = ~0ULL, bestPop = ~0ULL;
+	uint16_t batch;
+	uint8_t trial, i, len = MRBUS_PKT_TYPE + 1;
+
+	mrbusPktQueueInitialize(&q, buffer, BENCH_HOST_QUEUE);
+	memcpy(pkt, benchHostData, sizeof(pkt));
+
+	for (trial=0; trial<BENCH_HOST_TRIALS; trial++)
+	{
+		pushTotal = popTotal = 0;
+		for (batch=0; batch<BENCH_HOST_BATCHES; batch++)
+		{
+			pkt[MRBUS_PKT_LEN] = len;
+			if (++len > MRBUS_BUFFER_SIZE)
+				len = MRBUS_PKT_TYPE + 1;
+
+			start = benchHostNow();
+			for (i=0; i<BENCH_HOST_QUEUE; i++)
+				mrbusPktQueuePush(&q, pkt, sizeof(pkt));
+			pushTotal += benchHostNow() - start - overhead;
+
+			start = benchHostNow();
+			for (i=0; i<BENCH_HOST_QUEUE; i++)
+				mrbusPktQueuePop(&q, pkt, sizeof(pkt));
+			popTotal += benchHostNow() - start - overhead;
+		}
+		if (pushTotal < bestPush)
+			bestPush = pushTotal;
+		if (popTotal < bestPop)
+			bestPop = popTotal;
+	}
+	*push = (double)bestPush / ((double)BENCH_HOST_BATCHES * BENCH_HOST_QUEUE);
+	*pop = (double)bestPop / ((double)BENCH_HOST_BATCHES * BENCH_HOST_QUEUE);
+}
+
+int main(void)
+{
+	double push, pop;
+
+	benchHostFill(benchHostData, sizeof(benchHostData), 1);
+
+	printf("%-8s crc type %d  crc_update %6.2f %s/byte  crc_valid %7.1f %s/%d byte packet\n", MRBUS_BENCH_HOST_VARIANT,
+		MRBUS_CRC_TYPE, benchHostCrcUpdate(), BENCH_HOST_UNIT, benchHostCrcValid(), BENCH_HOST_UNIT, MRBUS_BUFFER_SIZE);
+
+	benchHostQueue(&push, &pop);
+	printf("%-8s queue  push %6.1f %s  pop %6.1f %s\n", MRBUS_BENCH_HOST_VARIANT, push, BENCH_HOST_UNIT, pop, BENCH_HOST_UNIT);
+	return(0);
+}
@@ -0,0 +1,428 @@
+// MRBus benchmark runner
+// Loads the benchmark firmware into simavr and single steps it, taking cycle counts and stack
+// depth straight from the simulated core:
+//  - Sections marked by the firmware are timed from START to STOP, less any cycles spent in the
+//    benchmarked ISRs in between, and the calibration overhead of an empty section.  Stack is
+//    the deepest the foreground code went below SP at START.
+//  - ISRs registered by the firmware are timed from their first instruction through the reti
+//    (add the 4 cycle interrupt response and 3 cycle vector jmp for true latency).  Stack includes
+//    the return address pushed on entry.
+//  - The firmware's competing ISR stands in for the application's interrupts.  Its latency is
+//    timed from the cycle its interrupt flag is raised to its first instruction, so includes the
+//    interrupt response, the vector jmp and however long the driver had interrupts off.
+// Results go to a CSV file (section,count,best,worst,avg,stack).  If a baseline CSV is given, any
+// section whose worst case cycles grow by more than the margin, or whose stack grows at all, is
+// reported and the runner exits non-zero so the build fails.  So does a failed firmware self
+// check (the CRC engine against a bit at a time reference).
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sim_avr.h>
+#include <sim_elf.h>
+#include <sim_irq.h>
+#include <avr_uart.h>
+
+#include "mrbus-bench.h"
+
+#define BENCH_MAX_NEST     4
+#define BENCH_MAX_SECONDS  60
+
+typedef struct
+{
+	uint32_t count;
+	uint64_t total;
+	uint32_t best;
+	uint32_t worst;
+	uint16_t stack;
+} BenchStats;
+
+typedef struct
+{
+	uint8_t section;
+	uint64_t entryCycle;
+	uint16_t entrySp;
+	uint16_t minSp;
+} BenchIsrFrame;
+
+static const char* benchNames[MRBUS_BENCH_SECTIONS] =
+{
+	"overhead",
+	"crc_valid",
+	"queue_push",
+	"queue_pop",
+	"transmit",
+	"rx_isr",
+	"tx_isr",
+	"done_isr",
+	"timer_isr",
+	"pkt_handler",
+	"compete_isr",
+	"compete_latency",
+};
+
+static avr_t* avr;
+static BenchStats stats[MRBUS_BENCH_SECTIONS];
+static uint32_t isrAddr[MRBUS_BENCH_SECTIONS];
+static uint16_t config[MRBUS_BENCH_CFG_KEYS];
+static uint8_t configSet[MRBUS_BENCH_CFG_KEYS];
+static uint16_t benchDataReg;
+static uint8_t benchArgReg;
+static int benchDone;
+static int benchFailed;
+
+static BenchIsrFrame isrStack[BENCH_MAX_NEST];
+static int isrDepth;
+static uint64_t isrCycles;       // Cycles spent in outermost ISRs since the run started
+
+static int sectionActive = -1;
+static uint64_t sectionStart;
+static uint64_t sectionIsrStart;
+static uint16_t sectionSp, sectionMinSp;
+
+static int competeEnabled;
+static uint8_t competeRaised;
+static uint64_t competeRaisedCycle;
+
+static avr_irq_t* uartIn;
+static int busEnabled;
+static uint8_t busLevel = 1;
+
+static uint16_t benchSp(void)
+{
+	return(avr->data[R_SPL] | (avr->data[R_SPH] << 8));
+}
+
+static void benchRecord(uint8_t section, uint64_t cycles, uint16_t stack)
+{
+	BenchStats* s = &stats[section];
+	if (0 == s->count || cycles < s->best)
+		s->best = cycles;
+	if (cycles > s->worst)
+		s->worst = cycles;
+	if (stack > s->stack)
+		s->stack = stack;
+	s->total += cycles;
+	s->count++;
+}
+
+static void benchCmdWrite(struct avr_t* avr, avr_io_addr_t addr, uint8_t v, void* param)
+{
+	avr->data[addr] = v;
+
+	switch(v)
+	{
+		case MRBUS_BENCH_CMD_START:
+			if (benchArgReg >= MRBUS_BENCH_SECTIONS)
+				break;
+			sectionActive = benchArgReg;
+			sectionStart = avr->cycle;
+			sectionIsrStart = isrCycles;
+			sectionSp = sectionMinSp = benchSp();
+			break;
+
+		case MRBUS_BENCH_CMD_STOP:
+			if (benchArgReg != sectionActive)
+				break;
+			benchRecord(sectionActive, (avr->cycle - sectionStart) - (isrCycles - sectionIsrStart), sectionSp - sectionMinSp);
+			sectionActive = -1;
+			break;
+
+		case MRBUS_BENCH_CMD_ISR:
+			if (benchArgReg < MRBUS_BENCH_SECTIONS)
+				isrAddr[benchArgReg] = (uint32_t)benchDataReg * 2;
+			break;
+
+		case MRBUS_BENCH_CMD_CONFIG:
+			if (benchArgReg < MRBUS_BENCH_CFG_KEYS)
+			{
+				config[benchArgReg] = benchDataReg;
+				configSet[benchArgReg] = 1;
+			}
+			break;
+
+		case MRBUS_BENCH_CMD_INJECT:
+			if (NULL != uartIn)
+				avr_raise_irq(uartIn, benchDataReg & 0xFF);
+			break;
+
+		case MRBUS_BENCH_CMD_DONE:
+			benchDone = 1;
+			break;
+
+		case MRBUS_BENCH_CMD_FAIL:
+			fprintf(stderr, "FAILED %s: firmware self check\n", (benchArgReg < MRBUS_BENCH_SECTIONS) ? benchNames[benchArgReg] : "?");
+			benchFailed = 1;
+			break;
+	}
+}
+
+static void benchArgWrite(struct avr_t* avr, avr_io_addr_t addr, uint8_t v, void* param)
+{
+	avr->data[addr] = v;
+	benchArgReg = v;
+}
+
+static void benchDataWrite(struct avr_t* avr, avr_io_addr_t addr, uint8_t v, void* param)
+{
+	avr->data[addr] = v;
+	benchDataReg = (benchDataReg << 8) | v;
+}
+
+// The UART is only hooked up once the firmware says which one it's using
+static void benchUartSetup(void)
+{
+	char uart = configSet[MRBUS_BENCH_CFG_UART] ? config[MRBUS_BENCH_CFG_UART] : '0';
+	uint32_t flags = 0;
+
+	uartIn = avr_io_getirq(avr, AVR_IOCTL_UART_GETIRQ(uart), UART_IRQ_INPUT);
+
+	// Keep the bus traffic off our stdout
+	avr_ioctl(avr, AVR_IOCTL_UART_GET_FLAGS(uart), &flags);
+	flags &= ~AVR_UART_FLAG_STDIO;
+	avr_ioctl(avr, AVR_IOCTL_UART_SET_FLAGS(uart), &flags);
+
+	if (configSet[MRBUS_BENCH_CFG_LOOPBACK] && config[MRBUS_BENCH_CFG_LOOPBACK])
+		avr_connect_irq(avr_io_getirq(avr, AVR_IOCTL_UART_GETIRQ(uart), UART_IRQ_OUTPUT), uartIn);
+
+	busEnabled = configSet[MRBUS_BENCH_CFG_BUS_PORT] && configSet[MRBUS_BENCH_CFG_BUS_DDR]
+		&& configSet[MRBUS_BENCH_CFG_BUS_PIN] && configSet[MRBUS_BENCH_CFG_BUS_TX]
+		&& configSet[MRBUS_BENCH_CFG_BUS_TXE] && configSet[MRBUS_BENCH_CFG_BUS_RX];
+}
+
+// RS485 transceiver model for a node alone on the bus - the bus is only pulled low when the
+// driver is enabled and TX is an output driven low, otherwise the terminators hold it high
+static void benchBusUpdate(void)
+{
+	uint8_t port = avr->data[config[MRBUS_BENCH_CFG_BUS_PORT]];
+	uint8_t ddr = avr->data[config[MRBUS_BENCH_CFG_BUS_DDR]];
+	uint8_t level = 1;
+
+	if ((port & (1 << config[MRBUS_BENCH_CFG_BUS_TXE])) && (ddr & (1 << config[MRBUS_BENCH_CFG_BUS_TX]))
+		&& !(port & (1 << config[MRBUS_BENCH_CFG_BUS_TX])))
+		level = 0;
+
+	if (level != busLevel)
+	{
+		uint16_t pin = config[MRBUS_BENCH_CFG_BUS_PIN];
+		uint8_t rxBit = 1 << config[MRBUS_BENCH_CFG_BUS_RX];
+		avr->data[pin] = level ? (avr->data[pin] | rxBit) : (avr->data[pin] & ~rxBit);
+		busLevel = level;
+	}
+}
+
+static int benchCompare(const char* baselineFile, double margin)
+{
+	char line[256], name[64];
+	unsigned long count, best, worst, avg, stack;
+	int i, failed = 0;
+	FILE* f = fopen(baselineFile, "r");
+
+	if (NULL == f)
+	{
+		fprintf(stderr, "Can't open baseline %s\n", baselineFile);
+		return(1);
+	}
+
+	while (NULL != fgets(line, sizeof(line), f))
+	{
+		if (6 != sscanf(line, "%63[^,],%lu,%lu,%lu,%lu,%lu", name, &count, &best, &worst, &avg, &stack))
+			continue;
+
+		for (i=0; i<MRBUS_BENCH_SECTIONS; i++)
+		{
+			if (0 != strcmp(name, benchNames[i]) || MRBUS_BENCH_OVERHEAD == i)
+				continue;
+
+			if (0 == stats[i].count)
+			{
+				fprintf(stderr, "REGRESSION %s: no samples (baseline had %lu)\n", name, count);
+				failed = 1;
+			}
+			else if (stats[i].worst > worst * (1.0 + margin / 100.0))
+			{
+				fprintf(stderr, "REGRESSION %s: worst %u cycles, baseline %lu (+%.1f%% allowed)\n", name, stats[i].worst, worst, margin);
+				failed = 1;
+			}
+			if (stats[i].stack > stack)
+			{
+				fprintf(stderr, "REGRESSION %s: stack %u bytes, baseline %lu\n", name, stats[i].stack, stack);
+				failed = 1;
+			}
+		}
+	}
+
+	fclose(f);
+	return(failed);
+}
+
+static void usage(const char* prog)
+{
+	fprintf(stderr, "Usage: %s -m mcu [-f freq] [-o results.csv] [-b baseline.csv] [-t margin%%] firmware.elf\n", prog);
+	exit(2);
+}
+
+int main(int argc, char* argv[])
+{
+	elf_firmware_t fw;
+	const char* mcu = NULL;
+	const char* outFile = NULL;
+	const char* baselineFile = NULL;
+	unsigned long freq = 16000000;
+	double margin = 2.0;
+	uint32_t overhead;
+	int state, opt, i, uartReady = 0;
+	FILE* out;
+
+	while (-1 != (opt = getopt(argc, argv, "m:f:o:b:t:")))
+	{
+		switch(opt)
+		{
+			case 'm': mcu = optarg; break;
+			case 'f': freq = strtoul(optarg, NULL, 0); break;
+			case 'o': outFile = optarg; break;
+			case 'b': baselineFile = optarg; break;
+			case 't': margin = atof(optarg); break;
+			default: usage(argv[0]);
+		}
+	}
+	if (NULL == mcu || optind != argc - 1)
+		usage(argv[0]);
+
+	memset(&fw, 0, sizeof(fw));
+	if (0 != elf_read_firmware(argv[optind], &fw))
+	{
+		fprintf(stderr, "Can't load %s\n", argv[optind]);
+		return(2);
+	}
+
+	if (NULL == (avr = avr_make_mcu_by_name(mcu)))
+	{
+		fprintf(stderr, "simavr doesn't know the %s\n", mcu);
+		return(2);
+	}
+	avr_init(avr);
+	avr->frequency = freq;
+	avr_load_firmware(avr, &fw);
+
+	avr_register_io_write(avr, MRBUS_BENCH_REG_CMD, benchCmdWrite, NULL);
+	avr_register_io_write(avr, MRBUS_BENCH_REG_ARG, benchArgWrite, NULL);
+	avr_register_io_write(avr, MRBUS_BENCH_REG_DATA, benchDataWrite, NULL);
+
+	do
+	{
+		uint32_t pc = avr->pc;
+		uint16_t sp;
+		int isReti;
+
+		// The firmware sends its configuration before enabling interrupts or the UART
+		if (!uartReady && avr->sreg[S_I])
+		{
+			benchUartSetup();
+			competeEnabled = configSet[MRBUS_BENCH_CFG_COMPETE_FLAG] && configSet[MRBUS_BENCH_CFG_COMPETE_BIT];
+			uartReady = 1;
+		}
+
+		for (i=0; i<MRBUS_BENCH_SECTIONS && isrDepth < BENCH_MAX_NEST; i++)
+		{
+			if (0 != isrAddr[i] && pc == isrAddr[i])
+			{
+				if (MRBUS_BENCH_COMPETE_ISR == i && competeRaisedCycle)
+				{
+					benchRecord(MRBUS_BENCH_COMPETE_LAT, avr->cycle - competeRaisedCycle, 0);
+					competeRaisedCycle = 0;
+				}
+				isrStack[isrDepth].section = i;
+				isrStack[isrDepth].entryCycle = avr->cycle;
+				isrStack[isrDepth].entrySp = isrStack[isrDepth].minSp = benchSp();
+				isrDepth++;
+				break;
+			}
+		}
+
+		isReti = (0x9518 == (avr->flash[pc] | (avr->flash[pc+1] << 8)));
+
+		state = avr_run(avr);
+
+		sp = benchSp();
+		if (isrDepth)
+		{
+			BenchIsrFrame* frame = &isrStack[isrDepth-1];
+			if (sp < frame->minSp)
+				frame->minSp = sp;
+
+			if (isReti && sp > frame->entrySp)
+			{
+				uint64_t cycles = avr->cycle - frame->entryCycle;
+				// Return address was already on the stack when we saw the entry
+				benchRecord(frame->section, cycles, frame->entrySp - frame->minSp + (sp - frame->entrySp));
+				isrDepth--;
+				if (0 == isrDepth)
+					isrCycles += cycles;
+				else if (frame->minSp < isrStack[isrDepth-1].minSp)
+					isrStack[isrDepth-1].minSp = frame->minSp;
+			}
+		}
+		else if (sectionActive >= 0 && sp < sectionMinSp)
+			sectionMinSp = sp;
+
+		if (busEnabled)
+			benchBusUpdate();
+
+		// The flag is cleared in hardware as the vector is taken
+		if (competeEnabled)
+		{
+			uint8_t raised = avr->data[config[MRBUS_BENCH_CFG_COMPETE_FLAG]] & (1 << config[MRBUS_BENCH_CFG_COMPETE_BIT]);
+			if (raised && !competeRaised)
+				competeRaisedCycle = avr->cycle;
+			competeRaised = raised;
+		}
+
+		if (avr->cycle > (uint64_t)freq * BENCH_MAX_SECONDS)
+		{
+			fprintf(stderr, "Firmware didn't finish within %d simulated seconds\n", BENCH_MAX_SECONDS);
+			return(2);
+		}
+	} while (cpu_Done != state && cpu_Crashed != state);
+
+	if (cpu_Crashed == state || !benchDone)
+	{
+		fprintf(stderr, "Firmware crashed at PC 0x%04x\n", avr->pc);
+		return(2);
+	}
+
+	// The START/STOP pair itself costs a few cycles, measured by the empty overhead section
+	overhead = stats[MRBUS_BENCH_OVERHEAD].count ? stats[MRBUS_BENCH_OVERHEAD].best : 0;
+
+	out = (NULL != outFile) ? fopen(outFile, "w") : stdout;
+	if (NULL == out)
+	{
+		fprintf(stderr, "Can't write %s\n", outFile);
+		return(2);
+	}
+
+	fprintf(out, "section,count,best,worst,avg,stack\n");
+	for (i=0; i<MRBUS_BENCH_SECTIONS; i++)
+	{
+		BenchStats* s = &stats[i];
+		uint32_t adjust = (0 != isrAddr[i] || MRBUS_BENCH_OVERHEAD == i || MRBUS_BENCH_COMPETE_LAT == i) ? 0 : overhead;
+
+		if (0 == s->count)
+			continue;
+		fprintf(out, "%s,%u,%u,%u,%u,%u\n", benchNames[i], s->count, s->best - adjust, s->worst - adjust,
+			(uint32_t)(s->total / s->count) - adjust, s->stack);
+		if (out != stdout)
+			printf("%-12s %6u samples  best %6u  worst %6u  avg %6u cycles  stack %3u bytes\n", benchNames[i], s->count,
+				s->best - adjust, s->worst - adjust, (uint32_t)(s->total / s->count) - adjust, s->stack);
+	}
+	if (out != stdout)
+		fclose(out);
+
+	if (benchFailed || (NULL != baselineFile && benchCompare(baselineFile, margin)))
+		return(1);
+
+	return(0);
+}
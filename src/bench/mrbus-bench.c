@@ -0,0 +1,428 @@
+// MRBus benchmark firmware
+// Exercises the hot paths of either the wired (default) or XBee (MRBUS_BENCH_MRBEE) driver under
+// simavr - see mrbus-bench-sim.c for how the timing and stack numbers are taken.  Nothing here
+// measures anything itself, it just marks sections and generates traffic.
+
+#include <stdlib.h>
+#include <string.h>
+#include <avr/sleep.h>
+
+#ifdef MRBUS_BENCH_MRBEE
+#include "mrbee.h"
+#else
+#include "mrbus.h"
+#endif
+#include "mrbus-bench.h"
+
+#define MRBUS_BENCH_CMD   _SFR_MEM8(MRBUS_BENCH_REG_CMD)
+#define MRBUS_BENCH_ARG   _SFR_MEM8(MRBUS_BENCH_REG_ARG)
+#define MRBUS_BENCH_DATA  _SFR_MEM8(MRBUS_BENCH_REG_DATA)
+
+#define benchStart(section) do { MRBUS_BENCH_ARG = (section); MRBUS_BENCH_CMD = MRBUS_BENCH_CMD_START; } while(0)
+#define benchStop(section)  do { MRBUS_BENCH_ARG = (section); MRBUS_BENCH_CMD = MRBUS_BENCH_CMD_STOP; } while(0)
+
+#define BENCH_ADDR        0x03
+#define BENCH_OTHER_ADDR  0x42
+#define BENCH_QUEUE_LEN   4
+// The competing ISR fires every ~37.5uS, which doesn't line up with the 20uS arbitration slots
+#define BENCH_COMPETE_TICKS  (F_CPU / 26667)
+
+#ifdef MRBUS_BENCH_MRBEE
+
+#define benchRxQueue      mrbeeRxQueue
+#define benchTxQueue      mrbeeTxQueue
+#define benchUartData     MRBEE_UART_DATA
+#define benchInit()       mrbeeInit()
+#define benchTransmit()   mrbeeTransmit()
+#define benchTxActive()   mrbeeTxActive()
+// 115200 baud is ~87uS per byte
+#define BENCH_BYTE_US     100
+
+void MRBEE_UART_RX_INTERRUPT(void);
+void MRBEE_UART_TX_INTERRUPT(void);
+
+#else
+
+#if MRBUS_WAIT_TYPE == 1
+#error "The benchmark firmware doesn't provide the application 50kHz clock MRBUS_WAIT_TYPE 1 needs"
+#endif
+
+#define benchRxQueue      mrbusRxQueue
+#define benchTxQueue      mrbusTxQueue
+#define benchUartData     MRBUS_UART_DATA
+#define benchInit()       mrbusInit()
+#define benchTransmit()   mrbusTransmit()
+#define benchTxActive()   mrbusTxActive()
+// 57600 baud is ~174uS per byte
+#define BENCH_BYTE_US     200
+
+void MRBUS_UART_RX_INTERRUPT(void);
+void MRBUS_UART_TX_INTERRUPT(void);
+void MRBUS_UART_DONE_INTERRUPT(void);
+#if MRBUS_WAIT_TYPE == 2
+void MRBUS_TIMER_INTERRUPT(void);
+#endif
+
+#endif
+
+MRBusPacket benchRxBuffer[BENCH_QUEUE_LEN];
+MRBusPacket benchTxBuffer[BENCH_QUEUE_LEN];
+MRBusPacket benchQueueBuffer[BENCH_QUEUE_LEN];
+MRBusPktQueue benchQueue;
+volatile uint8_t benchCompeteCount;
+
+// Stands in for the application's own interrupts (encoders, a 50kHz tick, servo PWM) - the runner
+// times how long each one waits from its flag being raised to its first instruction
+ISR(TIMER1_COMPA_vect)
+{
+	benchCompeteCount++;
+}
+
+static void benchData(uint16_t data)
+{
+	MRBUS_BENCH_DATA = data >> 8;
+	MRBUS_BENCH_DATA = data;
+}
+
+static void benchConfig(uint8_t key, uint16_t value)
+{
+	benchData(value);
+	MRBUS_BENCH_ARG = key;
+	MRBUS_BENCH_CMD = MRBUS_BENCH_CMD_CONFIG;
+}
+
+static void benchIsr(uint8_t section, void (*isr)(void))
+{
+	benchData((uint16_t)isr);
+	MRBUS_BENCH_ARG = section;
+	MRBUS_BENCH_CMD = MRBUS_BENCH_CMD_ISR;
+}
+
+static void benchInject(uint8_t data)
+{
+	MRBUS_BENCH_DATA = data;
+	MRBUS_BENCH_CMD = MRBUS_BENCH_CMD_INJECT;
+}
+
+static void benchWaitBytes(uint8_t bytes)
+{
+	// Enough time for everything injected to trickle through the UART at the bus baud rate
+	while(bytes--)
+		_delay_us(BENCH_BYTE_US);
+}
+
+// Builds a packet with a valid CRC and varied contents
+static void benchBuildPkt(uint8_t* pkt, uint8_t dest, uint8_t src, uint8_t len, uint8_t seed)
+{
+	uint8_t i;
+	uint16_t crc16 = 0;
+
+	pkt[MRBUS_PKT_DEST] = dest;
+	pkt[MRBUS_PKT_SRC] = src;
+	pkt[MRBUS_PKT_LEN] = len;
+	pkt[MRBUS_PKT_TYPE] = 'A' + (seed & 0x0F);
+	for (i=MRBUS_PKT_TYPE+1; i<len; i++)
+		pkt[i] = seed + (i * 37);
+
+	for (i=0; i<len; i++)
+	{
+		if ((i != MRBUS_PKT_CRC_H) && (i != MRBUS_PKT_CRC_L))
+			crc16 = mrbusCRC16Update(crc16, pkt[i]);
+	}
+	pkt[MRBUS_PKT_CRC_L] = (crc16 & 0xFF);
+	pkt[MRBUS_PKT_CRC_H] = ((crc16 >> 8) & 0xFF);
+}
+
+static void benchDrainRx(void)
+{
+	uint8_t pkt[MRBUS_BUFFER_SIZE];
+	while (!mrbusPktQueueEmpty(&benchRxQueue))
+		mrbusPktQueuePop(&benchRxQueue, pkt, sizeof(pkt));
+}
+
+#ifdef MRBUS_BENCH_MRBEE
+static uint8_t benchInjectEscaped(uint8_t data)
+{
+	switch(data)
+	{
+		case 0x7E:
+		case 0x7D:
+		case 0x11:
+		case 0x13:
+			benchInject(0x7D);
+			benchInject(0x20 ^ data);
+			return(2);
+
+		default:
+			benchInject(data);
+			return(1);
+	}
+}
+
+// Wraps the packet in an XBee 16 bit address receive frame, the way the radio would deliver it
+static void benchInjectPkt(uint8_t* pkt, uint8_t len)
+{
+	uint8_t hdr[7] = { 0x00, len + 5, 0x81, 0x00, pkt[MRBUS_PKT_SRC], 0x28, 0x00 };
+	uint8_t i, sent = 1, checksum = 0;
+
+	benchInject(0x7E);
+	for (i=0; i<sizeof(hdr); i++)
+	{
+		if (i >= 2)
+			checksum += hdr[i];
+		sent += benchInjectEscaped(hdr[i]);
+	}
+	for (i=0; i<len; i++)
+	{
+		checksum += pkt[i];
+		sent += benchInjectEscaped(pkt[i]);
+	}
+	sent += benchInjectEscaped(0xFF - checksum);
+	benchWaitBytes(sent + 2);
+}
+#else
+static void benchInjectPkt(uint8_t* pkt, uint8_t len)
+{
+	uint8_t i;
+	for (i=0; i<len; i++)
+		benchInject(pkt[i]);
+	benchWaitBytes(len + 2);
+}
+#endif
+
+static void benchSetup(void)
+{
+	uint8_t uart = '0';
+
+#ifdef UDR1
+	if (&benchUartData == &UDR1)
+		uart = '1';
+#endif
+	benchConfig(MRBUS_BENCH_CFG_UART, uart);
+
+#ifdef MRBUS_BENCH_MRBEE
+	benchIsr(MRBUS_BENCH_RX_ISR, MRBEE_UART_RX_INTERRUPT);
+	benchIsr(MRBUS_BENCH_TX_ISR, MRBEE_UART_TX_INTERRUPT);
+#else
+	// The RS485 transceiver echoes everything we send, and drives the bus during arbitration
+	benchConfig(MRBUS_BENCH_CFG_LOOPBACK, 1);
+	benchConfig(MRBUS_BENCH_CFG_BUS_PORT, (uint16_t)&MRBUS_PORT);
+	benchConfig(MRBUS_BENCH_CFG_BUS_DDR, (uint16_t)&MRBUS_DDR);
+	benchConfig(MRBUS_BENCH_CFG_BUS_PIN, (uint16_t)&MRBUS_PIN);
+	benchConfig(MRBUS_BENCH_CFG_BUS_TX, MRBUS_TX);
+	benchConfig(MRBUS_BENCH_CFG_BUS_TXE, MRBUS_TXE);
+	benchConfig(MRBUS_BENCH_CFG_BUS_RX, MRBUS_RX);
+
+	benchIsr(MRBUS_BENCH_RX_ISR, MRBUS_UART_RX_INTERRUPT);
+	benchIsr(MRBUS_BENCH_TX_ISR, MRBUS_UART_TX_INTERRUPT);
+	benchIsr(MRBUS_BENCH_DONE_ISR, MRBUS_UART_DONE_INTERRUPT);
+#if MRBUS_WAIT_TYPE == 2
+	benchIsr(MRBUS_BENCH_TIMER_ISR, MRBUS_TIMER_INTERRUPT);
+#endif
+#endif
+
+	benchConfig(MRBUS_BENCH_CFG_COMPETE_FLAG, (uint16_t)&TIFR1);
+	benchConfig(MRBUS_BENCH_CFG_COMPETE_BIT, OCF1A);
+	benchIsr(MRBUS_BENCH_COMPETE_ISR, TIMER1_COMPA_vect);
+}
+
+// Timer 1 in CTC mode, no prescaler, isn't used by either driver
+static void benchCompeteStart(void)
+{
+	TCCR1A = 0;
+	TCCR1B = 0;
+	TCNT1 = 0;
+	OCR1A = BENCH_COMPETE_TICKS - 1;
+	TIFR1 = _BV(OCF1A);
+	TIMSK1 = _BV(OCIE1A);
+	TCCR1B = _BV(WGM12) | _BV(CS10);
+}
+
+static void benchCompeteStop(void)
+{
+	TCCR1B = 0;
+	TIMSK1 = 0;
+}
+
+static void benchOverhead(void)
+{
+	uint8_t i;
+	for (i=0; i<16; i++)
+	{
+		benchStart(MRBUS_BENCH_OVERHEAD);
+		benchStop(MRBUS_BENCH_OVERHEAD);
+	}
+}
+
+// MRBus CRC16 a bit at a time, MSB first, polynomial 0xA001 - slow, but obviously right
+static uint16_t benchCrcReference(uint16_t crc, uint8_t a)
+{
+	uint8_t bit;
+
+	crc ^= (uint16_t)a << 8;
+	for (bit=0; bit<8; bit++)
+		crc = (crc & 0x8000) ? (crc << 1) ^ 0xA001 : (crc << 1);
+	return(crc);
+}
+
+// The engine this firmware was built with (MRBUS_CRC_TYPE) has to agree with the reference over a
+// long pseudo-random stream, which walks the CRC through plenty of states.  This is the only place
+// the AVR assembly engine can be checked.
+static void benchCrcCheck(void)
+{
+	uint16_t crc = 0, ref = 0, seed = 1, n;
+	uint8_t a;
+
+	for (n=0; n<4096; n++)
+	{
+		seed = seed * 25173 + 13849;
+		a = seed >> 8;
+		crc = mrbusCRC16Update(crc, a);
+		ref = benchCrcReference(ref, a);
+		if (crc != ref)
+		{
+			MRBUS_BENCH_ARG = MRBUS_BENCH_CRC_VALID;
+			MRBUS_BENCH_CMD = MRBUS_BENCH_CMD_FAIL;
+			return;
+		}
+	}
+}
+
+static void benchCrc(void)
+{
+	uint8_t pkt[MRBUS_BUFFER_SIZE];
+	uint8_t len, seed;
+
+	for (seed=0; seed<4; seed++)
+	{
+		for (len=MRBUS_PKT_TYPE+1; len<=MRBUS_BUFFER_SIZE; len++)
+		{
+			benchBuildPkt(pkt, BENCH_ADDR, BENCH_OTHER_ADDR, len, seed);
+			// Every other one is corrupt, which can exit early
+			if (seed & 0x01)
+				pkt[len-1] ^= 0x01;
+			benchStart(MRBUS_BENCH_CRC_VALID);
+			mrbusIsCrcValid(pkt);
+			benchStop(MRBUS_BENCH_CRC_VALID);
+		}
+	}
+}
+
+static void benchQueueOps(void)
+{
+	uint8_t pkt[MRBUS_BUFFER_SIZE];
+	uint8_t len, i;
+
+	mrbusPktQueueInitialize(&benchQueue, benchQueueBuffer, BENCH_QUEUE_LEN);
+
+	// Fill past full and drain past empty, with changing lengths so the queue walks around
+	// and variable length backends see every alignment
+	for (len=MRBUS_PKT_TYPE+1; len<=MRBUS_BUFFER_SIZE; len++)
+	{
+		benchBuildPkt(pkt, BENCH_ADDR, BENCH_OTHER_ADDR, len, len);
+		for (i=0; i<BENCH_QUEUE_LEN+1; i++)
+		{
+			benchStart(MRBUS_BENCH_QUEUE_PUSH);
+			mrbusPktQueuePush(&benchQueue, pkt, len);
+			benchStop(MRBUS_BENCH_QUEUE_PUSH);
+		}
+		for (i=0; i<BENCH_QUEUE_LEN+1; i++)
+		{
+			benchStart(MRBUS_BENCH_QUEUE_POP);
+			mrbusPktQueuePop(&benchQueue, pkt, sizeof(pkt));
+			benchStop(MRBUS_BENCH_QUEUE_POP);
+		}
+	}
+}
+
+// Pops whatever arrived and, for the wired driver, runs it through the packet handler - the packet
+// types are 'A' to 'D', so pings get a reply built and the rest are left to the application
+static void benchHandleRx(void)
+{
+#ifdef MRBUS_BENCH_MRBEE
+	benchDrainRx();
+#else
+	uint8_t pkt[MRBUS_BUFFER_SIZE], reply[MRBUS_BUFFER_SIZE];
+
+	while (!mrbusPktQueueEmpty(&benchRxQueue))
+	{
+		mrbusPktQueuePop(&benchRxQueue, pkt, sizeof(pkt));
+		benchStart(MRBUS_BENCH_PKT_HANDLER);
+		mrbusPktHandler(pkt, reply, BENCH_ADDR);
+		benchStop(MRBUS_BENCH_PKT_HANDLER);
+	}
+#endif
+}
+
+static void benchReceive(void)
+{
+	uint8_t pkt[MRBUS_BUFFER_SIZE];
+	uint8_t len, seed;
+	const uint8_t dests[4] = { BENCH_ADDR, 0xFF, BENCH_OTHER_ADDR, BENCH_ADDR };
+
+	// ISR timing is picked up by the runner whenever they fire, so all we do is supply traffic -
+	// to us, broadcast, to someone else and, for every fourth packet, with a bad CRC
+	for (seed=0; seed<4; seed++)
+	{
+		for (len=MRBUS_PKT_TYPE+1; len<=MRBUS_BUFFER_SIZE; len++)
+		{
+			benchBuildPkt(pkt, dests[seed], BENCH_OTHER_ADDR, len, seed);
+			if (3 == seed)
+				pkt[MRBUS_PKT_CRC_L] ^= 0x01;
+			benchInjectPkt(pkt, len);
+			benchHandleRx();
+		}
+	}
+}
+
+static void benchTransmitOps(void)
+{
+	uint8_t pkt[MRBUS_BUFFER_SIZE];
+	uint8_t len, tries;
+
+	// The competing ISR runs all through transmit, where the driver may hold interrupts off
+	// for arbitration (compare builds with make bench-arb)
+	benchCompeteStart();
+	for (len=MRBUS_PKT_TYPE+1; len<=MRBUS_BUFFER_SIZE; len+=2)
+	{
+		benchBuildPkt(pkt, 0xFF, BENCH_ADDR, len, len);
+		mrbusPktQueuePush(&benchTxQueue, pkt, len);
+
+		for (tries=0; tries<10 && !mrbusPktQueueEmpty(&benchTxQueue); tries++)
+		{
+			benchStart(MRBUS_BENCH_TRANSMIT);
+			benchTransmit();
+			benchStop(MRBUS_BENCH_TRANSMIT);
+
+			// Let arbitration (for MRBUS_WAIT_TYPE 2) and the transmit ISRs finish
+			while (benchTxActive());
+			benchWaitBytes(2);
+		}
+		benchDrainRx();
+	}
+	benchCompeteStop();
+}
+
+int main(void)
+{
+	cli();
+	mrbusPktQueueInitialize(&benchRxQueue, benchRxBuffer, BENCH_QUEUE_LEN);
+	mrbusPktQueueInitialize(&benchTxQueue, benchTxBuffer, BENCH_QUEUE_LEN);
+	benchSetup();
+	benchInit();
+	sei();
+
+	benchOverhead();
+	benchCrcCheck();
+	benchCrc();
+	benchQueueOps();
+	benchReceive();
+	benchTransmitOps();
+
+	// Sleeping with interrupts off ends the simulation
+	MRBUS_BENCH_CMD = MRBUS_BENCH_CMD_DONE;
+	cli();
+	sleep_enable();
+	sleep_cpu();
+	return(0);
+}
@@ -0,0 +1,51 @@
+#ifndef MRBUS_BENCH_H
+#define MRBUS_BENCH_H
+
+// Shared between the benchmark firmware (mrbus-bench.c) and the simavr runner (mrbus-bench-sim.c)
+// The firmware talks to the runner through three general purpose I/O registers, which live at
+// the same data addresses on every part we benchmark (GPIOR0/1/2 on the ATmega328P and 1284P).
+// A write is one cycle, so marking the start and end of a section costs almost nothing and the
+// runner calibrates the remainder out with an empty section.
+
+#define MRBUS_BENCH_REG_CMD   0x3E   // GPIOR0 - command, written last
+#define MRBUS_BENCH_REG_ARG   0x4A   // GPIOR1 - section or config key
+#define MRBUS_BENCH_REG_DATA  0x4B   // GPIOR2 - data, shifted in MSB first
+
+#define MRBUS_BENCH_CMD_START   1   // Start timing section ARG
+#define MRBUS_BENCH_CMD_STOP    2   // Stop timing section ARG
+#define MRBUS_BENCH_CMD_ISR     3   // ISR for section ARG starts at word address DATA
+#define MRBUS_BENCH_CMD_CONFIG  4   // Set config key ARG to DATA
+#define MRBUS_BENCH_CMD_INJECT  5   // Feed DATA into the UART receiver
+#define MRBUS_BENCH_CMD_DONE    6   // All done - report and exit
+#define MRBUS_BENCH_CMD_FAIL    7   // A self check in section ARG failed - the run fails
+
+// Sections - functions are timed from START to STOP, less any time spent in benchmarked ISRs
+// ISRs are timed from their first instruction through the reti, whenever they run
+#define MRBUS_BENCH_OVERHEAD    0
+#define MRBUS_BENCH_CRC_VALID   1
+#define MRBUS_BENCH_QUEUE_PUSH  2
+#define MRBUS_BENCH_QUEUE_POP   3
+#define MRBUS_BENCH_TRANSMIT    4
+#define MRBUS_BENCH_RX_ISR      5
+#define MRBUS_BENCH_TX_ISR      6
+#define MRBUS_BENCH_DONE_ISR    7
+#define MRBUS_BENCH_TIMER_ISR   8
+#define MRBUS_BENCH_PKT_HANDLER 9
+#define MRBUS_BENCH_COMPETE_ISR 10  // Stand-in for an application ISR, fired throughout transmit
+#define MRBUS_BENCH_COMPETE_LAT 11  // Its latency - flag raised to first instruction, not an ISR itself
+#define MRBUS_BENCH_SECTIONS    12
+
+// Config keys - the bus keys turn on the RS485 transceiver model for wired MRBus arbitration
+#define MRBUS_BENCH_CFG_UART       0   // UART number as a character, '0' or '1'
+#define MRBUS_BENCH_CFG_LOOPBACK   1   // Nonzero to echo UART output back into its input
+#define MRBUS_BENCH_CFG_BUS_PORT   2   // Data address of the PORT register with TX/TXE/RX
+#define MRBUS_BENCH_CFG_BUS_DDR    3   // Data address of the matching DDR register
+#define MRBUS_BENCH_CFG_BUS_PIN    4   // Data address of the matching PIN register
+#define MRBUS_BENCH_CFG_BUS_TX     5   // TX bit number
+#define MRBUS_BENCH_CFG_BUS_TXE    6   // TXE bit number
+#define MRBUS_BENCH_CFG_BUS_RX     7   // RX bit number
+#define MRBUS_BENCH_CFG_COMPETE_FLAG 8 // Data address of the competing ISR's interrupt flag register
+#define MRBUS_BENCH_CFG_COMPETE_BIT  9 // Its flag bit number
+#define MRBUS_BENCH_CFG_KEYS       10
+
+#endif
@@ -1,15 +1,21 @@
 #include <stdlib.h>
 #include <string.h>
-#include <avr/io.h>
-#include <avr/interrupt.h>
-#include <util/delay.h>
-#include <util/atomic.h>
-#include <avr/wdt.h>
 
 #include "mrbee.h"
 
+// Longest packet the XBee can carry - its RF payload is at most 100 bytes
+#define MRBEE_PKT_MAX  min(MRBUS_BUFFER_SIZE, 100)
+
+// API frames carry the packet after at most 14 bytes of header, with a checksum after it.
+// Escaping can double everything after the start byte on the way out.  Extended frames grow
+// the buffers to suit.
+#if MRBUS_BUFFER_SIZE > MRBUS_BUFFER_SIZE_STANDARD
+#define MRBEE_UART_TX_BUFFER_SIZE  (1 + 2 * (8 + MRBEE_PKT_MAX + 1))
+#define MRBEE_UART_RX_BUFFER_SIZE  (14 + MRBEE_PKT_MAX + 2)
+#else
 #define MRBEE_UART_TX_BUFFER_SIZE  64
 #define MRBEE_UART_RX_BUFFER_SIZE  64
+#endif
 
 //static volatile uint8_t mrbeeActivity;
 
@@ -37,6 +43,8 @@ ISR(MRBEE_UART_RX_INTERRUPT)
 	if (MRBEE_UART_SCR_A & MRBEE_RX_ERR_MASK)
 	{
 		// Handle framing errors - these are likely arbitration bytes
+		if (mrbeeRxIndex)
+			mrbusStatsInc(rxFrameErrors);
 		mrbeeRxIndex = MRBEE_UART_DATA;
 		mrbeeRxIndex = 0; // Reset receive buffer
 		rxFlags = 0;
@@ -77,6 +85,7 @@ ISR(MRBEE_UART_RX_INTERRUPT)
 			else
 			{
 				// Overflow, reset everything and go back to not processing pkt
+				mrbusStatsInc(rxOverlong);
 				rxFlags &= ~(RX_ISR_PROCESSING_PKT);
 				mrbeeRxIndex = 0;
 				memset(mrbeeRxBuffer, 0, sizeof(mrbeeRxBuffer));
@@ -107,7 +116,11 @@ ISR(MRBEE_UART_RX_INTERRUPT)
 							// Intentional fall-through
 						case 0x81: // 16 bit addressing frame
 							// 0xFF is a passing checksum, load packet into mrbeeRxQueue
-							mrbeePktQueuePush(&mrbeeRxQueue, mrbeeRxBuffer + mrbeeRxIndex, min(mrbeeRxBuffer[mrbeeRxIndex + MRBUS_PKT_LEN], MRBUS_BUFFER_SIZE), mrbeeRxBuffer[mrbeeRxIndex-2]);
+							mrbusStatsInc(rxPkts);
+							if (mrbeeRxBuffer[mrbeeRxIndex + MRBUS_PKT_LEN] > MRBUS_BUFFER_SIZE)
+								mrbusStatsInc(rxOverlong);
+							if (!mrbeePktQueuePush(&mrbeeRxQueue, mrbeeRxBuffer + mrbeeRxIndex, min(mrbeeRxBuffer[mrbeeRxIndex + MRBUS_PKT_LEN], MRBUS_BUFFER_SIZE), mrbeeRxBuffer[mrbeeRxIndex-2]))
+								mrbusStatsInc(rxQueueFull);
 							mrbeeRssi = mrbeeRxBuffer[mrbeeRxIndex-2];
 							break;
 
@@ -115,6 +128,8 @@ ISR(MRBEE_UART_RX_INTERRUPT)
 					}
 				
 				}
+				else
+					mrbusStatsInc(rxBadChecksum);
 
 				rxFlags &= ~(RX_ISR_PROCESSING_PKT);
 				memset(mrbeeRxBuffer, 0, sizeof(mrbeeRxBuffer));
@@ -142,11 +157,17 @@ ISR(MRBEE_UART_TX_INTERRUPT)
 	}
 }
 
-void mrbusSetPriority(uint8_t priority)
+void mrbeeSetPriority(uint8_t priority)
 {
 	return;
 }
 
+// Old name, kept so MRBee firmware written against the wired API still links
+void mrbusSetPriority(uint8_t priority)
+{
+	mrbeeSetPriority(priority);
+}
+
 //#ifndef MRBEE_BAUD
 #define MRBEE_BAUD 115000
 //#endif
@@ -155,6 +176,10 @@ void mrbusSetPriority(uint8_t priority)
 void mrbeeInit(void)
 {
 	mrbeeRssi = 255;
+#ifdef MRBUS_STATS
+	mrbusStats.rxQueue = &mrbeeRxQueue;
+	mrbusStats.txQueue = &mrbeeTxQueue;
+#endif
 	
 	MRBEE_DDR |= _BV(MRBEE_RTS);
 	MRBEE_PORT &= ~_BV(MRBEE_RTS);
@@ -169,11 +194,19 @@ void mrbeeInit(void)
 	mrbeeTxIndex = 0;
 	memset((uint8_t*)mrbeeTxBuffer, 0, sizeof(mrbeeTxBuffer));
 
+#ifdef __AVR__
 #undef BAUD
 #define BAUD MRBEE_BAUD
 #include <util/setbaud.h>
+#endif
 
-#if defined( MRBEE_AT90_UART )
+#if defined( MRBEE_HOST_UART )
+	MRBEE_UART_UBRR = 0;
+	MRBEE_UART_SCR_A = 0;
+	MRBEE_UART_SCR_B = 0;
+	MRBEE_UART_SCR_C = 0;
+
+#elif defined( MRBEE_AT90_UART )
 	// FIXME - probably need more stuff here
 	UBRR = (uint8_t)UBRRL_VALUE;
 
@@ -268,7 +301,8 @@ uint8_t mrbeeTransmit(void)
 	// If we have no packet length, or it's less than the header, just silently say we transmitted it
 	// On the AVRs, if you don't have any packet length, it'll never clear up on the interrupt routine
 	// and you'll get stuck in indefinite transmit busy
-	if (mrbusPktLen < MRBUS_PKT_TYPE)
+	// Same for one too long for the XBee to send
+	if (mrbusPktLen < MRBUS_PKT_TYPE || mrbusPktLen > MRBEE_PKT_MAX)
 	{
 		mrbusPktQueueDrop(&mrbeeTxQueue);
 		return(0);
@@ -315,7 +349,12 @@ uint8_t mrbeeTransmit(void)
 	}
 
 	mrbeeTxIndex = 0;
+#ifdef MRBUS_LATENCY
+	// No arbitration here - the XBee takes it from us straight away
+	mrbusLatencyRecord(mrbusStats.txQueueWait, mrbusHalTicks() - mrbusPktQueueFront(&mrbeeTxQueue)->timestamp);
+#endif
 	mrbusPktQueueDrop(&mrbeeTxQueue);
+	mrbusStatsInc(txPkts);
 	// Enable transmit interrupt
 	MRBEE_UART_SCR_B |= _BV(MRBEE_UART_UDRIE);
 
@@ -0,0 +1,54 @@
+#ifndef MRBEE_HOST_H
+#define MRBEE_HOST_H
+
+// Host (non-AVR) register model for the XBee UART - see mrbus-host.h
+
+#define MRBEE_HOST_UART
+#define MRBEE_UART_RX_INTERRUPT    mrbeeHostUartRxIsr
+#define MRBEE_UART_TX_INTERRUPT    mrbeeHostUartTxIsr
+#define MRBEE_PORT                 mrbeeHostPort
+#define MRBEE_PIN                  mrbeeHostPin
+#define MRBEE_DDR                  mrbeeHostDdr
+
+#ifndef MRBEE_CTS
+#define MRBEE_CTS                  3
+#endif
+#ifndef MRBEE_RTS
+#define MRBEE_RTS                  2
+#endif
+#ifndef MRBEE_TX
+#define MRBEE_TX                   1
+#endif
+#ifndef MRBEE_RX
+#define MRBEE_RX                   0
+#endif
+
+#define MRBEE_UART_UBRR            mrbeeHostUartUbrr
+#define MRBEE_UART_SCR_A           mrbeeHostUartScrA
+#define MRBEE_UART_SCR_B           mrbeeHostUartScrB
+#define MRBEE_UART_SCR_C           mrbeeHostUartScrC
+#define MRBEE_UART_DATA            mrbeeHostUartData
+#define MRBEE_UART_UDRIE           5
+#define MRBEE_RXEN                 4
+#define MRBEE_TXEN                 3
+#define MRBEE_RXCIE                7
+#define MRBEE_TXCIE                6
+#define MRBEE_TXC                  6
+#define MRBEE_RX_ERR_MASK          (_BV(4) | _BV(3))
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+extern volatile uint8_t mrbeeHostPort, mrbeeHostPin, mrbeeHostDdr;
+extern volatile uint8_t mrbeeHostUartScrA, mrbeeHostUartScrB, mrbeeHostUartScrC, mrbeeHostUartData;
+extern volatile uint16_t mrbeeHostUartUbrr;
+
+void mrbeeHostUartRxIsr(void);
+void mrbeeHostUartTxIsr(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // MRBEE_HOST_H
@@ -28,16 +28,18 @@ LICENSE:
 #define MRBEE_H
 
 
-#ifdef __AVR__
 #include <stdlib.h>
-#include <avr/io.h>
-#include <avr/interrupt.h>
-#include <util/delay.h>
-#include <util/atomic.h>
+#include "mrbus-hal.h"
 #include "mrbus-constants.h"
 #include "mrbus-queue.h"
+#include "mrbus-stats.h"
+#include "mrbus-eeprom.h"
+#include "mrbus-reliable.h"
 #include "mrbus-macros.h"
+#ifdef __AVR__
 #include "mrbee-avr.h"
+#else
+#include "mrbee-host.h"
 #endif
 
 // Global variable externs, so everybody can see the public mrbus variabes
@@ -48,12 +50,12 @@ extern MRBusPktQueue mrbeeTxQueue;
 extern "C" {
 #endif
 
-#ifdef __AVR__
 uint16_t mrbusCRC16Update(uint16_t crc, uint8_t a);
-#endif
+uint8_t mrbusIsCrcValid(uint8_t* pktBuffer);
 
 void mrbeeInit(void);
 void mrbeeSetPriority(uint8_t priority);
+void mrbusSetPriority(uint8_t priority);  // Same as mrbeeSetPriority()
 uint8_t mrbeeTxActive();
 uint8_t mrbeeTransmit(void);
 uint8_t mrbeeIsBusIdle();
@@ -1,22 +1,163 @@
 #include <stdlib.h>
-#include <avr/io.h>
-#include <avr/interrupt.h>
-#include <util/delay.h>
-#include <util/atomic.h>
+#include <string.h>
 
 #include "mrbus.h"
 
 static volatile uint8_t mrbusActivity;
-// While mrbuxRxBuffer is volatile, it's only accessed within the ISR
-static uint8_t mrbusRxBuffer[MRBUS_BUFFER_SIZE];
+// Incoming packets are assembled directly in a reserved mrbusRxQueue slot, only accessed within the ISR
+// NULL if the queue was full when the packet started - the bytes are then counted but not stored
+static MRBusPacket* mrbusRxPkt;
+static uint8_t mrbusRxLen;
 static volatile uint8_t mrbusRxIndex=0;
+#ifdef MRBUS_STATS
+// The RX queue was full when the current packet started
+static uint8_t mrbusRxFull;
+#endif
+#ifdef MRBUS_RX_ISR_CRC
+// Running CRC of the packet being received, only touched by the RX ISR once running
+static uint16_t mrbusRxCrc16=0;
+#endif
 static volatile uint8_t mrbusTxBuffer[MRBUS_BUFFER_SIZE];
 static volatile uint8_t mrbusTxIndex=0;
 static uint8_t mrbusLoneliness;
 static uint8_t mrbusPriority;
+// Arbitration priority of the packet in mrbusTxBuffer
+static uint8_t mrbusTxPriority;
+#ifdef MRBUS_LATENCY
+// When the packet in mrbusTxBuffer first tried for the bus
+static uint16_t mrbusTxStartTicks;
+#endif
+#if MRBUS_TX_LANES > 1
+// Lane the packet in mrbusTxBuffer came from - it stays queued there until it's won the bus
+static uint8_t mrbusTxLaneNum;
+static uint8_t mrbusTxLanePriority[MRBUS_TX_LANES - 1];
+static uint8_t mrbusTxLaneOptions[MRBUS_TX_LANES - 1];
+#endif
+#ifdef MRBUS_ADAPTIVE_BACKOFF
+// Adaptive backoff - only changes how long we wait before arbitrating, so it mixes freely with
+// nodes using the fixed formula.  mrbusArbHistory holds the last 8 transmit attempts, newest in
+// bit 0, set if we lost the bus or saw another node's packet since the previous attempt.
+// On a quiet bus a node that just sent doesn't need to yield, so loneliness goes straight to 0.
+// Once there's contention it yields as usual, and the address nibble tie-break is replaced by a
+// per-node pseudo-random one so high nibbles don't always lose among nodes that have run their
+// loneliness down.  Nodes above default priority never yield, so their wait never exceeds that of
+// a default priority node that has already given up all of its loneliness.
+static uint8_t mrbusArbHistory;
+static uint8_t mrbusBusActivity;
+static uint8_t mrbusBackoffSeed;
+static uint8_t mrbusRxSrc;
+#endif
 
 MRBusPktQueue mrbusRxQueue;
 MRBusPktQueue mrbusTxQueue;
+#if MRBUS_TX_LANES > 1
+MRBusPktQueue mrbusTxLaneQueue[MRBUS_TX_LANES - 1];
+#endif
+
+#ifdef MRBUS_RX_FILTER
+MRBusRxFilter mrbusRxFilter;
+#endif
+
+#ifdef MRBUS_FAST_BAUD
+// Data phase rate - only the UART changes, arbitration is bit-banged at 4800 baud either way.
+// A new rate waits until nothing is going out, so our own packet is never split across two.
+static volatile uint8_t mrbusDataRate;
+static volatile uint8_t mrbusDataRateNext;
+
+#ifdef __AVR__
+#undef BAUD
+#define BAUD MRBUS_BAUD
+#include <util/setbaud.h>
+static const uint16_t mrbusUbrrStandard = UBRR_VALUE;
+static const uint8_t mrbusU2xStandard = USE_2X;
+#undef BAUD
+#define BAUD MRBUS_FAST_BAUD
+#include <util/setbaud.h>
+static const uint16_t mrbusUbrrFast = UBRR_VALUE;
+static const uint8_t mrbusU2xFast = USE_2X;
+#undef BAUD
+#endif
+
+// Interrupts must be off, and the UART not transmitting
+static void mrbusDataRateApply(void)
+{
+	uint8_t fast = (MRBUS_DATA_RATE_STANDARD != mrbusDataRateNext);
+
+	mrbusDataRate = mrbusDataRateNext;
+#if defined( MRBUS_HOST_UART )
+	mrbusHostUartBaud = fast ? MRBUS_FAST_BAUD : MRBUS_BAUD;
+#else
+#if defined( MRBUS_UART_UBRRH )
+	MRBUS_UART_UBRRH = 0x0F & ((fast ? mrbusUbrrFast : mrbusUbrrStandard) >> 8);
+	MRBUS_UART_UBRRL = 0xFF & (fast ? mrbusUbrrFast : mrbusUbrrStandard);
+#else
+	MRBUS_UART_UBRR = fast ? mrbusUbrrFast : mrbusUbrrStandard;
+#endif
+	if (fast ? mrbusU2xFast : mrbusU2xStandard)
+		MRBUS_UART_SCR_A |= _BV(MRBUS_UART_U2X);
+	else
+		MRBUS_UART_SCR_A &= ~_BV(MRBUS_UART_U2X);
+#endif
+}
+#endif
+
+#ifdef MRBUS_RX_STATE
+MRBusRxState mrbusRxState;
+// State table packets are assembled here and only copied into the table once complete, so the
+// application never sees a partial packet.  The header is always kept here too, since we can't
+// tell where a packet belongs until its type arrives.
+static MRBusPacket mrbusRxStatePkt;
+#define mrbusRxStateTaken() (&mrbusRxStatePkt == mrbusRxPkt)
+#else
+#define mrbusRxStateTaken() 0
+#endif
+
+#ifdef MRBUS_RX_FILTER
+// The state table can't claim a packet before its type arrives, so with it the address stage waits
+// for the type too - otherwise packets the table goes on to accept would be counted as drops
+#ifdef MRBUS_RX_STATE
+#define MRBUS_RX_FILTER_ADDR_INDEX  MRBUS_PKT_TYPE
+#else
+#define MRBUS_RX_FILTER_ADDR_INDEX  MRBUS_PKT_SRC
+#endif
+#endif
+
+// Called whenever we lose the bus - to activity during the 2ms wait, in the backoff or in arbitration
+static void mrbusBackoffLost(void)
+{
+#ifdef MRBUS_ADAPTIVE_BACKOFF
+	mrbusArbHistory = (mrbusArbHistory << 1) | 0x01;
+	mrbusBusActivity = 0;
+#endif
+	mrbusStatsInc(txArbLost);
+	if (mrbusLoneliness)
+		mrbusLoneliness--;
+}
+
+// Called once a packet is on the wire
+static void mrbusBackoffSent(void)
+{
+#ifdef MRBUS_ADAPTIVE_BACKOFF
+	mrbusArbHistory = (mrbusArbHistory << 1) | (mrbusBusActivity ? 0x01 : 0x00);
+	mrbusBusActivity = 0;
+	mrbusLoneliness = (mrbusArbHistory && mrbusTxPriority >= MRBUS_PRIORITY_DEFAULT) ? 6 : 0;
+#else
+	mrbusLoneliness = 6;
+#endif
+}
+
+// Number of 20uS slots to wait after the 2ms idle time before arbitrating
+static uint8_t mrbusBackoffSlots(uint8_t src)
+{
+#ifdef MRBUS_ADAPTIVE_BACKOFF
+	if (mrbusArbHistory)
+	{
+		mrbusBackoffSeed = mrbusBackoffSeed * 109 + (src | 0x01);
+		return(((mrbusLoneliness + mrbusTxPriority) * 5) + (((mrbusBackoffSeed >> 4) ^ src ^ (src >> 4)) & 0x0F) + 22);
+	}
+#endif
+	return(((mrbusLoneliness + mrbusTxPriority) * 5) + (src & 0x0F) + 22);
+}
 
 #if MRBUS_WAIT_TYPE == 0
 // MRBUS_WAIT_TYPE == 0 is the standard way, using delay loops
@@ -53,10 +194,230 @@ void mrbusWait20uS(uint16_t waitUnits)
 
 #elif MRBUS_WAIT_TYPE == 2
 // MRBUS_WAIT_TYPE == 2 uses TMR2 controlled by MRBus
-// FIXME:  Somebody should implement this
+// mrbusTransmit() only starts arbitration - the 2ms pre-wait, the priority backoff and each
+// arbitration bit are stepped through by a 50kHz timer interrupt, so the caller never blocks.
+// Poll mrbusArbStatus(), or define MRBUS_ARB_CALLBACK and provide mrbusArbComplete(status).
+// Global interrupts are never held off for more than one short timer ISR.  Define MRBUS_ARB_NOBLOCK
+// to also re-enable them inside the timer ISR once its pin I/O is done.
+
+#define MRBUS_ARB_STATE_IDLE      0
+#define MRBUS_ARB_STATE_PREWAIT   1
+#define MRBUS_ARB_STATE_BACKOFF   2
+#define MRBUS_ARB_STATE_BITS      3
+
+#ifdef MRBUS_ARB_CALLBACK
+extern void mrbusArbComplete(uint8_t status);
+#endif
+
+static volatile uint8_t mrbusArbState = MRBUS_ARB_STATE_IDLE;
+static volatile uint8_t mrbusArbResult = MRBUS_ARB_IDLE;
+// Everything below is only touched by the timer ISR once arbitration has started
+static uint8_t mrbusArbCount;     // 20uS ticks left in the pre-wait or backoff
+static uint8_t mrbusArbBackoff;   // Backoff length, computed by mrbusTransmit()
+static uint8_t mrbusArbSlice;     // 20uS slice within the current arbitration bit
+static uint8_t mrbusArbBitNum;    // Arbitration bit being sent
+static uint8_t mrbusArbSample;    // Sticky RX sample for the current bit
+static uint8_t mrbusArbDrive;     // Whether TXE is driven during the next slice
+static uint16_t mrbusArbBits;     // Arbitration bits left to send, LSB first
+
+static void mrbusArbStart(uint8_t address, uint8_t backoff)
+{
+	// Start bit (0), address LSB first, then two stop bits (1)
+	mrbusArbBits = ((uint16_t)address << 1) | (0x03 << 9);
+	mrbusArbBackoff = backoff;
+	mrbusArbCount = 100; // 2ms pre-wait
+	mrbusArbDrive = 0;
+	mrbusArbResult = MRBUS_ARB_ACTIVE;
+	mrbusArbState = MRBUS_ARB_STATE_PREWAIT;
+
+	MRBUS_TIMER_COUNT = 0;
+	MRBUS_TIMER_IMSK |= _BV(MRBUS_TIMER_OCIE);
+	MRBUS_TIMER_SCR_B = MRBUS_TIMER_CLK_DIV8;
+}
+
+// Only called from the timer ISR
+static void mrbusArbFinish(uint8_t result)
+{
+	MRBUS_TIMER_SCR_B = 0;
+	MRBUS_TIMER_IMSK &= ~_BV(MRBUS_TIMER_OCIE);
+
+	if (MRBUS_ARB_LOST == result)
+	{
+		MRBUS_PORT &= ~_BV(MRBUS_TXE);
+		MRBUS_DDR &= ~_BV(MRBUS_TX);
+		mrbusBackoffLost();
+	}
+
+	mrbusArbState = MRBUS_ARB_STATE_IDLE;
+	mrbusArbResult = result;
+#ifdef MRBUS_ARB_CALLBACK
+	mrbusArbComplete(result);
+#endif
+}
+
+#if MRBUS_TX_LANES > 1
+// Abandon arbitration that hasn't started driving the bus yet, so a more urgent packet can take
+// its place.  Not counted as a loss - the abandoned packet is still at the front of its lane.
+// Returns 1 if arbitration was abandoned.
+static uint8_t mrbusArbAbort(void)
+{
+	uint8_t aborted = 0;
+
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+	{
+		if (MRBUS_ARB_STATE_PREWAIT == mrbusArbState || MRBUS_ARB_STATE_BACKOFF == mrbusArbState)
+		{
+			MRBUS_TIMER_SCR_B = 0;
+			MRBUS_TIMER_IMSK &= ~_BV(MRBUS_TIMER_OCIE);
+			MRBUS_DDR &= ~_BV(MRBUS_TX);
+			mrbusArbState = MRBUS_ARB_STATE_IDLE;
+			mrbusArbResult = MRBUS_ARB_IDLE;
+			aborted = 1;
+		}
+	}
+	return(aborted);
+}
+#endif
+
+ISR(MRBUS_TIMER_INTERRUPT)
+{
+	uint8_t rxHigh;
+
+	// All pin I/O happens first, at a fixed offset from the compare match no matter which way
+	// the state machine goes below, so the hardware timer alone sets the slot timing
+	if (MRBUS_ARB_STATE_BITS == mrbusArbState)
+	{
+		if (mrbusArbDrive)
+			MRBUS_PORT |= _BV(MRBUS_TXE);
+		else
+			MRBUS_PORT &= ~_BV(MRBUS_TXE);
+	}
+	rxHigh = MRBUS_PIN & _BV(MRBUS_RX);
+
+#ifdef MRBUS_ARB_NOBLOCK
+	// Only the pin I/O needs to be exact - let other interrupts in for the bookkeeping.
+	// Our own compare interrupt stays masked so a late tick can't re-enter us.
+	MRBUS_TIMER_IMSK &= ~_BV(MRBUS_TIMER_OCIE);
+	sei();
+#endif
+
+	switch(mrbusArbState)
+	{
+		case MRBUS_ARB_STATE_PREWAIT:
+			// Any activity - we may have a packet to receive
+			// Application is responsible for waiting 10ms or for successful receive
+			if (mrbusActivity)
+			{
+				mrbusArbFinish(MRBUS_ARB_LOST);
+				break;
+			}
+			if (--mrbusArbCount)
+				break;
+
+			// Clear driver enable to prevent transmitting and set TX pin low
+			MRBUS_PORT &= ~(_BV(MRBUS_TXE) | _BV(MRBUS_TX));  
+			// Set TX as an output
+			MRBUS_DDR |= _BV(MRBUS_TX);     
+			//  Disable transmitter
+			MRBUS_UART_SCR_B &= ~_BV(MRBUS_TXEN);
+			// Be sure to reset RX index - see the note in the blocking version of mrbusTransmit()
+			mrbusRxIndex = 0;
+#ifdef MRBUS_RX_ISR_CRC
+			mrbusRxCrc16 = 0;
+#endif
+			mrbusArbCount = mrbusArbBackoff;
+			mrbusArbState = MRBUS_ARB_STATE_BACKOFF;
+			break;
+
+		case MRBUS_ARB_STATE_BACKOFF:
+			if (!rxHigh)
+			{
+				mrbusArbFinish(MRBUS_ARB_LOST);
+				break;
+			}
+			if (--mrbusArbCount)
+				break;
+			mrbusArbSlice = 0;
+			mrbusArbBitNum = 0;
+			mrbusArbState = MRBUS_ARB_STATE_BITS;
+			// Start bit goes out right away
+			mrbusArbDrive = 1;
+			MRBUS_PORT |= _BV(MRBUS_TXE);
+			// Intentional fall-through
+
+		case MRBUS_ARB_STATE_BITS:
+			// Arbitration Sequence - 4800 bps, 10 slices of 20uS per bit
+			if (0 == mrbusArbSlice)
+			{
+				if (11 == mrbusArbBitNum)
+				{
+					// Won arbitration - control over bus is assumed
+					mrbusTxIndex = 0;
+					/* Set TX back to input */
+					MRBUS_DDR &= ~_BV(MRBUS_TX);
+					/* Enable transmitter */
+					MRBUS_UART_SCR_B |= _BV(MRBUS_TXEN);
+					MRBUS_UART_SCR_A |= _BV(MRBUS_TXC);
+					MRBUS_PORT |= _BV(MRBUS_TXE);
+#ifdef MRBUS_DISABLE_LOOPBACK
+					// Disable receive interrupt while transmitting
+					MRBUS_UART_SCR_B &= ~_BV(MRBUS_RXCIE);
+#endif
+					// Enable transmit interrupt
+					MRBUS_UART_SCR_B |= _BV(MRBUS_UART_UDRIE);
+					mrbusPktQueueDrop(mrbusTxLane(mrbusTxLaneNum));
+#ifdef MRBUS_LATENCY
+					mrbusLatencyRecord(mrbusStats.txArbTime, mrbusHalTicks() - mrbusTxStartTicks);
+#endif
+					mrbusArbFinish(MRBUS_ARB_WON);
+					break;
+				}
+
+				// TXE for this bit was already set on the way in
+				mrbusArbSample = 0;
+			}
+			else if (mrbusArbSlice > 2)
+			{
+				if (rxHigh)
+					mrbusArbSample = 1;
+				if (mrbusArbSample ^ (mrbusArbBits & 0x01))
+				{
+					mrbusArbFinish(MRBUS_ARB_LOST);
+					break;
+				}
+			}
+
+			if (++mrbusArbSlice >= 10)
+			{
+				mrbusArbSlice = 0;
+				mrbusArbBitNum++;
+				mrbusArbBits >>= 1;
+				// 0 bits drive the bus, 1 bits release it.  Nothing is driven after the last
+				// stop bit - TX has to go back to an input before TXE comes back on.
+				mrbusArbDrive = (mrbusArbBitNum < 11) && !(mrbusArbBits & 0x01);
+			}
+			break;
 
+		default:
+			mrbusArbFinish(MRBUS_ARB_IDLE);
+			break;
+	}
+
+#ifdef MRBUS_ARB_NOBLOCK
+	cli();
+	if (MRBUS_ARB_STATE_IDLE != mrbusArbState)
+		MRBUS_TIMER_IMSK |= _BV(MRBUS_TIMER_OCIE);
 #endif
+}
 
+uint8_t mrbusArbStatus(void)
+{
+	return(mrbusArbResult);
+}
+
+#endif
+
+#if MRBUS_WAIT_TYPE != 2
 uint8_t mrbusArbBitSend(uint8_t bitval)
 {
 	uint8_t slice;
@@ -96,33 +457,182 @@ uint8_t mrbusArbBitSend(uint8_t bitval)
 	}
 	return(0);
 }
+#endif
 
 
 ISR(MRBUS_UART_RX_INTERRUPT)
 {
+	uint8_t data;
+
 	//Receive Routine
 	mrbusActivity = MRBUS_ACTIVITY_RX;
 
 	if (MRBUS_UART_SCR_A & MRBUS_RX_ERR_MASK)
 	{
 		// Handle framing errors - these are likely arbitration bytes
+		// Any partial packet is abandoned in its slot, which is reserved again for the next one
+		if (mrbusRxIndex)
+			mrbusStatsInc(rxFrameErrors);
+		mrbusPktQueueAbort(&mrbusRxQueue);
 		mrbusRxIndex = MRBUS_UART_DATA;
 		mrbusRxIndex = 0; // Reset receive buffer
+#ifdef MRBUS_RX_ISR_CRC
+		mrbusRxCrc16 = 0;
+#endif
 	}
 	else
 	{
-		mrbusRxBuffer[mrbusRxIndex++] = MRBUS_UART_DATA;
+		data = MRBUS_UART_DATA;
+
+		if (0 == mrbusRxIndex)
+		{
+			mrbusRxPkt = mrbusPktQueueReserve(&mrbusRxQueue);
+#ifdef MRBUS_STATS
+			mrbusRxFull = (NULL == mrbusRxPkt);
+#endif
+		}
+		else if (MRBUS_PKT_LEN == mrbusRxIndex)
+		{
+			mrbusRxLen = data;
+			if (data > MRBUS_BUFFER_SIZE)
+				mrbusStatsInc(rxOverlong);
+		}
+
+#ifdef MRBUS_RX_ISR_CRC
+		// Fold each byte into the CRC as it arrives, skipping the CRC bytes themselves
+		if ((mrbusRxIndex != MRBUS_PKT_CRC_L) && (mrbusRxIndex != MRBUS_PKT_CRC_H))
+			mrbusRxCrc16 = mrbusCRC16Update(mrbusRxCrc16, data);
+#endif
+
+#ifdef MRBUS_RX_STATE
+		if (mrbusRxIndex < MRBUS_PKT_TYPE)
+			mrbusRxStatePkt.pkt[mrbusRxIndex] = data;
+		else if ((MRBUS_PKT_TYPE == mrbusRxIndex)
+			&& (mrbusRxState.typeMask[data >> 3] & _BV(data & 0x07))
+			&& ((uint8_t)(mrbusRxStatePkt.pkt[MRBUS_PKT_SRC] - mrbusRxState.firstSrc) < mrbusRxState.count))
+		{
+			// Status packet for the table - the RX filter doesn't apply, and any queue slot
+			// reserved for it is abandoned
+			mrbusPktQueueAbort(&mrbusRxQueue);
+			mrbusRxPkt = &mrbusRxStatePkt;
+		}
+#endif
 
-		if (mrbusRxIndex > 5 && mrbusRxIndex == mrbusRxBuffer[MRBUS_PKT_LEN])
+#ifdef MRBUS_RX_FILTER
+		// Decide as soon as the header bytes that matter are in - a rejected packet is then
+		// received into nowhere, just like when the queue is full
+		if ((NULL != mrbusRxPkt) && !mrbusRxStateTaken() && (mrbusRxFilter.options & MRBUS_RX_FILTER_ENABLE))
+		{
+			if (MRBUS_RX_FILTER_ADDR_INDEX == mrbusRxIndex)
+			{
+				uint8_t dest = mrbusRxPkt->pkt[MRBUS_PKT_DEST];
+				uint8_t src = (MRBUS_PKT_SRC == mrbusRxIndex)?data:mrbusRxPkt->pkt[MRBUS_PKT_SRC];
+				if ((src == mrbusRxFilter.addr) && !(mrbusRxFilter.options & MRBUS_RX_FILTER_OWN_PKTS))
+				{
+					mrbusRxFilter.dropOwnPkts++;
+					mrbusPktQueueAbort(&mrbusRxQueue);
+					mrbusRxPkt = NULL;
+				}
+				else if (!((dest == mrbusRxFilter.addr)
+					|| ((0xFF == dest) && (mrbusRxFilter.options & MRBUS_RX_FILTER_BROADCAST))
+					|| (mrbusRxFilter.srcMask[src >> 3] & _BV(src & 0x07))))
+				{
+					mrbusRxFilter.dropAddress++;
+					mrbusPktQueueAbort(&mrbusRxQueue);
+					mrbusRxPkt = NULL;
+				}
+			}
+			if ((NULL != mrbusRxPkt) && (MRBUS_PKT_TYPE == mrbusRxIndex) && !(mrbusRxFilter.typeMask[data >> 3] & _BV(data & 0x07)))
+			{
+				mrbusRxFilter.dropType++;
+				mrbusPktQueueAbort(&mrbusRxQueue);
+				mrbusRxPkt = NULL;
+			}
+		}
+#endif
+
+#ifdef MRBUS_ADAPTIVE_BACKOFF
+		if (MRBUS_PKT_SRC == mrbusRxIndex)
+			mrbusRxSrc = data;
+#endif
+
+		// On the off chance we just keep receiving stuff, stop storing at the end of the buffer to prevent overflow
+		if (mrbusRxIndex < MRBUS_BUFFER_SIZE)
+		{
+			if (NULL != mrbusRxPkt)
+				mrbusRxPkt->pkt[mrbusRxIndex] = data;
+			mrbusRxIndex++;
+		}
+
+		if (mrbusRxIndex > 5 && mrbusRxIndex == mrbusRxLen)
 		{
 			mrbusRxIndex = 0;
-			mrbusPktQueuePush(&mrbusRxQueue, mrbusRxBuffer, min(mrbusRxBuffer[MRBUS_PKT_LEN], MRBUS_BUFFER_SIZE));
+			mrbusStatsInc(rxPkts);
+#ifdef MRBUS_STATS
+			if (NULL == mrbusRxPkt && mrbusRxFull)
+				mrbusStats.rxQueueFull++;
+#endif
+#ifdef MRBUS_RX_STATE
+			if (&mrbusRxStatePkt == mrbusRxPkt)
+			{
+#ifdef MRBUS_RX_ISR_CRC
+				if ((UINT16_LOW_BYTE(mrbusRxCrc16) == mrbusRxStatePkt.pkt[MRBUS_PKT_CRC_L]) && (UINT16_HIGH_BYTE(mrbusRxCrc16) == mrbusRxStatePkt.pkt[MRBUS_PKT_CRC_H]))
+#endif
+				{
+					uint8_t entry = mrbusRxStatePkt.pkt[MRBUS_PKT_SRC] - mrbusRxState.firstSrc;
+					MRBusPacket* statePkt = &mrbusRxState.table[entry];
+
+					memcpy(statePkt->pkt, mrbusRxStatePkt.pkt, min(mrbusRxLen, MRBUS_BUFFER_SIZE));
+					statePkt->rssi = 0;
+#ifdef MRBUS_RX_ISR_CRC
+					statePkt->flags = MRBUS_PKT_FLAG_CRC_VALID;
+#else
+					statePkt->flags = 0;
+#endif
+					if (mrbusRxState.dirty[entry >> 3] & _BV(entry & 0x07))
+						mrbusRxState.overwrites++;
+					mrbusRxState.dirty[entry >> 3] |= _BV(entry & 0x07);
+					mrbusRxState.updates++;
+				}
+#ifdef MRBUS_RX_ISR_CRC
+				else
+					mrbusStatsInc(rxCrcErrors);
+#endif
+				mrbusRxPkt = NULL;
+			}
+#endif
+			if (NULL != mrbusRxPkt)
+			{
+#ifdef MRBUS_RX_ISR_CRC
+				// Corrupt packets never take a queue slot
+				if ((UINT16_LOW_BYTE(mrbusRxCrc16) == mrbusRxPkt->pkt[MRBUS_PKT_CRC_L]) && (UINT16_HIGH_BYTE(mrbusRxCrc16) == mrbusRxPkt->pkt[MRBUS_PKT_CRC_H]))
+				{
+					mrbusRxPkt->rssi = 0;
+					mrbusRxPkt->flags = MRBUS_PKT_FLAG_CRC_VALID;
+					mrbusPktQueueCommit(&mrbusRxQueue);
+				}
+				else
+				{
+					mrbusStatsInc(rxCrcErrors);
+					mrbusPktQueueAbort(&mrbusRxQueue);
+				}
+#else
+				mrbusRxPkt->rssi = 0;
+				mrbusRxPkt->flags = 0;
+				mrbusPktQueueCommit(&mrbusRxQueue);
+#endif
+				mrbusRxPkt = NULL;
+			}
+#ifdef MRBUS_RX_ISR_CRC
+			mrbusRxCrc16 = 0;
+#endif
+#ifdef MRBUS_ADAPTIVE_BACKOFF
+			// Someone else's packet, not our own echo
+			if (mrbusRxSrc != mrbusTxBuffer[MRBUS_PKT_SRC])
+				mrbusBusActivity = 1;
+#endif
 			mrbusActivity = MRBUS_ACTIVITY_IDLE;
 		}
-		else if (mrbusRxIndex > MRBUS_BUFFER_SIZE)
-		// On the off chance we just keep receiving stuff, decrement the buffer to prevent overflow
-			mrbusRxIndex--;
-
 	}
 }
 
@@ -133,7 +643,12 @@ ISR(MRBUS_UART_DONE_INTERRUPT)
 	// Disable the various transmit interrupts and the transmitter itself
 	// Re-enable receive interrupt (might be killed if no loopback define is on...)
 	MRBUS_UART_SCR_B = (MRBUS_UART_SCR_B & ~(_BV(MRBUS_TXCIE) | _BV(MRBUS_TXEN) | _BV(MRBUS_UART_UDRIE))) | _BV(MRBUS_RXCIE);
-	mrbusLoneliness = 6;
+	mrbusStatsInc(txPkts);
+	mrbusBackoffSent();
+#ifdef MRBUS_FAST_BAUD
+	if (mrbusDataRateNext != mrbusDataRate)
+		mrbusDataRateApply();
+#endif
 }
 
 
@@ -155,12 +670,158 @@ ISR(MRBUS_UART_TX_INTERRUPT)
 	}
 }
 
+#ifdef MRBUS_FAST_BAUD
+// Switches the data phase to MRBUS_DATA_RATE_STANDARD (MRBUS_BAUD) or MRBUS_DATA_RATE_FAST
+// (MRBUS_FAST_BAUD) - straight away if we're not sending, otherwise once the packet is out.
+// Normally called when mrbusPktHandler() returns MRBUS_HANDLER_DATA_RATE.  Anything in flight
+// on the bus at the moment of the switch is lost.
+void mrbusSetDataRate(uint8_t rate)
+{
+	if (MRBUS_DATA_RATE_STANDARD != rate && MRBUS_DATA_RATE_FAST != rate)
+		return;
+
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+	{
+		mrbusDataRateNext = rate;
+		if (!mrbusTxActive())
+			mrbusDataRateApply();
+	}
+}
+
+uint8_t mrbusGetDataRate(void)
+{
+	return(mrbusDataRate);
+}
+#endif
+
 void mrbusSetPriority(uint8_t priority)
 {
 	if (priority < 12)
 		mrbusPriority = priority;
 }
 
+#if MRBUS_TX_LANES > 1
+// Lane 0 (mrbusTxQueue) always uses the node priority from mrbusSetPriority()
+void mrbusTxLaneInit(uint8_t lane, uint8_t priority, uint8_t options)
+{
+	if (0 == lane || lane >= MRBUS_TX_LANES || priority >= 12)
+		return;
+	mrbusTxLanePriority[lane - 1] = priority;
+	mrbusTxLaneOptions[lane - 1] = options;
+}
+#endif
+
+#ifdef MRBUS_RX_FILTER
+void mrbusRxFilterInit(uint8_t mrbus_dev_addr, uint8_t options)
+{
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+	{
+		mrbusRxFilter.addr = mrbus_dev_addr;
+		mrbusRxFilter.options = options | MRBUS_RX_FILTER_ENABLE;
+		memset(mrbusRxFilter.srcMask, 0, sizeof(mrbusRxFilter.srcMask));
+		memset(mrbusRxFilter.typeMask, 0xFF, sizeof(mrbusRxFilter.typeMask));
+		mrbusRxFilter.dropOwnPkts = 0;
+		mrbusRxFilter.dropAddress = 0;
+		mrbusRxFilter.dropType = 0;
+	}
+}
+
+void mrbusRxFilterSource(uint8_t src, uint8_t enable)
+{
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+	{
+		if (enable)
+			mrbusRxFilter.srcMask[src >> 3] |= _BV(src & 0x07);
+		else
+			mrbusRxFilter.srcMask[src >> 3] &= ~_BV(src & 0x07);
+	}
+}
+
+void mrbusRxFilterType(uint8_t type, uint8_t enable)
+{
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+	{
+		if (enable)
+			mrbusRxFilter.typeMask[type >> 3] |= _BV(type & 0x07);
+		else
+			mrbusRxFilter.typeMask[type >> 3] &= ~_BV(type & 0x07);
+	}
+}
+#endif
+
+#ifdef MRBUS_RX_STATE
+// table must hold count packets - one for each source from firstSrc up
+// No types go to the table until enabled with mrbusRxStateType()
+void mrbusRxStateInit(MRBusPacket* table, uint8_t firstSrc, uint8_t count)
+{
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+	{
+		mrbusRxState.table = table;
+		mrbusRxState.firstSrc = firstSrc;
+		mrbusRxState.count = count;
+		mrbusRxState.next = 0;
+		memset(mrbusRxState.typeMask, 0, sizeof(mrbusRxState.typeMask));
+		memset(mrbusRxState.dirty, 0, sizeof(mrbusRxState.dirty));
+		mrbusRxState.updates = 0;
+		mrbusRxState.overwrites = 0;
+		memset(table, 0, (uint16_t)count * sizeof(MRBusPacket));
+	}
+}
+
+void mrbusRxStateType(uint8_t type, uint8_t enable)
+{
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+	{
+		if (enable)
+			mrbusRxState.typeMask[type >> 3] |= _BV(type & 0x07);
+		else
+			mrbusRxState.typeMask[type >> 3] &= ~_BV(type & 0x07);
+	}
+}
+
+// Copies out the next changed entry and marks it read - returns 0 once nothing has changed
+// The walk carries on from the last entry returned, so a chatty node can't starve the rest,
+// and skips 8 clean entries at a time.
+uint8_t mrbusRxStatePop(uint8_t* data, uint8_t dataLen)
+{
+	uint8_t entry = mrbusRxState.next;
+	uint8_t left = mrbusRxState.count;
+	uint8_t found = 0;
+
+	memset(data, 0, dataLen);
+
+	while (left && !found)
+	{
+		if (0 == (entry & 0x07) && 0 == mrbusRxState.dirty[entry >> 3])
+		{
+			uint8_t skip = min(8, mrbusRxState.count - entry);
+			left = (left > skip) ? left - skip : 0;
+			entry += skip;
+		}
+		else
+		{
+			if (mrbusRxState.dirty[entry >> 3] & _BV(entry & 0x07))
+			{
+				ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+				{
+					MRBusPacket* statePkt = &mrbusRxState.table[entry];
+					memcpy(data, statePkt->pkt, min(dataLen, statePkt->pkt[MRBUS_PKT_LEN]));
+					mrbusRxState.dirty[entry >> 3] &= ~_BV(entry & 0x07);
+				}
+				found = 1;
+			}
+			left--;
+			entry++;
+		}
+		if (entry >= mrbusRxState.count)
+			entry = 0;
+	}
+
+	mrbusRxState.next = entry;
+	return(found);
+}
+#endif
+
 void mrbusInit(void)
 {
 	MRBUS_DDR |= _BV(MRBUS_TXE);
@@ -170,13 +831,41 @@ void mrbusInit(void)
 	mrbusTxIndex = 0;
 	mrbusActivity = MRBUS_ACTIVITY_IDLE;
 	mrbusLoneliness = 6;
-	mrbusPriority = 6;
+	mrbusPriority = MRBUS_PRIORITY_DEFAULT;
+#ifdef MRBUS_STATS
+	mrbusStats.rxQueue = &mrbusRxQueue;
+	mrbusStats.txQueue = &mrbusTxQueue;
+#endif
+#if MRBUS_TX_LANES > 1
+	// Extra lanes default to top priority, no preemption
+	memset(mrbusTxLanePriority, 0, sizeof(mrbusTxLanePriority));
+	memset(mrbusTxLaneOptions, 0, sizeof(mrbusTxLaneOptions));
+	mrbusTxLaneNum = 0;
+#endif
+
+#if MRBUS_WAIT_TYPE == 2
+	// 50kHz CTC tick, only clocked while arbitrating
+	MRBUS_TIMER_SCR_B = 0;
+	MRBUS_TIMER_SCR_A = MRBUS_TIMER_CTC;
+	MRBUS_TIMER_OCR = (F_CPU / 8 / 50000) - 1;
+	mrbusArbState = MRBUS_ARB_STATE_IDLE;
+	mrbusArbResult = MRBUS_ARB_IDLE;
+#endif
 
+#ifdef __AVR__
 #undef BAUD
 #define BAUD MRBUS_BAUD
 #include <util/setbaud.h>
+#endif
+
+#if defined( MRBUS_HOST_UART )
+	MRBUS_UART_UBRR = 0;
+	mrbusHostUartBaud = MRBUS_BAUD;
+	MRBUS_UART_SCR_A = 0;
+	MRBUS_UART_SCR_B = 0;
+	MRBUS_UART_SCR_C = 0;
 
-#if defined( MRBUS_AT90_UART )
+#elif defined( MRBUS_AT90_UART )
 	// FIXME - probably need more stuff here
 	UBRR = (uint8_t)UBRRL_VALUE;
 
@@ -219,6 +908,10 @@ void mrbusInit(void)
 
 #undef BAUD
 
+#ifdef MRBUS_FAST_BAUD
+	mrbusDataRate = mrbusDataRateNext = MRBUS_DATA_RATE_STANDARD;
+#endif
+
 	/* Enable USART receiver and transmitter and receive complete interrupt */
 	MRBUS_UART_SCR_B = _BV(MRBUS_RXCIE) | _BV(MRBUS_RXEN) | _BV(MRBUS_TXEN);
 
@@ -226,6 +919,10 @@ void mrbusInit(void)
 
 uint8_t mrbusTxActive() 
 {
+#if MRBUS_WAIT_TYPE == 2
+	if (MRBUS_ARB_STATE_IDLE != mrbusArbState)
+		return(1);
+#endif
 	return(MRBUS_UART_SCR_B & (_BV(MRBUS_UART_UDRIE) | _BV(MRBUS_TXCIE)));
 }
 
@@ -235,24 +932,65 @@ uint8_t mrbusTransmit(void)
 	uint8_t address;
 	uint8_t i;
 	uint16_t crc16 = 0x0000;
+	uint8_t lane = MRBUS_TX_LANES - 1;
+#ifdef MRBUS_LATENCY
+	MRBusPacket* txPkt;
+#endif
+
+#ifdef MRBUS_FAST_BAUD
+	// A rate switch held up by an arbitration we then lost is still waiting
+	if (mrbusDataRateNext != mrbusDataRate)
+		mrbusSetDataRate(mrbusDataRateNext);
+#endif
+
+	// Find the highest non-empty lane
+	while (lane && mrbusPktQueueEmpty(mrbusTxLane(lane)))
+		lane--;
 
-	if (mrbusPktQueueEmpty(&mrbusTxQueue))
+	if (mrbusPktQueueEmpty(mrbusTxLane(lane)))
 		return(0);
 
 	//  Return if bus already active.
 	if (mrbusTxActive())
-		return(1);
+	{
+#if (MRBUS_TX_LANES > 1) && (MRBUS_WAIT_TYPE == 2)
+		// A preempting lane can take over from a less urgent packet that's still waiting to arbitrate
+		if (!(lane > mrbusTxLaneNum && (mrbusTxLaneOptions[lane - 1] & MRBUS_TX_LANE_PREEMPT) && mrbusArbAbort()))
+#endif
+			return(1);
+	}
 
-	mrbusPktQueuePeek(&mrbusTxQueue, (uint8_t*)mrbusTxBuffer, sizeof(mrbusTxBuffer));
+	mrbusPktQueuePeek(mrbusTxLane(lane), (uint8_t*)mrbusTxBuffer, sizeof(mrbusTxBuffer));
 
 	// If we have no packet length, or it's less than the header, just silently say we transmitted it
 	// On the AVRs, if you don't have any packet length, it'll never clear up on the interrupt routine
 	// and you'll get stuck in indefinite transmit busy
 	if (mrbusTxBuffer[MRBUS_PKT_LEN] < MRBUS_PKT_TYPE)
 	{
-		mrbusPktQueueDrop(&mrbusTxQueue);
+		mrbusPktQueueDrop(mrbusTxLane(lane));
 		return(0);
 	}
+
+#if MRBUS_TX_LANES > 1
+	mrbusTxLaneNum = lane;
+	mrbusTxPriority = lane ? mrbusTxLanePriority[lane - 1] : mrbusPriority;
+#else
+	mrbusTxPriority = mrbusPriority;
+#endif
+
+#ifdef MRBUS_LATENCY
+	// The first attempt ends the queue wait - the queued packet's timestamp then marks the start
+	// of arbitration, so it's kept across retries.  Only we touch the front packet.
+	txPkt = mrbusPktQueueFront(mrbusTxLane(lane));
+	if (!(txPkt->flags & MRBUS_PKT_FLAG_TX_STARTED))
+	{
+		mrbusTxStartTicks = mrbusHalTicks();
+		mrbusLatencyRecord(mrbusStats.txQueueWait, mrbusTxStartTicks - txPkt->timestamp);
+		txPkt->timestamp = mrbusTxStartTicks;
+		txPkt->flags |= MRBUS_PKT_FLAG_TX_STARTED;
+	}
+	mrbusTxStartTicks = txPkt->timestamp;
+#endif
 		
 	address = mrbusTxBuffer[MRBUS_PKT_SRC];
 
@@ -270,7 +1008,13 @@ uint8_t mrbusTransmit(void)
 
 	/* Now go into critical timing loop */
 	/* Note that status is abused to calculate bus wait */
-	status = ((mrbusLoneliness + mrbusPriority) * 5) + (mrbusTxBuffer[MRBUS_PKT_SRC] & 0x0F) + 22;
+	status = mrbusBackoffSlots(address);
+
+#if MRBUS_WAIT_TYPE == 2
+	// Timer ISR takes it from here - check back with mrbusArbStatus() or mrbusTxActive()
+	mrbusArbStart(address, status);
+	return(1);
+#else
 
 	mrbusWaitSetup();
 	mrbusWait20uS(100); //wait 2ms
@@ -279,8 +1023,7 @@ uint8_t mrbusTransmit(void)
 	// Application is responsible for waiting 10ms or for successful receive
 	if (mrbusActivity)
 	{
-		if (mrbusLoneliness)
-			mrbusLoneliness--;
+		mrbusBackoffLost();
 		return(1);
 	}
 
@@ -297,6 +1040,9 @@ uint8_t mrbusTransmit(void)
 		//  framing errors, but if we're talking to ourselves, we're screwed because the RX
 		//  side of the uart isn't on during arbitration sending
 		mrbusRxIndex = 0;
+#ifdef MRBUS_RX_ISR_CRC
+		mrbusRxCrc16 = 0;
+#endif
 	}
 
 	// Now, wait calculated time from above
@@ -306,8 +1052,7 @@ uint8_t mrbusTransmit(void)
 		if (0 == (MRBUS_PIN & _BV(MRBUS_RX)))
 		{
 			MRBUS_DDR &= ~_BV(MRBUS_TX);
-			if (mrbusLoneliness)
-				mrbusLoneliness--;
+			mrbusBackoffLost();
 			return(1);
 		}
 	}
@@ -316,8 +1061,7 @@ uint8_t mrbusTransmit(void)
 	// Start Bit
 	if (mrbusArbBitSend(0))
 	{
-		if (mrbusLoneliness)
-			mrbusLoneliness--;
+		mrbusBackoffLost();
 		return(1);
 	}
 
@@ -328,8 +1072,7 @@ uint8_t mrbusTransmit(void)
 
 		if (status)
 		{
-			if (mrbusLoneliness)
-				mrbusLoneliness--;
+			mrbusBackoffLost();
 			return(1);
 		}
 	}
@@ -337,14 +1080,12 @@ uint8_t mrbusTransmit(void)
 	// Stop Bits
 	if (mrbusArbBitSend(1))
 	{
-		if (mrbusLoneliness)
-			mrbusLoneliness--;
+		mrbusBackoffLost();
 		return(1);
 	}
 	if (mrbusArbBitSend(1))
 	{
-		if (mrbusLoneliness)
-			mrbusLoneliness--;
+		mrbusBackoffLost();
 		return(1);
 	}
 
@@ -367,9 +1108,13 @@ uint8_t mrbusTransmit(void)
 		MRBUS_UART_SCR_B |= _BV(MRBUS_UART_UDRIE);
 	}
 
-	mrbusPktQueueDrop(&mrbusTxQueue);
+	mrbusPktQueueDrop(mrbusTxLane(mrbusTxLaneNum));
+#ifdef MRBUS_LATENCY
+	mrbusLatencyRecord(mrbusStats.txArbTime, mrbusHalTicks() - mrbusTxStartTicks);
+#endif
 
 	return(0);
+#endif
 }
 
 uint8_t mrbusIsBusIdle()
@@ -377,19 +1122,4 @@ uint8_t mrbusIsBusIdle()
 	return(MRBUS_ACTIVITY_IDLE == mrbusActivity);
 }
 
-uint8_t mrbusIsCrcValid(uint8_t* pktBuffer)
-{
-	uint8_t i;
-	uint16_t crc = 0;
-	// CRC16 Test - is the packet intact?
-	for(i=0; i<pktBuffer[MRBUS_PKT_LEN]; i++)
-	{
-		if ((i != MRBUS_PKT_CRC_H) && (i != MRBUS_PKT_CRC_L)) 
-			crc = mrbusCRC16Update(crc, pktBuffer[i]);
-	}
-	if ((UINT16_HIGH_BYTE(crc) != pktBuffer[MRBUS_PKT_CRC_H]) || (UINT16_LOW_BYTE(crc) != pktBuffer[MRBUS_PKT_CRC_L]))
-		return(0);
-
-	return (1);
-}
 
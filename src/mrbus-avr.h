@@ -74,6 +74,7 @@ LICENSE:
 #define MRBUS_RXCIE                RXCIE0
 #define MRBUS_TXCIE                TXCIE0
 #define MRBUS_TXC                  TXC0
+#define MRBUS_UART_U2X             U2X0
 #define MRBUS_RX_ERR_MASK          (_BV(FE0) | _BV(DOR0))
 
 #elif  defined(__AVR_ATmega8__)
@@ -107,6 +108,7 @@ LICENSE:
 #define MRBUS_RXCIE                RXCIE
 #define MRBUS_TXCIE                TXCIE
 #define MRBUS_TXC                  TXC
+#define MRBUS_UART_U2X             U2X
 #define MRBUS_RX_ERR_MASK          (_BV(FE) | _BV(DOR))
 
 
@@ -143,6 +145,7 @@ LICENSE:
 #define MRBUS_RXCIE                RXCIE0
 #define MRBUS_TXCIE                TXCIE0
 #define MRBUS_TXC                  TXC0
+#define MRBUS_UART_U2X             U2X0
 #define MRBUS_RX_ERR_MASK          (_BV(FE0) | _BV(DOR0))
 
 #elif defined(__AVR_ATmega32U4__)
@@ -177,6 +180,7 @@ LICENSE:
 #define MRBUS_RXCIE               RXCIE1
 #define MRBUS_TXCIE               TXCIE1
 #define MRBUS_TXC                 TXC1
+#define MRBUS_UART_U2X            U2X1
 #define MRBUS_RX_ERR_MASK         (_BV(FE1) | _BV(DOR1))
 
 
@@ -213,6 +217,7 @@ LICENSE:
 #define MRBUS_RXCIE               RXCIE0
 #define MRBUS_TXCIE               TXCIE0
 #define MRBUS_TXC                 TXC0
+#define MRBUS_UART_U2X            U2X0
 #define MRBUS_RX_ERR_MASK         (_BV(FE0) | _BV(DOR0))
 
 #elif defined(__AVR_ATtiny2313__) || defined(__AVR_ATtiny2313A__) || defined(__AVR_ATtiny4313__)
@@ -247,12 +252,36 @@ LICENSE:
 #define MRBUS_RXCIE               RXCIE
 #define MRBUS_TXCIE               TXCIE
 #define MRBUS_TXC                 TXC
+#define MRBUS_UART_U2X            U2X
 #define MRBUS_RX_ERR_MASK         (_BV(FE) | _BV(DOR))
 #else
 #error "No UART definition for MCU available"
 #error "Please feel free to add one and send us the patch"
 #endif
 
+#if MRBUS_WAIT_TYPE == 2
+// MRBUS_WAIT_TYPE == 2 needs an 8 bit timer with a compare match A interrupt to itself
+#if defined(__AVR_ATmega48__) || defined(__AVR_ATmega88__) || defined(__AVR_ATmega168__) || \
+    defined(__AVR_ATmega48P__) || defined(__AVR_ATmega88P__) || defined(__AVR_ATmega168P__) || \
+    defined(__AVR_ATmega328__) || defined(__AVR_ATmega328P__) || \
+    defined(__AVR_ATmega164P__) || defined(__AVR_ATmega324P__) || \
+    defined(__AVR_ATmega644P__) || defined(__AVR_ATmega1284P__)
+
+#define MRBUS_TIMER_INTERRUPT     TIMER2_COMPA_vect
+#define MRBUS_TIMER_SCR_A         TCCR2A
+#define MRBUS_TIMER_SCR_B         TCCR2B
+#define MRBUS_TIMER_COUNT         TCNT2
+#define MRBUS_TIMER_OCR           OCR2A
+#define MRBUS_TIMER_IMSK          TIMSK2
+#define MRBUS_TIMER_OCIE          OCIE2A
+#define MRBUS_TIMER_CTC           _BV(WGM21)
+#define MRBUS_TIMER_CLK_DIV8      _BV(CS21)
+
+#else
+#error "MRBUS_WAIT_TYPE 2 has no timer definition for this MCU"
+#endif
+#endif
+
 #endif // MRBUS_AVR_H
 
 
@@ -2,7 +2,18 @@
 #define MRBUS_CONSTANTS_H
 
 // Size definitions
-#define MRBUS_BUFFER_SIZE  0x14
+// MRBUS_BUFFER_SIZE is the longest packet a node sends or receives - the standard 20 bytes, or
+// up to 250 for an extended frame build.  Standard nodes drop anything longer, so an extended
+// node says so in its 'v' reply (MRBUS_VERSION_EXT_FRAME, and its buffer size in reply to a
+// capability query) and should only send long packets to nodes that did the same.
+#define MRBUS_BUFFER_SIZE_STANDARD  0x14
+#ifndef MRBUS_BUFFER_SIZE
+#define MRBUS_BUFFER_SIZE  MRBUS_BUFFER_SIZE_STANDARD
+#endif
+
+#if (MRBUS_BUFFER_SIZE < MRBUS_BUFFER_SIZE_STANDARD) || (MRBUS_BUFFER_SIZE > 250)
+#error "MRBUS_BUFFER_SIZE must be 20 to 250"
+#endif
 
 // Packet component defines
 #define MRBUS_PKT_DEST  0
@@ -24,17 +35,103 @@
 #define MRBUS_EE_DEVICE_UPDATE_H     2
 #define MRBUS_EE_DEVICE_UPDATE_L     3
 
+// Extended EEPROM packet (MRBUS_EEPROM_EXT) - 16-bit addressed block reads and writes.  The
+// operation is the subtype byte, the reply is the lower case type.
+#ifndef MRBUS_EE_EXT_PKT_TYPE
+#define MRBUS_EE_EXT_PKT_TYPE        'E'
+#endif
+#define MRBUS_EE_EXT_WRITE           'W'
+#define MRBUS_EE_EXT_READ            'R'
+#define MRBUS_EE_EXT_NEXT            'N'
+
+// mrbusArbStatus() results (MRBUS_WAIT_TYPE == 2)
+#define MRBUS_ARB_IDLE               0
+#define MRBUS_ARB_ACTIVE             1
+#define MRBUS_ARB_WON                2
+#define MRBUS_ARB_LOST               3
+
 // MRBus packet handling defines
 #define MRBUS_HANDLER_DONE           1
 #define MRBUS_HANDLER_EEPROM         2
 #define MRBUS_HANDLER_RESET          3
 #define MRBUS_HANDLER_VERSION        4
 #define MRBUS_HANDLER_CUSTOM         5
+#define MRBUS_HANDLER_DATA_RATE      6  // Switch with mrbusSetDataRate(rxBuffer[6]) (MRBUS_FAST_BAUD)
+
+// mrbusPktHandlers[] covers the printable packet types, ' ' to DEL (MRBUS_PKT_DISPATCH)
+#define MRBUS_PKT_HANDLER_FIRST      0x20
+#define MRBUS_PKT_HANDLER_TYPES      96
+
+// MRBusPacket flags
+#define MRBUS_PKT_FLAG_CRC_VALID     0x01
+#define MRBUS_PKT_FLAG_TX_STARTED    0x02  // Transmit queue internal (MRBUS_LATENCY) - timestamp is the first arbitration attempt
+#define MRBUS_PKT_FLAG_RING_WRAP     0x80  // Byte ring queue internal - rest of the ring is unused
+
+// mrbusPktQueuePushCoalesce() options (MRBUS_PKT_QUEUE_COALESCE)
+#define MRBUS_PKT_COALESCE_SUBTYPE   0x01  // Subtype must match too
+
+// RX filter options (MRBUS_RX_FILTER)
+#define MRBUS_RX_FILTER_ENABLE       0x80
+#define MRBUS_RX_FILTER_BROADCAST    0x01  // Accept packets sent to 0xFF
+#define MRBUS_RX_FILTER_OWN_PKTS     0x02  // Accept packets with our own source address
+
+// Transmit lane options (MRBUS_TX_LANES > 1)
+#define MRBUS_TX_LANE_PREEMPT        0x01  // Take over from a lower lane packet that's still arbitrating
+
+// Statistics query (MRBUS_STATS) - the reply is the lower case type
+#ifndef MRBUS_STATS_PKT_TYPE
+#define MRBUS_STATS_PKT_TYPE         'Q'
+#endif
+#define MRBUS_STATS_CLEAR            0x80  // OR'd into the requested page - clear everything once read
+
+// Latency histograms (MRBUS_LATENCY) - bucket 0 is under 8 ticks (160uS), each bucket after
+// that covers 4 times the span of the one before, and the last one has everything from 2048 ticks (41ms) up
+#define MRBUS_LATENCY_BUCKETS        6
 
 // Version flags
 #define MRBUS_VERSION_WIRELESS 0x80
 #define MRBUS_VERSION_WIRED    0x00
+#define MRBUS_VERSION_EXT_FRAME 0x40  // MRBUS_BUFFER_SIZE is larger than standard
+#define MRBUS_VERSION_FAST_BAUD 0x20  // Can switch to a fast data rate (MRBUS_FAST_BAUD)
+#define MRBUS_VERSION_CAPS      0x10  // Capability reply
+
+// Capability query - a 'V' with MRBUS_VERSION_CAPS in [6].  The 'v' reply has the version flags
+// plus MRBUS_VERSION_CAPS in [6], MRBUS_BUFFER_SIZE in [7] and the MRBUS_DATA_RATE_* code of its
+// fast rate in [8] (MRBUS_DATA_RATE_STANDARD if it has none), instead of the revisions and
+// description.  Nodes from before the query ignore [6] and send the usual reply, without
+// MRBUS_VERSION_CAPS, so a host takes those to be standard.  The usual reply is unchanged -
+// [12] on is the application's description, which older hosts show all of.
 
 #define MRBUS_BAUD   57600
 
+// Data phase rates (MRBUS_FAST_BAUD) - arbitration always runs at 4800 baud, and the packet bytes
+// at MRBUS_BAUD until an MRBUS_DATA_RATE_PKT_TYPE packet moves the segment to a faster rate.  A
+// fast node lists its rate code in its 'v' reply - only switch a segment once every node on it
+// has, since a node left behind hears nothing but framing errors.  Mind the clock - at 500000 a
+// byte arrives every 20uS (320 cycles at 16MHz) for the RX ISR and anything else that's running,
+// and 115200 is 2.1% out from a 16MHz crystal.  250000 and 500000 are exact there.
+#define MRBUS_DATA_RATE_STANDARD     0  // MRBUS_BAUD
+#define MRBUS_DATA_RATE_115200       1
+#define MRBUS_DATA_RATE_250000       2
+#define MRBUS_DATA_RATE_500000       3
+
+#ifndef MRBUS_DATA_RATE_PKT_TYPE
+#define MRBUS_DATA_RATE_PKT_TYPE     'B'
+#endif
+
+#ifdef MRBUS_FAST_BAUD
+#if MRBUS_FAST_BAUD == 115200
+#define MRBUS_DATA_RATE_FAST  MRBUS_DATA_RATE_115200
+#elif MRBUS_FAST_BAUD == 250000
+#define MRBUS_DATA_RATE_FAST  MRBUS_DATA_RATE_250000
+#elif MRBUS_FAST_BAUD == 500000
+#define MRBUS_DATA_RATE_FAST  MRBUS_DATA_RATE_500000
+#else
+#error "MRBUS_FAST_BAUD must be 115200, 250000 or 500000"
+#endif
+#endif
+
+// Arbitration priority, 0 (highest) to 11 - see mrbusSetPriority()
+#define MRBUS_PRIORITY_DEFAULT  6
+
 #endif
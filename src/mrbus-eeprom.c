@@ -0,0 +1,251 @@
+// Write-behind EEPROM queue (MRBUS_EEPROM_ASYNC) and SRAM mirror (MRBUS_EEPROM_MIRROR) - see mrbus-eeprom.h
+
+#include <string.h>
+
+#include "mrbus-constants.h"
+#include "mrbus-eeprom.h"
+
+#ifdef MRBUS_EEPROM_ASYNC
+
+#ifndef MRBUS_EEPROM_READY_INTERRUPT
+#error "MRBUS_EEPROM_ASYNC needs an EEPROM ready interrupt - define MRBUS_EEPROM_READY_INTERRUPT"
+#endif
+
+typedef struct
+{
+	uint16_t addr;
+	uint8_t data;
+} MRBusEepromWriteEntry;
+
+static MRBusEepromWriteEntry mrbusEepromQueue[MRBUS_EEPROM_QUEUE_SIZE];
+static volatile uint8_t mrbusEepromQueueTail;
+static volatile uint8_t mrbusEepromQueueCount;
+
+// Entries that must be written before the held reply can go - those queued up to and
+// including the write packet it answers
+static volatile uint8_t mrbusEepromAckWait;
+static uint8_t mrbusEepromAckPending;
+
+uint8_t mrbusEepromAsyncAckPkt[MRBUS_BUFFER_SIZE];
+
+// Starts the write of the oldest entry that changes anything.  Interrupts must be off and the
+// EEPROM ready.  Unchanged bytes are dropped on the way, so one call can use up several entries.
+static void mrbusEepromCommit(void)
+{
+	MRBusEepromWriteEntry* entry;
+
+	while (mrbusEepromQueueCount)
+	{
+		entry = &mrbusEepromQueue[mrbusEepromQueueTail];
+		if (++mrbusEepromQueueTail >= MRBUS_EEPROM_QUEUE_SIZE)
+			mrbusEepromQueueTail = 0;
+		mrbusEepromQueueCount--;
+		if (mrbusEepromAckWait)
+			mrbusEepromAckWait--;
+
+		if (mrbusEepromReadByte(entry->addr) != entry->data)
+		{
+			mrbusEepromWriteByte(entry->addr, entry->data);
+			break;
+		}
+	}
+
+	if (0 == mrbusEepromQueueCount)
+		mrbusEepromReadyIntDisable();
+}
+
+ISR(MRBUS_EEPROM_READY_INTERRUPT)
+{
+	mrbusEepromCommit();
+}
+
+void mrbusEepromAsyncWrite(uint16_t addr, uint8_t data)
+{
+	uint8_t i, idx, staged = 0;
+
+	while (!staged)
+	{
+		ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+		{
+			// Already pending?  Just replace the value
+			idx = mrbusEepromQueueTail;
+			for (i=0; i<mrbusEepromQueueCount; i++)
+			{
+				if (mrbusEepromQueue[idx].addr == addr)
+				{
+					mrbusEepromQueue[idx].data = data;
+					staged = 1;
+					break;
+				}
+				if (++idx >= MRBUS_EEPROM_QUEUE_SIZE)
+					idx = 0;
+			}
+
+			if (!staged && mrbusEepromQueueCount < MRBUS_EEPROM_QUEUE_SIZE)
+			{
+				mrbusEepromQueue[idx].addr = addr;
+				mrbusEepromQueue[idx].data = data;
+				mrbusEepromQueueCount++;
+				mrbusEepromReadyIntEnable();
+				staged = 1;
+			}
+			else if (!staged && mrbusEepromIsReady())
+			{
+				// Queue full - make room ourselves rather than wait for the interrupt
+				mrbusEepromCommit();
+			}
+		}
+	}
+}
+
+uint8_t mrbusEepromAsyncRead(uint16_t addr)
+{
+	uint8_t i, idx, data = 0, done = 0;
+
+	while (!done)
+	{
+		ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+		{
+			idx = mrbusEepromQueueTail;
+			for (i=0; i<mrbusEepromQueueCount; i++)
+			{
+				if (mrbusEepromQueue[idx].addr == addr)
+					break;
+				if (++idx >= MRBUS_EEPROM_QUEUE_SIZE)
+					idx = 0;
+			}
+
+			if (i < mrbusEepromQueueCount)
+			{
+				data = mrbusEepromQueue[idx].data;
+				done = 1;
+			}
+			else if (mrbusEepromIsReady())
+			{
+				// Not pending - read it from EEPROM, once any write in progress is done
+				data = mrbusEepromReadByte(addr);
+				done = 1;
+			}
+		}
+	}
+	return(data);
+}
+
+uint8_t mrbusEepromAsyncPending(void)
+{
+	return(mrbusEepromQueueCount);
+}
+
+// Waits for every pending write to finish - before a reset, or direct EEPROM access
+void mrbusEepromAsyncFlush(void)
+{
+	uint8_t done = 0;
+
+	while (!done)
+	{
+		ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+		{
+			if (mrbusEepromIsReady())
+			{
+				if (mrbusEepromQueueCount)
+					mrbusEepromCommit();
+				else
+					done = 1;
+			}
+		}
+	}
+}
+
+// Returns MRBUS_HANDLER_EEPROM, with the held 'w' reply in txBuffer, once everything it
+// acknowledges is in EEPROM.  Otherwise returns 0.
+uint8_t mrbusEepromAsyncPoll(uint8_t* txBuffer)
+{
+	uint8_t ready;
+
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+	{
+		ready = mrbusEepromAckPending && !mrbusEepromAckWait && mrbusEepromIsReady();
+	}
+
+	if (!ready)
+		return(0);
+
+	memcpy(txBuffer, mrbusEepromAsyncAckPkt, mrbusEepromAsyncAckPkt[MRBUS_PKT_LEN]);
+	mrbusEepromAckPending = 0;
+	return(MRBUS_HANDLER_EEPROM);
+}
+
+// For the EEPROM write handler - the reply slot is about to be reused, so if it's still held,
+// finish the writes it's waiting for and hand it over now.  Same return as mrbusEepromAsyncPoll().
+uint8_t mrbusEepromAsyncAckFlush(uint8_t* txBuffer)
+{
+	uint8_t status = 0;
+
+	while (mrbusEepromAckPending && !status)
+	{
+		ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+		{
+			if (mrbusEepromAckWait && mrbusEepromIsReady())
+				mrbusEepromCommit();
+		}
+		status = mrbusEepromAsyncPoll(txBuffer);
+	}
+	return(status);
+}
+
+// Holds mrbusEepromAsyncAckPkt until everything queued so far is written
+void mrbusEepromAsyncAckArm(void)
+{
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+	{
+		mrbusEepromAckWait = mrbusEepromQueueCount;
+		mrbusEepromAckPending = 1;
+	}
+}
+
+#endif
+
+#ifdef MRBUS_EEPROM_MIRROR
+
+// Underneath the mirror - the write-behind queue if there is one, otherwise the EEPROM itself
+#ifdef MRBUS_EEPROM_ASYNC
+#define mrbusEepromMirrorBackingRead(addr)         mrbusEepromAsyncRead(addr)
+#define mrbusEepromMirrorBackingWrite(addr, data)  mrbusEepromAsyncWrite((addr), (data))
+#else
+#define mrbusEepromMirrorBackingRead(addr)         mrbusEepromReadByte(addr)
+#define mrbusEepromMirrorBackingWrite(addr, data)  mrbusEepromUpdateByte((addr), (data))
+#endif
+
+uint8_t mrbusEepromMirror[MRBUS_EEPROM_MIRROR_HEAD + MRBUS_EEPROM_MIRROR_SIZE];
+
+void mrbusEepromMirrorLoad(void)
+{
+	uint8_t i;
+
+	// No head to load when the window already starts at 0 (and i<0 would warn with -Wextra)
+#if MRBUS_EEPROM_MIRROR_HEAD
+	for (i=0; i<MRBUS_EEPROM_MIRROR_HEAD; i++)
+		mrbusEepromMirror[i] = mrbusEepromMirrorBackingRead(i);
+#endif
+	for (i=0; i<MRBUS_EEPROM_MIRROR_SIZE; i++)
+		mrbusEepromMirror[MRBUS_EEPROM_MIRROR_HEAD + i] = mrbusEepromMirrorBackingRead(MRBUS_EEPROM_MIRROR_START + i);
+}
+
+// Write-through - the mirror changes first, so reads see the new value straight away
+void mrbusEepromMirrorWrite(uint16_t addr, uint8_t data)
+{
+	if ((uint16_t)(addr - MRBUS_EEPROM_MIRROR_START) < MRBUS_EEPROM_MIRROR_SIZE)
+		mrbusEepromMirror[MRBUS_EEPROM_MIRROR_HEAD + addr - MRBUS_EEPROM_MIRROR_START] = data;
+#if MRBUS_EEPROM_MIRROR_HEAD
+	else if (addr < MRBUS_EEPROM_MIRROR_HEAD)
+		mrbusEepromMirror[addr] = data;
+#endif
+	mrbusEepromMirrorBackingWrite(addr, data);
+}
+
+uint8_t mrbusEepromMirrorMiss(uint16_t addr)
+{
+	return(mrbusEepromMirrorBackingRead(addr));
+}
+
+#endif
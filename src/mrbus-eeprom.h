@@ -0,0 +1,122 @@
+#ifndef MRBUS_EEPROM_H
+#define MRBUS_EEPROM_H
+
+#include <stdint.h>
+#include "mrbus-hal.h"
+#include "mrbus-constants.h"
+
+#ifdef MRBUS_EEPROM_ASYNC
+
+// Write-behind EEPROM (MRBUS_EEPROM_ASYNC) - shared by the wired and XBee drivers
+// Writes are staged in a queue of MRBUS_EEPROM_QUEUE_SIZE bytes and committed one at a time from
+// the EEPROM ready interrupt, so an EEPROM write packet no longer stalls the main loop for 3.3mS
+// a byte.  Bytes that already hold the value are skipped, like eeprom_update_byte(), and a second
+// write to a pending address just replaces the staged value.  Reads see pending values.
+//
+// The 'w' reply to an EEPROM write packet is held until its bytes are written - mrbusPktHandler()
+// returns 0 for the packet, and the reply comes later from mrbusEepromAsyncPoll(), which the
+// main loop calls alongside the handler and treats the same way:
+//
+//   if (MRBUS_HANDLER_EEPROM == mrbusEepromAsyncPoll(txBuffer))
+//       { reload configuration, push txBuffer }
+//
+// The interrupt owns the EEPROM while writes are pending - everything else should go through
+// mrbusEepromRead() / mrbusEepromWrite(), or mrbusEepromAsyncFlush() first.
+#ifndef MRBUS_EEPROM_QUEUE_SIZE
+#define MRBUS_EEPROM_QUEUE_SIZE 16
+#endif
+
+#if (MRBUS_EEPROM_QUEUE_SIZE < 1) || (MRBUS_EEPROM_QUEUE_SIZE > 255)
+#error "MRBUS_EEPROM_QUEUE_SIZE must be 1 to 255"
+#endif
+
+// Reply to the last EEPROM write packet, until mrbusEepromAsyncPoll() hands it over
+extern uint8_t mrbusEepromAsyncAckPkt[MRBUS_BUFFER_SIZE];
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+void mrbusEepromAsyncWrite(uint16_t addr, uint8_t data);
+uint8_t mrbusEepromAsyncRead(uint16_t addr);
+uint8_t mrbusEepromAsyncPending(void);
+void mrbusEepromAsyncFlush(void);
+uint8_t mrbusEepromAsyncPoll(uint8_t* txBuffer);
+uint8_t mrbusEepromAsyncAckFlush(uint8_t* txBuffer);
+void mrbusEepromAsyncAckArm(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
+
+#ifdef MRBUS_EEPROM_MIRROR
+
+// EEPROM mirror (MRBUS_EEPROM_MIRROR) - a write-through SRAM copy of the EEPROM window
+// MRBUS_EEPROM_MIRROR_START to MRBUS_EEPROM_MIRROR_START + MRBUS_EEPROM_MIRROR_SIZE - 1, and of
+// the device address and option flags wherever the window is.  mrbusEepromRead() of a mirrored
+// byte is a RAM read, and mrbusEepromWrite() updates the mirror and then the EEPROM (through the
+// write-behind queue, with MRBUS_EEPROM_ASYNC).  The EEPROM is the master copy - the application
+// calls mrbusEepromMirrorLoad() at startup, before it reads any configuration, and makes every
+// EEPROM write through mrbusEepromWrite() so the two never disagree.
+#ifndef MRBUS_EEPROM_MIRROR_START
+#define MRBUS_EEPROM_MIRROR_START 0
+#endif
+
+#ifndef MRBUS_EEPROM_MIRROR_SIZE
+#define MRBUS_EEPROM_MIRROR_SIZE 32
+#endif
+
+#if (MRBUS_EEPROM_MIRROR_SIZE < 1) || (MRBUS_EEPROM_MIRROR_SIZE > 255)
+#error "MRBUS_EEPROM_MIRROR_SIZE must be 1 to 255"
+#endif
+
+// A window away from the start of EEPROM gets the device address and option flags ahead of it
+#if MRBUS_EEPROM_MIRROR_START == 0
+#define MRBUS_EEPROM_MIRROR_HEAD 0
+#else
+#define MRBUS_EEPROM_MIRROR_HEAD (MRBUS_EE_DEVICE_OPT_FLAGS + 1)
+#endif
+
+extern uint8_t mrbusEepromMirror[MRBUS_EEPROM_MIRROR_HEAD + MRBUS_EEPROM_MIRROR_SIZE];
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+void mrbusEepromMirrorLoad(void);
+void mrbusEepromMirrorWrite(uint16_t addr, uint8_t data);
+uint8_t mrbusEepromMirrorMiss(uint16_t addr);
+
+#ifdef __cplusplus
+}
+#endif
+
+static inline uint8_t mrbusEepromMirrorRead(uint16_t addr)
+{
+	if ((uint16_t)(addr - MRBUS_EEPROM_MIRROR_START) < MRBUS_EEPROM_MIRROR_SIZE)
+		return(mrbusEepromMirror[MRBUS_EEPROM_MIRROR_HEAD + addr - MRBUS_EEPROM_MIRROR_START]);
+#if MRBUS_EEPROM_MIRROR_HEAD
+	if (addr < MRBUS_EEPROM_MIRROR_HEAD)
+		return(mrbusEepromMirror[addr]);
+#endif
+	return(mrbusEepromMirrorMiss(addr));
+}
+
+#define mrbusEepromRead(addr)         mrbusEepromMirrorRead(addr)
+#define mrbusEepromWrite(addr, data)  mrbusEepromMirrorWrite((addr), (data))
+
+#elif defined(MRBUS_EEPROM_ASYNC)
+
+#define mrbusEepromRead(addr)         mrbusEepromAsyncRead(addr)
+#define mrbusEepromWrite(addr, data)  mrbusEepromAsyncWrite((addr), (data))
+
+#else
+
+#define mrbusEepromRead(addr)         mrbusEepromReadByte(addr)
+#define mrbusEepromWrite(addr, data)  mrbusEepromWriteByte((addr), (data))
+
+#endif
+
+#endif
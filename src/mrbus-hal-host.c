@@ -0,0 +1,57 @@
+// Host (non-AVR) implementation of the MRBus hardware abstraction layer - see mrbus-hal.h
+
+#ifndef __AVR__
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "mrbus-hal.h"
+#include "mrbus-host.h"
+#include "mrbee-host.h"
+
+// Register models - see mrbus-host.h and mrbee-host.h
+volatile uint8_t mrbusHostPort, mrbusHostPin, mrbusHostDdr;
+volatile uint8_t mrbusHostUartScrA, mrbusHostUartScrB, mrbusHostUartScrC, mrbusHostUartData;
+volatile uint16_t mrbusHostUartUbrr;
+// No baud generator to model - the driver sets the bit rate here, for the simulator's UART
+volatile uint32_t mrbusHostUartBaud;
+volatile uint8_t mrbusHostTimerScrA, mrbusHostTimerScrB, mrbusHostTimerCount, mrbusHostTimerOcr, mrbusHostTimerImsk;
+
+volatile uint8_t mrbeeHostPort, mrbeeHostPin, mrbeeHostDdr;
+volatile uint8_t mrbeeHostUartScrA, mrbeeHostUartScrB, mrbeeHostUartScrC, mrbeeHostUartData;
+volatile uint16_t mrbeeHostUartUbrr;
+
+uint8_t mrbusHostEeprom[MRBUS_HOST_EEPROM_SIZE] =
+{
+	[0 ... (MRBUS_HOST_EEPROM_SIZE - 1)] = 0xFF
+};
+
+volatile uint8_t mrbusHostEepromReadyIe = 0;
+
+volatile uint32_t mrbusHostMicros = 0;
+void (*mrbusHostDelayHook)(uint32_t us) = NULL;
+
+uint8_t mrbusEepromReadByte(uint16_t addr)
+{
+	return(mrbusHostEeprom[addr % MRBUS_HOST_EEPROM_SIZE]);
+}
+
+void mrbusEepromWriteByte(uint16_t addr, uint8_t data)
+{
+	mrbusHostEeprom[addr % MRBUS_HOST_EEPROM_SIZE] = data;
+}
+
+void mrbusEepromUpdateByte(uint16_t addr, uint8_t data)
+{
+	if (mrbusEepromReadByte(addr) != data)
+		mrbusEepromWriteByte(addr, data);
+}
+
+void mrbusHostDelayUs(uint32_t us)
+{
+	mrbusHostMicros += us;
+	if (NULL != mrbusHostDelayHook)
+		(*mrbusHostDelayHook)(us);
+}
+
+#endif
@@ -0,0 +1,134 @@
+#ifndef MRBUS_HAL_H
+#define MRBUS_HAL_H
+
+// Hardware abstraction layer
+// Everything in MRBus that isn't plain C goes through here - interrupt control and ATOMIC_BLOCK,
+// EEPROM access, PROGMEM tables, delays and ISR declarations.  On the AVR these are just the
+// avr-libc facilities.  Anywhere else (a Linux host build for testing, profiling and simulation)
+// they're replaced by the shims below, backed by mrbus-hal-host.c.  The UART, pin and timer
+// register models live alongside the AVR ones, in mrbus-host.h and mrbee-host.h.
+
+#include <stdint.h>
+
+#ifdef __AVR__
+
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include <avr/eeprom.h>
+#include <avr/pgmspace.h>
+#include <avr/wdt.h>
+#include <util/delay.h>
+#include <util/atomic.h>
+
+#define mrbusEepromReadByte(addr)          eeprom_read_byte((uint8_t*)(uint16_t)(addr))
+#define mrbusEepromWriteByte(addr, data)   eeprom_write_byte((uint8_t*)(uint16_t)(addr), (data))
+#define mrbusEepromUpdateByte(addr, data)  eeprom_update_byte((uint8_t*)(uint16_t)(addr), (data))
+#define mrbusEepromIsReady()               eeprom_is_ready()
+
+// EEPROM ready interrupt, for the write-behind queue (MRBUS_EEPROM_ASYNC)
+#if defined(EE_READY_vect)
+#define MRBUS_EEPROM_READY_INTERRUPT       EE_READY_vect
+#elif defined(EE_RDY_vect)
+#define MRBUS_EEPROM_READY_INTERRUPT       EE_RDY_vect
+#endif
+#define mrbusEepromReadyIntEnable()        do { EECR |= _BV(EERIE); } while(0)
+#define mrbusEepromReadyIntDisable()       do { EECR &= ~_BV(EERIE); } while(0)
+
+#ifndef pgm_read_ptr
+#define pgm_read_ptr(addr) ((void*)pgm_read_word(addr))
+#endif
+
+#define MRBUS_MEMORY_BARRIER() __asm__ __volatile__ ("" ::: "memory")
+
+#if (defined(MRBUS_LATENCY) || defined(MRBUS_RELIABLE)) && !defined(mrbusHalTicks)
+// Latency timestamps and retransmit timeouts come from the application's free-running 50kHz
+// tick, the same one MRBUS_WAIT_TYPE 1 uses.  Define mrbusHalTicks() to use some other 20uS tick instead.
+extern volatile uint16_t ticks50kHz;
+
+static inline uint16_t mrbusHalTicks(void)
+{
+	uint16_t ticks;
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+	{
+		ticks = ticks50kHz;
+	}
+	return(ticks);
+}
+#endif
+
+#else
+
+#ifndef F_CPU
+#define F_CPU 16000000UL
+#endif
+
+#ifndef _BV
+#define _BV(bit) (1 << (bit))
+#endif
+
+// A host build is single threaded - "interrupts" are ISR functions called by the test harness
+// or simulator, so there's nothing to mask.
+#define ATOMIC_RESTORESTATE
+#define ATOMIC_FORCEON
+#define NONATOMIC_RESTORESTATE
+#define NONATOMIC_FORCEOFF
+#define ATOMIC_BLOCK(type) for (uint8_t mrbusHalAtomicOnce = 1; mrbusHalAtomicOnce; mrbusHalAtomicOnce = 0)
+#define NONATOMIC_BLOCK(type) for (uint8_t mrbusHalAtomicOnce = 1; mrbusHalAtomicOnce; mrbusHalAtomicOnce = 0)
+#define cli()
+#define sei()
+#define wdt_reset()
+
+// ISRs become ordinary functions, named by the vector macros in mrbus-host.h / mrbee-host.h
+#define ISR(vector, ...) void vector(void); void vector(void)
+
+#define PROGMEM
+#define pgm_read_byte(addr) (*(const uint8_t*)(addr))
+#define pgm_read_word(addr) (*(const uint16_t*)(addr))
+#define pgm_read_ptr(addr) (*(void* const*)(addr))
+
+#define MRBUS_MEMORY_BARRIER() __asm__ __volatile__ ("" ::: "memory")
+
+#ifndef MRBUS_HOST_EEPROM_SIZE
+#define MRBUS_HOST_EEPROM_SIZE 4096
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Host EEPROM is a RAM array, initialized to 0xFF like an erased part
+extern uint8_t mrbusHostEeprom[MRBUS_HOST_EEPROM_SIZE];
+uint8_t mrbusEepromReadByte(uint16_t addr);
+void mrbusEepromWriteByte(uint16_t addr, uint8_t data);
+void mrbusEepromUpdateByte(uint16_t addr, uint8_t data);
+#define mrbusEepromIsReady() 1
+
+// Host writes complete at once, so the EEPROM ready "interrupt" only runs when the test harness
+// calls mrbusHostEepromReadyIsr() - as long as mrbusHostEepromReadyIe says it's enabled.
+extern volatile uint8_t mrbusHostEepromReadyIe;
+void mrbusHostEepromReadyIsr(void);
+#define MRBUS_EEPROM_READY_INTERRUPT mrbusHostEepromReadyIsr
+#define mrbusEepromReadyIntEnable()  do { mrbusHostEepromReadyIe = 1; } while(0)
+#define mrbusEepromReadyIntDisable() do { mrbusHostEepromReadyIe = 0; } while(0)
+
+// Host delay/tick source - a virtual microsecond clock.  Delays advance it and then call
+// mrbusHostDelayHook (if set), so a simulator can run other nodes and events in the meantime.
+extern volatile uint32_t mrbusHostMicros;
+extern void (*mrbusHostDelayHook)(uint32_t us);
+void mrbusHostDelayUs(uint32_t us);
+
+#ifdef __cplusplus
+}
+#endif
+
+#define _delay_us(us) mrbusHostDelayUs((uint32_t)(us))
+#define _delay_ms(ms) mrbusHostDelayUs((uint32_t)(ms) * 1000)
+
+// 20uS ticks for latency timestamps and retransmit timeouts, off the virtual clock
+#ifndef mrbusHalTicks
+#define mrbusHalTicks() ((uint16_t)(mrbusHostMicros / 20))
+#endif
+
+#endif
+
+#endif
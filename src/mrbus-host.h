@@ -0,0 +1,74 @@
+#ifndef MRBUS_HOST_H
+#define MRBUS_HOST_H
+
+// Host (non-AVR) register model for the wired MRBus UART, pins and arbitration timer
+// Same macro names as mrbus-avr.h, backed by plain variables in mrbus-hal-host.c.  The test
+// harness or simulator plays the part of the hardware - it sets PIN and the UART data/status
+// registers and calls the ISR functions named below.  Bit positions follow the ATmega328P.
+
+#ifndef MRBUS_WAIT_TYPE
+#define MRBUS_WAIT_TYPE 0
+#endif
+
+#define MRBUS_HOST_UART
+#define MRBUS_UART_RX_INTERRUPT    mrbusHostUartRxIsr
+#define MRBUS_UART_TX_INTERRUPT    mrbusHostUartTxIsr
+#define MRBUS_UART_DONE_INTERRUPT  mrbusHostUartDoneIsr
+#define MRBUS_PORT                 mrbusHostPort
+#define MRBUS_PIN                  mrbusHostPin
+#define MRBUS_DDR                  mrbusHostDdr
+
+#ifndef MRBUS_TXE
+#define MRBUS_TXE                  2
+#endif
+#ifndef MRBUS_TX
+#define MRBUS_TX                   1
+#endif
+#ifndef MRBUS_RX
+#define MRBUS_RX                   0
+#endif
+
+#define MRBUS_UART_UBRR            mrbusHostUartUbrr
+#define MRBUS_UART_SCR_A           mrbusHostUartScrA
+#define MRBUS_UART_SCR_B           mrbusHostUartScrB
+#define MRBUS_UART_SCR_C           mrbusHostUartScrC
+#define MRBUS_UART_DATA            mrbusHostUartData
+#define MRBUS_UART_UDRIE           5
+#define MRBUS_RXEN                 4
+#define MRBUS_TXEN                 3
+#define MRBUS_RXCIE                7
+#define MRBUS_TXCIE                6
+#define MRBUS_TXC                  6
+#define MRBUS_UART_U2X             1
+#define MRBUS_RX_ERR_MASK          (_BV(4) | _BV(3))
+
+#define MRBUS_TIMER_INTERRUPT      mrbusHostTimerIsr
+#define MRBUS_TIMER_SCR_A          mrbusHostTimerScrA
+#define MRBUS_TIMER_SCR_B          mrbusHostTimerScrB
+#define MRBUS_TIMER_COUNT          mrbusHostTimerCount
+#define MRBUS_TIMER_OCR            mrbusHostTimerOcr
+#define MRBUS_TIMER_IMSK           mrbusHostTimerImsk
+#define MRBUS_TIMER_OCIE           1
+#define MRBUS_TIMER_CTC            _BV(1)
+#define MRBUS_TIMER_CLK_DIV8       _BV(1)
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+extern volatile uint8_t mrbusHostPort, mrbusHostPin, mrbusHostDdr;
+extern volatile uint8_t mrbusHostUartScrA, mrbusHostUartScrB, mrbusHostUartScrC, mrbusHostUartData;
+extern volatile uint16_t mrbusHostUartUbrr;
+extern volatile uint32_t mrbusHostUartBaud;
+extern volatile uint8_t mrbusHostTimerScrA, mrbusHostTimerScrB, mrbusHostTimerCount, mrbusHostTimerOcr, mrbusHostTimerImsk;
+
+void mrbusHostUartRxIsr(void);
+void mrbusHostUartTxIsr(void);
+void mrbusHostUartDoneIsr(void);
+void mrbusHostTimerIsr(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // MRBUS_HOST_H
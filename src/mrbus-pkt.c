@@ -23,116 +23,483 @@ LICENSE:
     
 *************************************************************************/
 
-#include <avr/eeprom.h>
-#include "mrbus.h"
+#include <string.h>
 
-#ifdef __AVR__
+#include "mrbus.h"
 
-// FIXME: EEPROM addresses are limited to 255 + length of MRBus packet.  Should there be an optional extended write command with 16-bit addressing?
+#ifdef MRBUS_STATS
+MRBusStats mrbusStats;
 
-uint8_t mrbusPktHandler(uint8_t* rxBuffer, uint8_t* txBuffer, uint8_t mrbus_dev_addr)
+// Zeroes the counters and restarts the driver queue high-water marks from their current depth
+void mrbusStatsClear(void)
 {
-	// Loopback Test - did we send it?  If so, we probably want to ignore it
-	if (rxBuffer[MRBUS_PKT_SRC] == mrbus_dev_addr) 
-		return 0;
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+	{
+		MRBusPktQueue* rxQueue = mrbusStats.rxQueue;
+		MRBusPktQueue* txQueue = mrbusStats.txQueue;
 
-	// Destination Test - is this for us or broadcast?  If not, ignore
-	if (0xFF != rxBuffer[MRBUS_PKT_DEST] && mrbus_dev_addr != rxBuffer[MRBUS_PKT_DEST]) 
-		return 0;
-	
-	// CRC16 Test - is the packet intact?
-	if (!mrbusIsCrcValid(rxBuffer))
-		return 0;
+		memset(&mrbusStats, 0, sizeof(mrbusStats));
+		mrbusStats.rxQueue = rxQueue;
+		mrbusStats.txQueue = txQueue;
+		if (NULL != rxQueue)
+			mrbusPktQueueHighWaterClear(rxQueue);
+		if (NULL != txQueue)
+			mrbusPktQueueHighWaterClear(txQueue);
+	}
+}
+#endif
+
+#ifdef MRBUS_LATENCY
+// Counts ticks into a log scale histogram of MRBUS_LATENCY_BUCKETS buckets
+void mrbusLatencyRecord(uint16_t* histogram, uint16_t ticks)
+{
+	uint8_t bucket = 0;
 
-	if ('A' == rxBuffer[MRBUS_PKT_TYPE])
+	ticks >>= 3;
+	while (ticks && bucket < (MRBUS_LATENCY_BUCKETS - 1))
 	{
-		// PING packet
-		txBuffer[MRBUS_PKT_DEST] = rxBuffer[MRBUS_PKT_SRC];
-		txBuffer[MRBUS_PKT_SRC] = mrbus_dev_addr;
-		txBuffer[MRBUS_PKT_LEN] = 6;
-		txBuffer[MRBUS_PKT_TYPE] = 'a';
-		return (MRBUS_HANDLER_DONE);
-	} 
-	else if ('W' == rxBuffer[MRBUS_PKT_TYPE]) 
+		ticks >>= 2;
+		bucket++;
+	}
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+	{
+		histogram[bucket]++;
+	}
+}
+#endif
+
+// EEPROM addresses in 'W' and 'R' packets are limited to 255 + length of MRBus packet - the
+// extended EEPROM packets (MRBUS_EEPROM_EXT) reach the rest with 16-bit addressing.
+
+// Built-in handlers - called by mrbusPktHandler() once the packet has passed the loopback,
+// destination and CRC tests.  With MRBUS_PKT_DISPATCH they're listed in the application's
+// handler table by MRBUS_PKT_HANDLERS_BUILTIN, and can be called from its own handlers.
+
+uint8_t mrbusPktHandlePing(uint8_t* rxBuffer, uint8_t* txBuffer, uint8_t mrbus_dev_addr)
+{
+	// PING packet
+	txBuffer[MRBUS_PKT_DEST] = rxBuffer[MRBUS_PKT_SRC];
+	txBuffer[MRBUS_PKT_SRC] = mrbus_dev_addr;
+	txBuffer[MRBUS_PKT_LEN] = 6;
+	txBuffer[MRBUS_PKT_TYPE] = 'a';
+	return (MRBUS_HANDLER_DONE);
+}
+
+// EEPROM write replies go in txBuffer - or with MRBUS_EEPROM_ASYNC, in the reply slot that's held
+// until the bytes are written (see mrbusEepromAsyncPoll()).  If the last write's reply is still
+// held, that write is finished first and its reply goes in txBuffer, for the handler to return.
+static uint8_t* mrbusPktEepromAckBuffer(uint8_t* txBuffer, uint8_t* status)
+{
+#ifdef MRBUS_EEPROM_ASYNC
+	*status = mrbusEepromAsyncAckFlush(txBuffer);
+	return(mrbusEepromAsyncAckPkt);
+#else
+	*status = MRBUS_HANDLER_EEPROM;
+	return(txBuffer);
+#endif
+}
+
+uint8_t mrbusPktHandleEepromWrite(uint8_t* rxBuffer, uint8_t* txBuffer, uint8_t mrbus_dev_addr)
+{
+	// EEPROM WRITE Packet
+	uint8_t numBytes, i, status;
+	uint8_t* ackBuffer;
+	if( !((0xFF == rxBuffer[MRBUS_PKT_DEST]) && (MRBUS_EE_DEVICE_ADDR == rxBuffer[6])) && (rxBuffer[MRBUS_PKT_LEN] > 7) )
 	{
-		// EEPROM WRITE Packet
-		uint8_t numBytes, i;
-		if( !((0xFF == rxBuffer[MRBUS_PKT_DEST]) && (MRBUS_EE_DEVICE_ADDR == rxBuffer[6])) && (rxBuffer[MRBUS_PKT_LEN] > 7) )
+		// Exclude global writes to device address
+		// Exclude packets with no data
+		ackBuffer = mrbusPktEepromAckBuffer(txBuffer, &status);
+		ackBuffer[MRBUS_PKT_DEST] = rxBuffer[MRBUS_PKT_SRC];
+		ackBuffer[MRBUS_PKT_SRC] = mrbus_dev_addr;
+
+		// Write specified number of bytes.
+		// Limit maximum to avoid writing garbage if beyond MRBus buffer size.
+		numBytes = rxBuffer[MRBUS_PKT_LEN] - 7;
+		if(numBytes > (MRBUS_BUFFER_SIZE - 7))
+			numBytes = MRBUS_BUFFER_SIZE - 7;
+
+		ackBuffer[MRBUS_PKT_LEN] = numBytes + 7;
+		ackBuffer[MRBUS_PKT_TYPE] = 'w';
+		ackBuffer[6] = rxBuffer[6];
+		for(i=0; i<numBytes; i++)
 		{
-			// Exclude global writes to device address
-			// Exclude packets with no data
-			txBuffer[MRBUS_PKT_DEST] = rxBuffer[MRBUS_PKT_SRC];
-			txBuffer[MRBUS_PKT_SRC] = mrbus_dev_addr;
-
-			// Write specified number of bytes.
-			// Limit maximum to avoid writing garbage if beyond MRBus buffer size.
-			numBytes = rxBuffer[MRBUS_PKT_LEN] - 7;
-			if(numBytes > (MRBUS_BUFFER_SIZE - 7))
-				numBytes = MRBUS_BUFFER_SIZE - 7;
-
-			txBuffer[MRBUS_PKT_LEN] = numBytes + 7;
-			txBuffer[MRBUS_PKT_TYPE] = 'w';
-			txBuffer[6] = rxBuffer[6];
+			mrbusEepromWrite(rxBuffer[6]+i, rxBuffer[7+i]);
+			ackBuffer[7+i] = rxBuffer[7+i];
+		}
+#ifdef MRBUS_EEPROM_ASYNC
+		mrbusEepromAsyncAckArm();
+#endif
+		return (status);
+	}
+	return 0;
+}
+
+uint8_t mrbusPktHandleEepromRead(uint8_t* rxBuffer, uint8_t* txBuffer, uint8_t mrbus_dev_addr)
+{
+	// EEPROM READ Packet
+	uint8_t numBytes, i;
+	txBuffer[MRBUS_PKT_DEST] = rxBuffer[MRBUS_PKT_SRC];
+	txBuffer[MRBUS_PKT_SRC] = mrbus_dev_addr;
+	if((rxBuffer[MRBUS_PKT_LEN] > 7) && (rxBuffer[7] > 0))
+	{
+		// Read specified number of bytes.  Limit to avoid overflowing MRBus buffer.
+		numBytes = rxBuffer[7];
+		if(numBytes > (MRBUS_BUFFER_SIZE - 7))
+			numBytes = MRBUS_BUFFER_SIZE - 7;
+	}
+	else
+	{
+		// Default to 1 byte
+		numBytes = 1;
+	}
+	txBuffer[MRBUS_PKT_LEN] = numBytes + 7;
+	txBuffer[MRBUS_PKT_TYPE] = 'r';
+	txBuffer[6] = rxBuffer[6];
+	for(i=0; i<numBytes; i++)
+	{
+		txBuffer[7+i] = mrbusEepromRead(rxBuffer[6]+i);
+	}
+	return (MRBUS_HANDLER_DONE);
+}
+
+#ifdef MRBUS_EEPROM_EXT
+// Where MRBUS_EE_EXT_NEXT carries on from - the address after the last extended read
+static uint16_t mrbusPktEepromExtNext;
+
+uint8_t mrbusPktHandleEepromExt(uint8_t* rxBuffer, uint8_t* txBuffer, uint8_t mrbus_dev_addr)
+{
+	// Extended EEPROM packet - rxBuffer[6] is the operation, addresses are 16 bit, MSB first
+	//  MRBUS_EE_EXT_WRITE: [7-8] address, [9...] data
+	//  MRBUS_EE_EXT_READ:  [7-8] address, [9] byte count (optional - defaults to a standard packet)
+	//  MRBUS_EE_EXT_NEXT:  [7] byte count (optional) - reads on from the end of the last read
+	// The reply echoes the operation, with the address at [7-8] and the data from [9] - so a host
+	// streaming the whole EEPROM with MRBUS_EE_EXT_NEXT can check each block's address.
+	uint8_t numBytes, i, status;
+	uint8_t* ackBuffer;
+	uint16_t eeAddr;
+	uint8_t len = rxBuffer[MRBUS_PKT_LEN];
+
+	if (len < 7)
+		return 0;
+
+	switch(rxBuffer[6])
+	{
+		case MRBUS_EE_EXT_WRITE:
+			if (len < 10)
+				return 0;
+			eeAddr = ((uint16_t)rxBuffer[7] << 8) | rxBuffer[8];
+			numBytes = len - 9;
+			if (numBytes > (MRBUS_BUFFER_SIZE - 9))
+				numBytes = MRBUS_BUFFER_SIZE - 9;
+
+			// Exclude global writes that cover the device address
+			if ((0xFF == rxBuffer[MRBUS_PKT_DEST]) && (eeAddr <= MRBUS_EE_DEVICE_ADDR) && (eeAddr + numBytes > MRBUS_EE_DEVICE_ADDR))
+				return 0;
+
+			ackBuffer = mrbusPktEepromAckBuffer(txBuffer, &status);
+			ackBuffer[MRBUS_PKT_DEST] = rxBuffer[MRBUS_PKT_SRC];
+			ackBuffer[MRBUS_PKT_SRC] = mrbus_dev_addr;
+			ackBuffer[MRBUS_PKT_LEN] = numBytes + 9;
+			ackBuffer[MRBUS_PKT_TYPE] = MRBUS_EE_EXT_PKT_TYPE | 0x20;
+			ackBuffer[6] = MRBUS_EE_EXT_WRITE;
+			ackBuffer[7] = rxBuffer[7];
+			ackBuffer[8] = rxBuffer[8];
 			for(i=0; i<numBytes; i++)
 			{
-				eeprom_write_byte((uint8_t*)(uint16_t)(rxBuffer[6]+i), rxBuffer[7+i]);
-				txBuffer[7+i] = rxBuffer[7+i];
+				mrbusEepromWrite(eeAddr + i, rxBuffer[9+i]);
+				ackBuffer[9+i] = rxBuffer[9+i];
 			}
-			return (MRBUS_HANDLER_EEPROM);
-		}
+#ifdef MRBUS_EEPROM_ASYNC
+			mrbusEepromAsyncAckArm();
+#endif
+			return (status);
+
+		case MRBUS_EE_EXT_READ:
+			if (len < 9)
+				return 0;
+			eeAddr = ((uint16_t)rxBuffer[7] << 8) | rxBuffer[8];
+			numBytes = (len > 9) ? rxBuffer[9] : 0;
+			break;
+
+		case MRBUS_EE_EXT_NEXT:
+			eeAddr = mrbusPktEepromExtNext;
+			numBytes = (len > 7) ? rxBuffer[7] : 0;
+			break;
+
+		default:
+			return 0;
 	}
-	else if ('R' == rxBuffer[MRBUS_PKT_TYPE]) 
+
+	// Read - as many bytes as asked for, up to a full packet.  Without a count the reply fits in a
+	// standard packet, so hosts that don't know about extended frames can still receive it.
+	if (0 == numBytes)
+		numBytes = MRBUS_BUFFER_SIZE_STANDARD - 9;
+	else if (numBytes > (MRBUS_BUFFER_SIZE - 9))
+		numBytes = MRBUS_BUFFER_SIZE - 9;
+
+	txBuffer[MRBUS_PKT_DEST] = rxBuffer[MRBUS_PKT_SRC];
+	txBuffer[MRBUS_PKT_SRC] = mrbus_dev_addr;
+	txBuffer[MRBUS_PKT_LEN] = numBytes + 9;
+	txBuffer[MRBUS_PKT_TYPE] = MRBUS_EE_EXT_PKT_TYPE | 0x20;
+	txBuffer[6] = rxBuffer[6];
+	txBuffer[7] = UINT16_HIGH_BYTE(eeAddr);
+	txBuffer[8] = UINT16_LOW_BYTE(eeAddr);
+	for(i=0; i<numBytes; i++)
 	{
-		// EEPROM READ Packet
-		uint8_t numBytes, i;
-		txBuffer[MRBUS_PKT_DEST] = rxBuffer[MRBUS_PKT_SRC];
-		txBuffer[MRBUS_PKT_SRC] = mrbus_dev_addr;
-		if((rxBuffer[MRBUS_PKT_LEN] > 7) && (rxBuffer[7] > 0))
-		{
-			// Read specified number of bytes.  Limit to avoid overflowing MRBus buffer.
-			numBytes = rxBuffer[7];
-			if(numBytes > (MRBUS_BUFFER_SIZE - 7))
-				numBytes = MRBUS_BUFFER_SIZE - 7;
-		}
-		else
-		{
-			// Default to 1 byte
-			numBytes = 1;
-		}
-		txBuffer[MRBUS_PKT_LEN] = numBytes + 7;
-		txBuffer[MRBUS_PKT_TYPE] = 'r';
-		txBuffer[6] = rxBuffer[6];
-		for(i=0; i<numBytes; i++)
-		{
-			txBuffer[7+i] = eeprom_read_byte( (uint8_t*)(uint16_t)(rxBuffer[6]+i) );
-		}
+		txBuffer[9+i] = mrbusEepromRead(eeAddr + i);
+	}
+	mrbusPktEepromExtNext = eeAddr + numBytes;
+	return (MRBUS_HANDLER_DONE);
+}
+#endif
+
+uint8_t mrbusPktHandleVersion(uint8_t* rxBuffer, uint8_t* txBuffer, uint8_t mrbus_dev_addr)
+{
+	// Version
+	txBuffer[MRBUS_PKT_DEST] = rxBuffer[MRBUS_PKT_SRC];
+	txBuffer[MRBUS_PKT_SRC] = mrbus_dev_addr;
+	txBuffer[MRBUS_PKT_TYPE] = 'v';
+	txBuffer[6]  = MRBUS_VERSION_WIRED;
+#if MRBUS_BUFFER_SIZE > MRBUS_BUFFER_SIZE_STANDARD
+	txBuffer[6] |= MRBUS_VERSION_EXT_FRAME;
+#endif
+#ifdef MRBUS_FAST_BAUD
+	txBuffer[6] |= MRBUS_VERSION_FAST_BAUD;
+#endif
+
+	// Capability query - its own reply, so nothing follows the application's description
+	if (rxBuffer[MRBUS_PKT_LEN] >= 7 && MRBUS_VERSION_CAPS == rxBuffer[6])
+	{
+		txBuffer[MRBUS_PKT_LEN] = 9;
+		txBuffer[6] |= MRBUS_VERSION_CAPS;
+		txBuffer[7] = MRBUS_BUFFER_SIZE;
+#ifdef MRBUS_FAST_BAUD
+		txBuffer[8] = MRBUS_DATA_RATE_FAST;
+#else
+		txBuffer[8] = MRBUS_DATA_RATE_STANDARD;
+#endif
 		return (MRBUS_HANDLER_DONE);
 	}
-	else if ('V' == rxBuffer[MRBUS_PKT_TYPE]) 
+
+	txBuffer[MRBUS_PKT_LEN] = 16;
+	txBuffer[7]  = ((uint32_t)SWREV >> 16) & 0xFF;
+	txBuffer[8]  = ((uint32_t)SWREV >> 8) & 0xFF;
+	txBuffer[9]  = (uint32_t)SWREV & 0xFF;
+	txBuffer[10]  = HWREV_MAJOR;
+	txBuffer[11]  = HWREV_MINOR;
+	// Application inserts ASCII descrption string starting at txBuffer[12]
+	return (MRBUS_HANDLER_VERSION);
+}
+
+#ifdef MRBUS_FAST_BAUD
+// Data rate switch - [6] is the MRBUS_DATA_RATE_* code, and it's normally broadcast.  There's no
+// reply, since every node would answer at once at a rate the sender may not have moved to yet.
+// The core doesn't touch the driver - the application calls mrbusSetDataRate(rxBuffer[6]) when
+// this returns MRBUS_HANDLER_DATA_RATE.  Rates this node can't do are ignored.
+uint8_t mrbusPktHandleDataRate(uint8_t* rxBuffer, uint8_t* txBuffer, uint8_t mrbus_dev_addr)
+{
+	if (rxBuffer[MRBUS_PKT_LEN] < 7)
+		return (0);
+	if (MRBUS_DATA_RATE_STANDARD != rxBuffer[6] && MRBUS_DATA_RATE_FAST != rxBuffer[6])
+		return (0);
+	return (MRBUS_HANDLER_DATA_RATE);
+}
+#endif
+
+uint8_t mrbusPktHandleReset(uint8_t* rxBuffer, uint8_t* txBuffer, uint8_t mrbus_dev_addr)
+{
+#ifdef MRBUS_EEPROM_ASYNC
+	// Don't let the reset lose staged EEPROM writes
+	mrbusEepromAsyncFlush();
+#endif
+	return (MRBUS_HANDLER_RESET);
+}
+
+#ifdef MRBUS_STATS
+uint8_t mrbusPktHandleStats(uint8_t* rxBuffer, uint8_t* txBuffer, uint8_t mrbus_dev_addr)
+{
+	// Statistics query - rxBuffer[6] is the page (0 if missing), optionally with MRBUS_STATS_CLEAR
+	// Page 0: RX packets, TX packets, lost arbitrations, RX queue full drops, RX/TX queue high-water
+	// Page 1: framing errors, overlong packets, CRC errors, XBee checksum errors
+	// Pages 2-4 (MRBUS_LATENCY): TX queue wait, arbitration time and RX queue wait histograms
+	// 16 bit counters are sent MSB first.  Unknown pages get an empty reply.
+	MRBusStats stats;
+	uint8_t rxHighWater, txHighWater;
+#ifdef MRBUS_LATENCY
+	uint16_t* histogram = NULL;
+	uint8_t i;
+#endif
+	uint8_t page = (rxBuffer[MRBUS_PKT_LEN] > 6) ? rxBuffer[6] : 0;
+
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
 	{
-		// Version
-		txBuffer[MRBUS_PKT_DEST] = rxBuffer[MRBUS_PKT_SRC];
-		txBuffer[MRBUS_PKT_SRC] = mrbus_dev_addr;
-		txBuffer[MRBUS_PKT_LEN] = 16;
-		txBuffer[MRBUS_PKT_TYPE] = 'v';
-		txBuffer[6]  = MRBUS_VERSION_WIRED;
-		txBuffer[7]  = ((uint32_t)SWREV >> 16) & 0xFF;
-		txBuffer[8]  = ((uint32_t)SWREV >> 8) & 0xFF;
-		txBuffer[9]  = (uint32_t)SWREV & 0xFF;
-		txBuffer[10]  = HWREV_MAJOR;
-		txBuffer[11]  = HWREV_MINOR;
-		// Application inserts ASCII descrption string starting at txBuffer[12]
-		return (MRBUS_HANDLER_VERSION);
+		stats = mrbusStats;
 	}
-	else if ('X' == rxBuffer[MRBUS_PKT_TYPE]) 
+	rxHighWater = (NULL != stats.rxQueue) ? mrbusPktQueueHighWater(stats.rxQueue) : 0;
+	txHighWater = (NULL != stats.txQueue) ? mrbusPktQueueHighWater(stats.txQueue) : 0;
+	if (page & MRBUS_STATS_CLEAR)
+		mrbusStatsClear();
+
+	txBuffer[MRBUS_PKT_DEST] = rxBuffer[MRBUS_PKT_SRC];
+	txBuffer[MRBUS_PKT_SRC] = mrbus_dev_addr;
+	txBuffer[MRBUS_PKT_TYPE] = MRBUS_STATS_PKT_TYPE | 0x20;
+	txBuffer[6] = page;
+	switch(page & ~MRBUS_STATS_CLEAR)
 	{
-		return (MRBUS_HANDLER_RESET);
+		case 0:
+			txBuffer[MRBUS_PKT_LEN] = 17;
+			txBuffer[7]  = UINT16_HIGH_BYTE(stats.rxPkts);
+			txBuffer[8]  = UINT16_LOW_BYTE(stats.rxPkts);
+			txBuffer[9]  = UINT16_HIGH_BYTE(stats.txPkts);
+			txBuffer[10] = UINT16_LOW_BYTE(stats.txPkts);
+			txBuffer[11] = UINT16_HIGH_BYTE(stats.txArbLost);
+			txBuffer[12] = UINT16_LOW_BYTE(stats.txArbLost);
+			txBuffer[13] = UINT16_HIGH_BYTE(stats.rxQueueFull);
+			txBuffer[14] = UINT16_LOW_BYTE(stats.rxQueueFull);
+			txBuffer[15] = rxHighWater;
+			txBuffer[16] = txHighWater;
+			break;
+
+		case 1:
+			txBuffer[MRBUS_PKT_LEN] = 15;
+			txBuffer[7]  = UINT16_HIGH_BYTE(stats.rxFrameErrors);
+			txBuffer[8]  = UINT16_LOW_BYTE(stats.rxFrameErrors);
+			txBuffer[9]  = UINT16_HIGH_BYTE(stats.rxOverlong);
+			txBuffer[10] = UINT16_LOW_BYTE(stats.rxOverlong);
+			txBuffer[11] = UINT16_HIGH_BYTE(stats.rxCrcErrors);
+			txBuffer[12] = UINT16_LOW_BYTE(stats.rxCrcErrors);
+			txBuffer[13] = UINT16_HIGH_BYTE(stats.rxBadChecksum);
+			txBuffer[14] = UINT16_LOW_BYTE(stats.rxBadChecksum);
+			break;
+
+#ifdef MRBUS_LATENCY
+		case 2:
+			histogram = stats.txQueueWait;
+			break;
+
+		case 3:
+			histogram = stats.txArbTime;
+			break;
+
+		case 4:
+			histogram = stats.rxQueueWait;
+			break;
+#endif
+
+		default:
+			txBuffer[MRBUS_PKT_LEN] = 7;
+			break;
 	}
-	else
+#ifdef MRBUS_LATENCY
+	if (NULL != histogram)
 	{
+		txBuffer[MRBUS_PKT_LEN] = 7 + (2 * MRBUS_LATENCY_BUCKETS);
+		for (i=0; i<MRBUS_LATENCY_BUCKETS; i++)
+		{
+			txBuffer[7 + (2 * i)] = UINT16_HIGH_BYTE(histogram[i]);
+			txBuffer[8 + (2 * i)] = UINT16_LOW_BYTE(histogram[i]);
+		}
+	}
+#endif
+	return (MRBUS_HANDLER_DONE);
+}
+#endif
+
+#ifdef MRBUS_PKT_DISPATCH
+
+// Dispatches on rxBuffer[MRBUS_PKT_SUBTYPE] through a table of handlers, the same way mrbusPktHandler()
+// dispatches on the type - for use by the application's type handlers.  The table is indexed from
+// subtype 0, and can be in PROGMEM (progmem set) or RAM.  Returns 0 for subtypes without a handler.
+uint8_t mrbusPktSubtypeDispatch(const MRBusPktHandlerFn* table, uint8_t tableSize, uint8_t progmem, uint8_t* rxBuffer, uint8_t* txBuffer, uint8_t mrbus_dev_addr)
+{
+	uint8_t subtype = rxBuffer[MRBUS_PKT_SUBTYPE];
+	MRBusPktHandlerFn handler;
+
+	if (subtype >= tableSize || rxBuffer[MRBUS_PKT_LEN] <= MRBUS_PKT_SUBTYPE)
+		return 0;
+
+	handler = progmem ? (MRBusPktHandlerFn)pgm_read_ptr(&table[subtype]) : table[subtype];
+	if (NULL == handler)
+		return 0;
+	return ((*handler)(rxBuffer, txBuffer, mrbus_dev_addr));
+}
+
+#endif
+
+// A packet just popped from the receive queue into rxBuffer keeps the flags the RX ISR gave it,
+// so with MRBUS_RX_ISR_CRC its CRC isn't walked again
+uint8_t mrbusPktHandler(uint8_t* rxBuffer, uint8_t* txBuffer, uint8_t mrbus_dev_addr)
+{
+	return(mrbusPktHandlerInternal(rxBuffer, txBuffer, mrbus_dev_addr, mrbusPktQueuePoppedFlags(rxBuffer)));
+}
+
+uint8_t mrbusPktHandlerInternal(uint8_t* rxBuffer, uint8_t* txBuffer, uint8_t mrbus_dev_addr, uint8_t pktFlags)
+{
+#ifdef MRBUS_PKT_DISPATCH
+	uint8_t typeIdx;
+	MRBusPktHandlerFn handler;
+#endif
+
+	// Loopback Test - did we send it?  If so, we probably want to ignore it
+	if (rxBuffer[MRBUS_PKT_SRC] == mrbus_dev_addr) 
+		return 0;
+
+	// Destination Test - is this for us or broadcast?  If not, ignore
+	if (0xFF != rxBuffer[MRBUS_PKT_DEST] && mrbus_dev_addr != rxBuffer[MRBUS_PKT_DEST]) 
+		return 0;
+	
+	// CRC16 Test - is the packet intact?  Skip it if the RX ISR already checked it
+	// The RX ISR counts its own CRC failures, so the shared counter is bumped with interrupts off
+	if (!(pktFlags & MRBUS_PKT_FLAG_CRC_VALID) && !mrbusIsCrcValid(rxBuffer))
+	{
+		mrbusStatsIncAtomic(rxCrcErrors);
+		return 0;
+	}
+
+#ifdef MRBUS_PKT_DISPATCH
+	// One table lookup, whatever the type - anything without a handler is left to the caller
+	typeIdx = rxBuffer[MRBUS_PKT_TYPE] - MRBUS_PKT_HANDLER_FIRST;
+	if (typeIdx >= MRBUS_PKT_HANDLER_TYPES)
 		return (MRBUS_HANDLER_CUSTOM);
+
+	handler = (MRBusPktHandlerFn)pgm_read_ptr(&mrbusPktHandlers[typeIdx]);
+	if (NULL == handler)
+		return (MRBUS_HANDLER_CUSTOM);
+	return ((*handler)(rxBuffer, txBuffer, mrbus_dev_addr));
+#else
+	switch(rxBuffer[MRBUS_PKT_TYPE])
+	{
+		case 'A':
+			return (mrbusPktHandlePing(rxBuffer, txBuffer, mrbus_dev_addr));
+		case 'W':
+			return (mrbusPktHandleEepromWrite(rxBuffer, txBuffer, mrbus_dev_addr));
+		case 'R':
+			return (mrbusPktHandleEepromRead(rxBuffer, txBuffer, mrbus_dev_addr));
+#ifdef MRBUS_EEPROM_EXT
+		case MRBUS_EE_EXT_PKT_TYPE:
+			return (mrbusPktHandleEepromExt(rxBuffer, txBuffer, mrbus_dev_addr));
+#endif
+		case 'V':
+			return (mrbusPktHandleVersion(rxBuffer, txBuffer, mrbus_dev_addr));
+		case 'X':
+			return (mrbusPktHandleReset(rxBuffer, txBuffer, mrbus_dev_addr));
+#ifdef MRBUS_STATS
+		case MRBUS_STATS_PKT_TYPE:
+			return (mrbusPktHandleStats(rxBuffer, txBuffer, mrbus_dev_addr));
+#endif
+#ifdef MRBUS_FAST_BAUD
+		case MRBUS_DATA_RATE_PKT_TYPE:
+			return (mrbusPktHandleDataRate(rxBuffer, txBuffer, mrbus_dev_addr));
+#endif
+#ifdef MRBUS_RELIABLE
+		case MRBUS_RELIABLE_PKT_TYPE:
+			return (mrbusPktHandleReliable(rxBuffer, txBuffer, mrbus_dev_addr));
+		case MRBUS_RELIABLE_ACK_PKT_TYPE:
+			return (mrbusPktHandleReliableAck(rxBuffer, txBuffer, mrbus_dev_addr));
+#endif
+		default:
+			return (MRBUS_HANDLER_CUSTOM);
 	}
-	return 0;
+#endif
 }
-#endif  // End of __AVR__ PKT routines
 
@@ -1,17 +1,435 @@
-#ifdef __AVR__
-#include <avr/io.h>
-#include <avr/interrupt.h>
-#include <util/delay.h>
-#include <util/atomic.h>
-#endif
-
 #include <stdlib.h>
 #include <string.h>
 
+#include "mrbus-hal.h"
 #include "mrbus-constants.h"
 #include "mrbus-queue.h"
+#include "mrbus-stats.h"
 #include "mrbus-macros.h"
 
+#include <stddef.h>
+
+// Keeps the compiler from moving packet slot accesses across the head/tail index updates
+#define MRBUS_PKT_QUEUE_BARRIER() MRBUS_MEMORY_BARRIER()
+
+#ifdef MRBUS_LATENCY
+// Producer side - stamp the packet as it's committed
+#define mrbusPktQueueStamp(slot) do { (slot)->timestamp = mrbusHalTicks(); } while(0)
+// Consumer side - record how long a packet leaving the driver's RX queue spent in it
+#define mrbusPktQueueLatency(q, slot) do { if ((q) == mrbusStats.rxQueue) mrbusLatencyRecord(mrbusStats.rxQueueWait, mrbusHalTicks() - (slot)->timestamp); } while(0)
+#else
+#define mrbusPktQueueStamp(slot) do { } while(0)
+#define mrbusPktQueueLatency(q, slot) do { } while(0)
+#endif
+
+#ifdef MRBUS_PKT_QUEUE_COALESCE
+// Whether a queued packet carries the same status as data, so data can replace it
+static uint8_t mrbusPktQueueCoalesceMatch(MRBusPacket* slot, uint8_t* data, uint8_t options)
+{
+	if (slot->pkt[MRBUS_PKT_SRC] != data[MRBUS_PKT_SRC]
+		|| slot->pkt[MRBUS_PKT_DEST] != data[MRBUS_PKT_DEST]
+		|| slot->pkt[MRBUS_PKT_TYPE] != data[MRBUS_PKT_TYPE])
+		return(0);
+	if ((options & MRBUS_PKT_COALESCE_SUBTYPE) && slot->pkt[MRBUS_PKT_SUBTYPE] != data[MRBUS_PKT_SUBTYPE])
+		return(0);
+#ifdef MRBUS_PKT_QUEUE_RING
+	// Records are packed back to back, so a replacement has to be exactly the same size
+	if (slot->pkt[MRBUS_PKT_LEN] != data[MRBUS_PKT_LEN])
+		return(0);
+#endif
+	return(1);
+}
+#endif
+
+#if defined(MRBUS_PKT_QUEUE_RING)
+
+// 8 bit offsets are read and written atomically anyway - 16 bit ones need interrupts off
+#if MRBUS_BUFFER_SIZE > MRBUS_BUFFER_SIZE_STANDARD
+static inline MRBusPktQueueRingIdx mrbusPktQueueRingLoad(volatile MRBusPktQueueRingIdx* idx)
+{
+	MRBusPktQueueRingIdx value;
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+	{
+		value = *idx;
+	}
+	return(value);
+}
+
+static inline void mrbusPktQueueRingStore(volatile MRBusPktQueueRingIdx* idx, MRBusPktQueueRingIdx value)
+{
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+	{
+		*idx = value;
+	}
+}
+#else
+#define mrbusPktQueueRingLoad(idx) (*(idx))
+#define mrbusPktQueueRingStore(idx, value) do { *(idx) = (value); } while(0)
+#endif
+
+// No room in the ring
+#define MRBUS_PKT_QUEUE_RING_NONE ((MRBusPktQueueRingIdx)~0)
+
+// Bytes a stored packet occupies in the ring - flags, rssi, then the packet itself
+// A bogus length is held to between the packet header and MRBUS_BUFFER_SIZE, so the record always
+// covers the bytes the consumer reads and never runs past the space that was reserved for it.
+#define mrbusPktQueueRecordLen(p) (offsetof(MRBusPacket, pkt) + max(min((p)->pkt[MRBUS_PKT_LEN], MRBUS_BUFFER_SIZE), MRBUS_PKT_TYPE + 1))
+
+// Offset where the producer can place a full size packet, or MRBUS_PKT_QUEUE_RING_NONE if there isn't room
+// A full MRBusPacket is always reserved since the length isn't known until it arrives.
+// The new head must never land on the tail, or the queue would look empty.
+static MRBusPktQueueRingIdx mrbusPktQueueRingSpot(MRBusPktQueue* q)
+{
+	MRBusPktQueueRingIdx headIdx = mrbusPktQueueRingLoad(&q->headIdx);
+	MRBusPktQueueRingIdx tailIdx = mrbusPktQueueRingLoad(&q->tailIdx);
+
+	if ((MRBusPktQueueRingIdx)(q->ringBufferSz - headIdx) > sizeof(MRBusPacket))
+	{
+		// Room before the end of the ring - fine unless the tail is in the way
+		if (tailIdx <= headIdx || (MRBusPktQueueRingIdx)(tailIdx - headIdx) > sizeof(MRBusPacket))
+			return(headIdx);
+	}
+	else if (tailIdx <= headIdx && tailIdx > sizeof(MRBusPacket))
+	{
+		// Not enough room at the end, but there is at the start
+		return(0);
+	}
+	return(MRBUS_PKT_QUEUE_RING_NONE);
+}
+
+void mrbusPktQueueInitializeInternal(MRBusPktQueue* q, MRBusPacket* pktBufferArray, uint8_t pktBufferArraySz)
+{
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+	{
+		q->ringBuffer = (uint8_t*)pktBufferArray;
+		q->ringBufferSz = min((uint32_t)pktBufferArraySz * sizeof(MRBusPacket), (MRBusPktQueueRingIdx)~0);
+		// Too small for a full size packet even when empty - a zero size ring is always full
+		if (q->ringBufferSz < sizeof(MRBusPacket) + 1)
+			q->ringBufferSz = 0;
+		q->headIdx = q->tailIdx = 0;
+		q->reserved = 0;
+		q->pushCount = q->popCount = 0;
+#ifdef MRBUS_PKT_QUEUE_COALESCE
+		q->coalesceCount = 0;
+#endif
+#ifdef MRBUS_STATS
+		q->highWater = 0;
+#endif
+		memset(q->ringBuffer, 0, q->ringBufferSz);
+	}
+}
+
+uint8_t mrbusPktQueueFull(MRBusPktQueue* q)
+{
+	return(MRBUS_PKT_QUEUE_RING_NONE == mrbusPktQueueRingSpot(q));
+}
+
+MRBusPacket* mrbusPktQueueReserve(MRBusPktQueue* q)
+{
+	MRBusPktQueueRingIdx headIdx, spot;
+
+	// Claim the slot before looking at the offsets, so the consumer can't rewind them under us
+	q->reserved = 1;
+	MRBUS_PKT_QUEUE_BARRIER();
+
+	headIdx = mrbusPktQueueRingLoad(&q->headIdx);
+	spot = mrbusPktQueueRingSpot(q);
+
+	if (MRBUS_PKT_QUEUE_RING_NONE == spot)
+	{
+		q->reserved = 0;
+		return(NULL);
+	}
+
+	// Wrapping - tell the consumer to skip the rest of the ring.  It can't see this until the commit.
+	if (spot != headIdx)
+		q->ringBuffer[headIdx] = MRBUS_PKT_FLAG_RING_WRAP;
+
+	return((MRBusPacket*)(q->ringBuffer + spot));
+}
+
+void mrbusPktQueueCommit(MRBusPktQueue* q)
+{
+	// Same placement decision as the reserve - it only depends on the head, which only we move
+	MRBusPktQueueRingIdx headIdx = mrbusPktQueueRingLoad(&q->headIdx);
+	MRBusPktQueueRingIdx spot = ((MRBusPktQueueRingIdx)(q->ringBufferSz - headIdx) > sizeof(MRBusPacket)) ? headIdx : 0;
+	MRBusPacket* pkt = (MRBusPacket*)(q->ringBuffer + spot);
+
+	pkt->flags &= ~MRBUS_PKT_FLAG_RING_WRAP;
+	mrbusPktQueueStamp(pkt);
+
+	// Packet must be completely in the ring before the consumer can see it
+	MRBUS_PKT_QUEUE_BARRIER();
+	mrbusPktQueueRingStore(&q->headIdx, spot + mrbusPktQueueRecordLen(pkt));
+	q->pushCount++;
+	q->reserved = 0;
+#ifdef MRBUS_STATS
+	if (mrbusPktQueueDepth(q) > q->highWater)
+		q->highWater = mrbusPktQueueDepth(q);
+#endif
+}
+
+void mrbusPktQueueAbort(MRBusPktQueue* q)
+{
+	// Any wrap marker the reserve left is never seen, since the head didn't move
+	q->reserved = 0;
+}
+
+MRBusPacket* mrbusPktQueueFront(MRBusPktQueue* q)
+{
+	MRBusPktQueueRingIdx tailIdx = mrbusPktQueueRingLoad(&q->tailIdx);
+
+	if (mrbusPktQueueRingLoad(&q->headIdx) == tailIdx)
+		return(NULL);
+
+	// Slot contents must not be read before the producer's head update is seen
+	MRBUS_PKT_QUEUE_BARRIER();
+
+	// Producer wrapped here - the next packet is at the start of the ring
+	if (q->ringBuffer[tailIdx] & MRBUS_PKT_FLAG_RING_WRAP)
+	{
+		tailIdx = 0;
+		mrbusPktQueueRingStore(&q->tailIdx, 0);
+	}
+
+	return((MRBusPacket*)(q->ringBuffer + tailIdx));
+}
+
+uint8_t mrbusPktQueueDrop(MRBusPktQueue* q)
+{
+	MRBusPacket* pkt = mrbusPktQueueFront(q);
+	MRBusPktQueueRingIdx tailIdx;
+
+	if (NULL == pkt)
+		return(0);
+
+	mrbusPktQueueLatency(q, pkt);
+	tailIdx = ((uint8_t*)pkt - q->ringBuffer) + mrbusPktQueueRecordLen(pkt);
+
+	// Packet must be completely read before the producer can reuse the space
+	MRBUS_PKT_QUEUE_BARRIER();
+	if (mrbusPktQueueRingLoad(&q->headIdx) == tailIdx)
+	{
+		// Drained - unless a packet is on its way in, start the ring again from the beginning
+		ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+		{
+			if (!q->reserved && q->headIdx == tailIdx)
+				q->headIdx = tailIdx = 0;
+			q->tailIdx = tailIdx;
+		}
+	}
+	else
+		mrbusPktQueueRingStore(&q->tailIdx, tailIdx);
+	q->popCount++;
+	return(1);
+}
+
+#ifdef MRBUS_PKT_QUEUE_COALESCE
+// Producer side - newest packet behind the front one that data can replace, or NULL
+// The consumer may move the tail meanwhile, but never alters records, so walking from a stale
+// tail is harmless.  mrbusPktQueueCoalesceQueued() makes the final check.
+static MRBusPacket* mrbusPktQueueCoalesceFind(MRBusPktQueue* q, uint8_t* data, uint8_t options)
+{
+	MRBusPacket* found = NULL;
+	MRBusPktQueueRingIdx headIdx = mrbusPktQueueRingLoad(&q->headIdx);
+	MRBusPktQueueRingIdx idx = mrbusPktQueueRingLoad(&q->tailIdx);
+
+	if (headIdx == idx)
+		return(NULL);
+
+	if (q->ringBuffer[idx] & MRBUS_PKT_FLAG_RING_WRAP)
+		idx = 0;
+
+	while(1)
+	{
+		idx += mrbusPktQueueRecordLen((MRBusPacket*)(q->ringBuffer + idx));
+		if (idx != headIdx && (q->ringBuffer[idx] & MRBUS_PKT_FLAG_RING_WRAP))
+			idx = 0;
+		if (idx == headIdx)
+			break;
+		if (mrbusPktQueueCoalesceMatch((MRBusPacket*)(q->ringBuffer + idx), data, options))
+			found = (MRBusPacket*)(q->ringBuffer + idx);
+	}
+	return(found);
+}
+
+// Whether slot is still queued and not at the front - call with interrupts off
+static uint8_t mrbusPktQueueCoalesceQueued(MRBusPktQueue* q, MRBusPacket* slot)
+{
+	MRBusPktQueueRingIdx idx = (uint8_t*)slot - q->ringBuffer;
+	MRBusPktQueueRingIdx headIdx = mrbusPktQueueRingLoad(&q->headIdx);
+	MRBusPktQueueRingIdx frontIdx = mrbusPktQueueRingLoad(&q->tailIdx);
+
+	if (headIdx == frontIdx)
+		return(0);
+	if (q->ringBuffer[frontIdx] & MRBUS_PKT_FLAG_RING_WRAP)
+		frontIdx = 0;
+	if (frontIdx < headIdx)
+		return(idx > frontIdx && idx < headIdx);
+	return(idx > frontIdx || idx < headIdx);
+}
+#endif
+
+uint8_t mrbeePktQueuePopInternal(MRBusPktQueue* q, uint8_t* data, uint8_t dataLen, uint8_t snoop, uint8_t* rssiPtr)
+{
+	MRBusPacket* pkt = mrbusPktQueueFront(q);
+
+	memset(data, 0, dataLen);
+	if (NULL != rssiPtr)
+		*rssiPtr = 0;
+
+	if (NULL == pkt)
+		return(0);
+
+	memcpy(data, pkt->pkt, min(dataLen, pkt->pkt[MRBUS_PKT_LEN]));
+	if (NULL != rssiPtr)
+		*rssiPtr = pkt->rssi;
+
+	// Snoop indicates that we shouldn't actually pop the packet off - just copy it out
+	if (snoop)
+		return(1);
+
+	return(mrbusPktQueueDrop(q));
+}
+
+#elif defined(MRBUS_PKT_QUEUE_POW2)
+
+void mrbusPktQueueInitializeInternal(MRBusPktQueue* q, MRBusPacket* pktBufferArray, uint8_t pktBufferArraySz)
+{
+	// Clear low bits until one is left - a size of 0 stays 0, and that queue is always full
+	while (pktBufferArraySz & (pktBufferArraySz - 1))
+		pktBufferArraySz &= pktBufferArraySz - 1;
+
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+	{
+		q->pktBufferArray = pktBufferArray;
+		q->pktBufferArraySz = pktBufferArraySz;
+		q->headIdx = q->tailIdx = 0;
+#ifdef MRBUS_PKT_QUEUE_COALESCE
+		q->coalesceCount = 0;
+#endif
+#ifdef MRBUS_STATS
+		q->highWater = 0;
+#endif
+		memset(q->pktBufferArray, 0, pktBufferArraySz * sizeof(MRBusPacket));
+	}
+}
+
+MRBusPacket* mrbusPktQueueReserve(MRBusPktQueue* q)
+{
+	// Producer owns headIdx, so a local copy is always current
+	uint8_t headIdx = q->headIdx;
+
+	// If full, there's no slot to hand out
+	if ((uint8_t)(headIdx - q->tailIdx) >= q->pktBufferArraySz)
+		return(NULL);
+
+	return(mrbusPktQueueSlot(q, headIdx));
+}
+
+void mrbusPktQueueCommit(MRBusPktQueue* q)
+{
+	mrbusPktQueueStamp(mrbusPktQueueSlot(q, q->headIdx));
+
+	// Packet must be completely in the slot before the consumer can see it
+	MRBUS_PKT_QUEUE_BARRIER();
+	q->headIdx++;
+#ifdef MRBUS_STATS
+	if (mrbusPktQueueDepth(q) > q->highWater)
+		q->highWater = mrbusPktQueueDepth(q);
+#endif
+}
+
+void mrbusPktQueueAbort(MRBusPktQueue* q)
+{
+	// Nothing to undo - the slot is just handed out again by the next reserve
+}
+
+#ifdef MRBUS_PKT_QUEUE_COALESCE
+// Producer side - newest packet behind the front one that data can replace, or NULL
+// The consumer may move the tail meanwhile, but only the producer writes slots, so looking at
+// a slot that's just been freed is harmless.  mrbusPktQueueCoalesceQueued() makes the final check.
+static MRBusPacket* mrbusPktQueueCoalesceFind(MRBusPktQueue* q, uint8_t* data, uint8_t options)
+{
+	MRBusPacket* found = NULL;
+	uint8_t headIdx = q->headIdx;
+	uint8_t idx = q->tailIdx;
+
+	if (headIdx == idx)
+		return(NULL);
+
+	while (++idx != headIdx)
+	{
+		if (mrbusPktQueueCoalesceMatch(mrbusPktQueueSlot(q, idx), data, options))
+			found = mrbusPktQueueSlot(q, idx);
+	}
+	return(found);
+}
+
+// Whether slot is still queued and not at the front - call with interrupts off
+static uint8_t mrbusPktQueueCoalesceQueued(MRBusPktQueue* q, MRBusPacket* slot)
+{
+	uint8_t pos = (uint8_t)((slot - q->pktBufferArray) - q->tailIdx) & (q->pktBufferArraySz - 1);
+	return(pos && pos < mrbusPktQueueDepth(q));
+}
+#endif
+
+uint8_t mrbeePktQueuePopInternal(MRBusPktQueue* q, uint8_t* data, uint8_t dataLen, uint8_t snoop, uint8_t* rssiPtr)
+{
+	MRBusPacket* slot;
+	// Consumer owns tailIdx, so a local copy is always current
+	uint8_t tailIdx = q->tailIdx;
+
+	memset(data, 0, dataLen);
+	if (NULL != rssiPtr)
+		*rssiPtr = 0;
+
+	if (q->headIdx == tailIdx)
+		return(0);
+
+	slot = mrbusPktQueueSlot(q, tailIdx);
+	memcpy(data, slot->pkt, min(dataLen, slot->pkt[MRBUS_PKT_LEN]));
+	if (NULL != rssiPtr)
+		*rssiPtr = slot->rssi;
+
+	// Snoop indicates that we shouldn't actually pop the packet off - just copy it out
+	if (snoop)
+		return(1);
+
+	mrbusPktQueueLatency(q, slot);
+
+	// Packet must be completely copied out before the producer can reuse the slot
+	MRBUS_PKT_QUEUE_BARRIER();
+	q->tailIdx = tailIdx + 1;
+	return(1);
+}
+
+MRBusPacket* mrbusPktQueueFront(MRBusPktQueue* q)
+{
+	uint8_t tailIdx = q->tailIdx;
+
+	if (q->headIdx == tailIdx)
+		return(NULL);
+
+	// Slot contents must not be read before the producer's head update is seen
+	MRBUS_PKT_QUEUE_BARRIER();
+	return(mrbusPktQueueSlot(q, tailIdx));
+}
+
+uint8_t mrbusPktQueueDrop(MRBusPktQueue* q)
+{
+	uint8_t tailIdx = q->tailIdx;
+
+	if (q->headIdx == tailIdx)
+		return(0);
+
+	mrbusPktQueueLatency(q, mrbusPktQueueSlot(q, tailIdx));
+	q->tailIdx = tailIdx + 1;
+	return(1);
+}
+
+#else
+
 void mrbusPktQueueInitialize(MRBusPktQueue* q, MRBusPacket* pktBufferArray, uint8_t pktBufferArraySz)
 {
 	ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
@@ -20,6 +438,12 @@ void mrbusPktQueueInitialize(MRBusPktQueue* q, MRBusPacket* pktBufferArray, uint
 		q->pktBufferArraySz = pktBufferArraySz;
 		q->headIdx = q->tailIdx = 0;
 		q->full = 0;
+#ifdef MRBUS_PKT_QUEUE_COALESCE
+		q->coalesceCount = 0;
+#endif
+#ifdef MRBUS_STATS
+		q->highWater = 0;
+#endif
 		memset(q->pktBufferArray, 0, pktBufferArraySz * sizeof(MRBusPacket));
 	}
 }
@@ -37,19 +461,18 @@ uint8_t mrbusPktQueueDepth(MRBusPktQueue* q)
 	return(result);
 }
 
-uint8_t mrbeePktQueuePush(MRBusPktQueue* q, uint8_t* data, uint8_t dataLen, uint8_t rssi)
+MRBusPacket* mrbusPktQueueReserve(MRBusPktQueue* q)
 {
-	uint8_t* pktPtr;
-	// If full, bail with a false
+	// If full, there's no slot to hand out
 	if (q->full)
-		return(0);
+		return(NULL);
 
-	dataLen = min(MRBUS_BUFFER_SIZE, dataLen);
-	pktPtr = (uint8_t*)q->pktBufferArray[q->headIdx].pkt;
-	memcpy(pktPtr, data, dataLen);
-	memset(pktPtr+dataLen, 0, MRBUS_BUFFER_SIZE - dataLen);
-	q->pktBufferArray[q->headIdx].rssi = rssi;
+	return(&q->pktBufferArray[q->headIdx]);
+}
 
+void mrbusPktQueueCommit(MRBusPktQueue* q)
+{
+	mrbusPktQueueStamp(&q->pktBufferArray[q->headIdx]);
 	if( ++q->headIdx >= q->pktBufferArraySz )
 		q->headIdx = 0;
 	ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
@@ -57,14 +480,46 @@ uint8_t mrbeePktQueuePush(MRBusPktQueue* q, uint8_t* data, uint8_t dataLen, uint
 		if (q->headIdx == q->tailIdx)
 			q->full = 1;
 	}
-	return(1);
+#ifdef MRBUS_STATS
+	if (mrbusPktQueueDepth(q) > q->highWater)
+		q->highWater = mrbusPktQueueDepth(q);
+#endif
 }
 
-uint8_t mrbusPktQueuePush(MRBusPktQueue* q, uint8_t* data, uint8_t dataLen)
+void mrbusPktQueueAbort(MRBusPktQueue* q)
 {
-	return mrbeePktQueuePush(q, data, dataLen, 0);
+	// Nothing to undo - the slot is just handed out again by the next reserve
 }
 
+#ifdef MRBUS_PKT_QUEUE_COALESCE
+// Producer side - newest packet behind the front one that data can replace, or NULL
+// The consumer may move the tail meanwhile, but only the producer writes slots, so looking at
+// a slot that's just been freed is harmless.  mrbusPktQueueCoalesceQueued() makes the final check.
+static MRBusPacket* mrbusPktQueueCoalesceFind(MRBusPktQueue* q, uint8_t* data, uint8_t options)
+{
+	MRBusPacket* found = NULL;
+	uint8_t depth = mrbusPktQueueDepth(q);
+	uint8_t idx = q->tailIdx;
+
+	while (depth-- > 1)
+	{
+		if (++idx >= q->pktBufferArraySz)
+			idx = 0;
+		if (mrbusPktQueueCoalesceMatch(&q->pktBufferArray[idx], data, options))
+			found = &q->pktBufferArray[idx];
+	}
+	return(found);
+}
+
+// Whether slot is still queued and not at the front - call with interrupts off
+static uint8_t mrbusPktQueueCoalesceQueued(MRBusPktQueue* q, MRBusPacket* slot)
+{
+	uint8_t idx = slot - q->pktBufferArray;
+	uint8_t pos = (idx >= q->tailIdx) ? idx - q->tailIdx : idx + (q->pktBufferArraySz - q->tailIdx);
+
+	return(pos && pos < mrbusPktQueueDepth(q));
+}
+#endif
 
 uint8_t mrbeePktQueuePopInternal(MRBusPktQueue* q, uint8_t* data, uint8_t dataLen, uint8_t snoop, uint8_t* rssiPtr)
 {
@@ -83,6 +538,8 @@ uint8_t mrbeePktQueuePopInternal(MRBusPktQueue* q, uint8_t* data, uint8_t dataLe
 	if (snoop)
 		return(1);
 
+	mrbusPktQueueLatency(q, &q->pktBufferArray[q->tailIdx]);
+
 	ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
 	{
 		if( ++q->tailIdx >= q->pktBufferArraySz )
@@ -93,9 +550,12 @@ uint8_t mrbeePktQueuePopInternal(MRBusPktQueue* q, uint8_t* data, uint8_t dataLe
 	return(1);
 }
 
-uint8_t mrbusPktQueuePopInternal(MRBusPktQueue* q, uint8_t* data, uint8_t dataLen, uint8_t snoop)
+MRBusPacket* mrbusPktQueueFront(MRBusPktQueue* q)
 {
-	return mrbeePktQueuePopInternal(q, data, dataLen, snoop, NULL);
+	if (0 == mrbusPktQueueDepth(q))
+		return(NULL);
+
+	return(&q->pktBufferArray[q->tailIdx]);
 }
 
 uint8_t mrbusPktQueueDrop(MRBusPktQueue* q)
@@ -103,6 +563,8 @@ uint8_t mrbusPktQueueDrop(MRBusPktQueue* q)
 	if (0 == mrbusPktQueueDepth(q))
 		return(0);
 
+	mrbusPktQueueLatency(q, &q->pktBufferArray[q->tailIdx]);
+
 	ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
 	{
 		if( ++q->tailIdx >= q->pktBufferArraySz )
@@ -112,3 +574,109 @@ uint8_t mrbusPktQueueDrop(MRBusPktQueue* q)
 	return(1);
 }
 
+#endif
+
+uint8_t mrbusPktQueuePushInternal(MRBusPktQueue* q, uint8_t* data, uint8_t dataLen, uint8_t rssi, uint8_t flags)
+{
+	MRBusPacket* slot = mrbusPktQueueReserve(q);
+
+	// If full, bail with a false
+	if (NULL == slot)
+		return(0);
+
+	dataLen = min(MRBUS_BUFFER_SIZE, dataLen);
+	memcpy(slot->pkt, data, dataLen);
+	memset(slot->pkt+dataLen, 0, MRBUS_BUFFER_SIZE - dataLen);
+	slot->rssi = rssi;
+	slot->flags = flags;
+
+	mrbusPktQueueCommit(q);
+	return(1);
+}
+
+#ifdef MRBUS_PKT_QUEUE_COALESCE
+uint8_t mrbusPktQueuePushCoalesce(MRBusPktQueue* q, uint8_t* data, uint8_t dataLen, uint8_t options)
+{
+	MRBusPacket* slot = mrbusPktQueueCoalesceFind(q, data, options);
+	uint8_t replaced = 0;
+	uint8_t room, len;
+
+	if (NULL != slot)
+	{
+#ifdef MRBUS_PKT_QUEUE_RING
+		room = min(slot->pkt[MRBUS_PKT_LEN], MRBUS_BUFFER_SIZE);
+#else
+		room = MRBUS_BUFFER_SIZE;
+#endif
+		len = min(room, dataLen);
+
+		// Only the final check and the copy need to be atomic - the consumer could reach the slot at any time
+		ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+		{
+			if (mrbusPktQueueCoalesceQueued(q, slot))
+			{
+				memcpy(slot->pkt, data, len);
+				memset(slot->pkt + len, 0, room - len);
+				slot->rssi = 0;
+				slot->flags = 0;
+				replaced = 1;
+			}
+		}
+	}
+
+	if (!replaced)
+		return(mrbusPktQueuePushInternal(q, data, dataLen, 0, 0));
+
+	q->coalesceCount++;
+	return(1);
+}
+#endif
+
+uint8_t mrbeePktQueuePush(MRBusPktQueue* q, uint8_t* data, uint8_t dataLen, uint8_t rssi)
+{
+	return mrbusPktQueuePushInternal(q, data, dataLen, rssi, 0);
+}
+
+uint8_t mrbusPktQueuePush(MRBusPktQueue* q, uint8_t* data, uint8_t dataLen)
+{
+	return mrbusPktQueuePushInternal(q, data, dataLen, 0, 0);
+}
+
+#ifdef MRBUS_RX_ISR_CRC
+// Where the last pop or peek copied its packet, with that packet's flags and CRC bytes
+static uint8_t* mrbusPktQueuePoppedData;
+static uint8_t mrbusPktQueuePoppedFlagsValue;
+static uint8_t mrbusPktQueuePoppedCrc[2];
+
+uint8_t mrbusPktQueuePopInternal(MRBusPktQueue* q, uint8_t* data, uint8_t dataLen, uint8_t snoop)
+{
+	// Only we take packets off, so the front packet can't change before we copy it - if the
+	// queue was empty here and one arrived since, it just goes without the flags
+	uint8_t flags = mrbusPktQueueEmpty(q) ? 0 : mrbusPktQueuePeekFlags(q);
+
+	if (!mrbeePktQueuePopInternal(q, data, dataLen, snoop, NULL))
+		return(0);
+
+	mrbusPktQueuePoppedData = (dataLen > MRBUS_PKT_CRC_H && dataLen >= data[MRBUS_PKT_LEN]) ? data : NULL;
+	mrbusPktQueuePoppedFlagsValue = flags;
+	mrbusPktQueuePoppedCrc[0] = data[MRBUS_PKT_CRC_L];
+	mrbusPktQueuePoppedCrc[1] = data[MRBUS_PKT_CRC_H];
+	return(1);
+}
+
+uint8_t mrbusPktQueuePoppedFlags(uint8_t* data)
+{
+	uint8_t flags = 0;
+
+	if (data == mrbusPktQueuePoppedData && mrbusPktQueuePoppedCrc[0] == data[MRBUS_PKT_CRC_L] && mrbusPktQueuePoppedCrc[1] == data[MRBUS_PKT_CRC_H])
+		flags = mrbusPktQueuePoppedFlagsValue;
+	mrbusPktQueuePoppedData = NULL;
+	return(flags);
+}
+#else
+uint8_t mrbusPktQueuePopInternal(MRBusPktQueue* q, uint8_t* data, uint8_t dataLen, uint8_t snoop)
+{
+	return mrbeePktQueuePopInternal(q, data, dataLen, snoop, NULL);
+}
+#endif
+
@@ -1,14 +1,120 @@
 #ifndef MRBUS_QUEUE_H
 #define MRBUS_QUEUE_H
 
+#include <stdint.h>
 #include "mrbus-constants.h"
 
+// flags and rssi lead so that a packet stored as [flags][rssi][pkt bytes] in the byte ring
+// queue is a valid prefix of an MRBusPacket.  With MRBUS_LATENCY the timestamp (mrbusHalTicks()
+// when the packet was committed to its queue) sits before pkt, so ring records carry it too.
 typedef struct 
 {
-	uint8_t pkt[MRBUS_BUFFER_SIZE];
+	uint8_t flags;
 	uint8_t rssi;
+#ifdef MRBUS_LATENCY
+	uint16_t timestamp;
+#endif
+	uint8_t pkt[MRBUS_BUFFER_SIZE];
 } MRBusPacket;
 
+#if defined(MRBUS_PKT_QUEUE_POW2) && defined(MRBUS_PKT_QUEUE_RING)
+#error "Only one of MRBUS_PKT_QUEUE_POW2 and MRBUS_PKT_QUEUE_RING may be defined"
+#endif
+
+#if defined(MRBUS_PKT_QUEUE_RING)
+
+// Variable length single producer / single consumer queue
+// Packets are stored back to back as [flags][rssi][pkt bytes] records in one byte ring, so short
+// packets only use what they need.  The packet array passed to mrbusPktQueueInitialize() is just
+// used as raw storage (up to 255 bytes of it, or 65535 with extended frames).  headIdx and tailIdx are byte offsets owned by the
+// producer and consumer respectively.  Records never wrap - if a full size packet won't fit before
+// the end of the ring, the producer leaves a wrap marker and starts again at offset 0.
+// With extended frames (MRBUS_BUFFER_SIZE above standard) the offsets are 16 bit, so the ring
+// scales with the packet size and still packs short packets.  The AVR can't read or write those in
+// one instruction, so then each side accesses the offsets with interrupts off.
+// When the consumer empties the queue while the producer has no slot reserved, it moves both
+// offsets back to the start of the ring (with interrupts off, since it then writes headIdx too).
+// A drained queue always has room for the next packet - either it was rewound, or the slot the
+// producer had reserved is still free to hand out again.
+// The ring must hold at least MRBUS_PKT_QUEUE_RING_MIN packets - a full size record and a byte.
+// A smaller ring is rejected and never accepts a packet.
+#define MRBUS_PKT_QUEUE_RING_MIN  2
+
+#if MRBUS_BUFFER_SIZE > MRBUS_BUFFER_SIZE_STANDARD
+typedef uint16_t MRBusPktQueueRingIdx;
+#else
+typedef uint8_t MRBusPktQueueRingIdx;
+#endif
+
+typedef struct
+{
+	volatile MRBusPktQueueRingIdx headIdx;
+	volatile MRBusPktQueueRingIdx tailIdx;
+	volatile uint8_t reserved;  // Producer has a slot reserved, so the consumer mustn't rewind the ring
+	volatile uint8_t pushCount;
+	volatile uint8_t popCount;
+	uint8_t* ringBuffer;
+	MRBusPktQueueRingIdx ringBufferSz;
+#ifdef MRBUS_PKT_QUEUE_COALESCE
+	uint16_t coalesceCount;
+#endif
+#ifdef MRBUS_STATS
+	uint8_t highWater;
+#endif
+} MRBusPktQueue;
+
+void mrbusPktQueueInitializeInternal(MRBusPktQueue* q, MRBusPacket* pktBufferArray, uint8_t pktBufferArraySz);
+uint8_t mrbusPktQueueFull(MRBusPktQueue* q);
+
+// The typedef fails to compile if a constant pktBufferArraySz is below MRBUS_PKT_QUEUE_RING_MIN
+// (a variable one can't be checked here, so it always passes)
+#define mrbusPktQueueInitialize(q, pktBufferArray, pktBufferArraySz) \
+	do { \
+		typedef char mrbusPktQueueRingTooSmall[(__builtin_constant_p(pktBufferArraySz) && (pktBufferArraySz) < MRBUS_PKT_QUEUE_RING_MIN)?-1:1] __attribute__((unused)); \
+		mrbusPktQueueInitializeInternal((q), (pktBufferArray), (pktBufferArraySz)); \
+	} while(0)
+
+#define mrbusPktQueueDepth(q) ((uint8_t)((q)->pushCount - (q)->popCount))
+
+#elif defined(MRBUS_PKT_QUEUE_POW2)
+
+// Lock-free single producer / single consumer queue
+// headIdx and tailIdx are free-running counters.  Only the producer writes headIdx and only
+// the consumer writes tailIdx, so no critical sections are needed as long as each queue has
+// exactly one of each (for example, RX ISR -> main loop, or main loop -> mrbusTransmit).
+// The slot is the counter masked by (pktBufferArraySz - 1), so the size must be a power of 2 <= 128.
+// A constant size is checked when mrbusPktQueueInitialize() is compiled; a size only known at run
+// time is rounded down to a power of 2 instead, leaving the rest of the array unused.
+typedef struct
+{
+	volatile uint8_t headIdx;
+	volatile uint8_t tailIdx;
+	MRBusPacket* pktBufferArray;
+	uint8_t pktBufferArraySz;
+#ifdef MRBUS_PKT_QUEUE_COALESCE
+	uint16_t coalesceCount;
+#endif
+#ifdef MRBUS_STATS
+	uint8_t highWater;
+#endif
+} MRBusPktQueue;
+
+void mrbusPktQueueInitializeInternal(MRBusPktQueue* q, MRBusPacket* pktBufferArray, uint8_t pktBufferArraySz);
+
+// The typedef fails to compile if a constant pktBufferArraySz isn't a power of 2 between 1 and 128
+// (a variable one can't be checked here, so it always passes)
+#define mrbusPktQueueInitialize(q, pktBufferArray, pktBufferArraySz) \
+	do { \
+		typedef char mrbusPktQueueSizeMustBePowerOf2[(__builtin_constant_p(pktBufferArraySz) && !((pktBufferArraySz) > 0 && (pktBufferArraySz) <= 128 && 0 == ((pktBufferArraySz) & ((pktBufferArraySz) - 1))))?-1:1] __attribute__((unused)); \
+		mrbusPktQueueInitializeInternal((q), (pktBufferArray), (pktBufferArraySz)); \
+	} while(0)
+
+#define mrbusPktQueueSlot(q, idx) (&(q)->pktBufferArray[(idx) & ((q)->pktBufferArraySz - 1)])
+#define mrbusPktQueueDepth(q) ((uint8_t)((q)->headIdx - (q)->tailIdx))
+#define mrbusPktQueueFull(q) (mrbusPktQueueDepth(q) >= (q)->pktBufferArraySz)
+
+#else
+
 typedef struct
 {
 	volatile uint8_t headIdx;
@@ -16,23 +122,82 @@ typedef struct
 	volatile uint8_t full;
 	MRBusPacket* pktBufferArray;
 	uint8_t pktBufferArraySz;
+#ifdef MRBUS_PKT_QUEUE_COALESCE
+	uint16_t coalesceCount;
+#endif
+#ifdef MRBUS_STATS
+	uint8_t highWater;
+#endif
 } MRBusPktQueue;
 
 void mrbusPktQueueInitialize(MRBusPktQueue* q, MRBusPacket* pktBufferArray, uint8_t pktBufferArraySz);
 uint8_t mrbusPktQueueDepth(MRBusPktQueue* q);
+
+#define mrbusPktQueueSlot(q, idx) (&(q)->pktBufferArray[(idx)])
+#define mrbusPktQueueFull(q) ((q)->full?1:0)
+
+#endif
+
 uint8_t mrbusPktQueuePush(MRBusPktQueue* q, uint8_t* data, uint8_t dataLen);
 uint8_t mrbusPktQueuePopInternal(MRBusPktQueue* q, uint8_t* data, uint8_t dataLen, uint8_t snoop);
 uint8_t mrbusPktQueueDrop(MRBusPktQueue* q);
 
+// Zero-copy producer interface - reserve the next free slot (NULL if full), assemble the packet
+// directly in it, then commit it to make it visible to the consumer.  A packet that won't be
+// committed must be aborted - the byte ring doesn't rewind while a slot is reserved.  The slot is
+// handed out again by the next reserve.
+MRBusPacket* mrbusPktQueueReserve(MRBusPktQueue* q);
+void mrbusPktQueueCommit(MRBusPktQueue* q);
+void mrbusPktQueueAbort(MRBusPktQueue* q);
+
+// Zero-copy consumer interface - get a pointer to the packet at the front of the queue (NULL if
+// empty), read it in place, then release it to free the slot.  The slot is only valid until released,
+// and bytes beyond pkt[MRBUS_PKT_LEN] are undefined.
+MRBusPacket* mrbusPktQueueFront(MRBusPktQueue* q);
+#define mrbusPktQueueRelease(q) mrbusPktQueueDrop(q)
+
+uint8_t mrbusPktQueuePushInternal(MRBusPktQueue* q, uint8_t* data, uint8_t dataLen, uint8_t rssi, uint8_t flags);
+
+#ifdef MRBUS_PKT_QUEUE_COALESCE
+// Last-value push for periodic status packets - if a packet with the same source, destination and
+// type (and subtype, with MRBUS_PKT_COALESCE_SUBTYPE) is already queued, it's overwritten in place
+// with the new one instead of taking another slot.  The packet at the front of the queue is never
+// touched, since mrbusTransmit() may already be sending it.  With MRBUS_PKT_QUEUE_RING the lengths
+// must also match.  Returns 0 only if a new slot was needed and the queue is full.
+// coalesceCount counts the overwritten packets - transmissions that didn't need to happen.
+uint8_t mrbusPktQueuePushCoalesce(MRBusPktQueue* q, uint8_t* data, uint8_t dataLen, uint8_t options);
+#define mrbusPktQueueCoalesced(q) ((q)->coalesceCount)
+#endif
 uint8_t mrbeePktQueuePush(MRBusPktQueue* q, uint8_t* data, uint8_t dataLen, uint8_t rssi);
 uint8_t mrbeePktQueuePopInternal(MRBusPktQueue* q, uint8_t* data, uint8_t dataLen, uint8_t snoop, uint8_t* rssi);
 
-#define mrbusPktQueueFull(q) ((q)->full?1:0)
 #define mrbusPktQueueEmpty(q) (0 == mrbusPktQueueDepth(q))
 
+#ifdef MRBUS_STATS
+// Deepest the queue has been since it was initialized or the high-water mark was cleared
+#define mrbusPktQueueHighWater(q) ((q)->highWater)
+#define mrbusPktQueueHighWaterClear(q) do { (q)->highWater = mrbusPktQueueDepth(q); } while(0)
+#endif
+
+// Flags (MRBUS_PKT_FLAG_*) of the packet at the front of the queue - only meaningful if the queue isn't empty
+#ifdef MRBUS_PKT_QUEUE_RING
+#define mrbusPktQueuePeekFlags(q) (mrbusPktQueueFront(q)->flags)
+#else
+#define mrbusPktQueuePeekFlags(q) (mrbusPktQueueSlot((q), (q)->tailIdx)->flags)
+#endif
+
 #define mrbusPktQueuePeek(q, data, dataLen) mrbusPktQueuePopInternal((q), (data), (dataLen), 1)
 #define mrbusPktQueuePop(q, data, dataLen) mrbusPktQueuePopInternal((q), (data), (dataLen), 0)
 
+// Flags of the packet the last pop or peek copied into data, if data is that buffer and still holds
+// it (0 otherwise).  Answers once per pop - mrbusPktHandler() uses it to skip the CRC walk for a
+// packet the RX ISR already checked (MRBUS_RX_ISR_CRC), without the caller passing the flags along.
+#ifdef MRBUS_RX_ISR_CRC
+uint8_t mrbusPktQueuePoppedFlags(uint8_t* data);
+#else
+#define mrbusPktQueuePoppedFlags(data) 0
+#endif
+
 #define mrbeePktQueuePeek(q, data, dataLen, rssiPtr) mrbeePktQueuePopInternal((q), (data), (dataLen), 1, rssiPtr)
 #define mrbeePktQueuePop(q, data, dataLen, rssiPtr) mrbeePktQueuePopInternal((q), (data), (dataLen), 0, rssiPtr)
 
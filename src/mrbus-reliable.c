@@ -0,0 +1,328 @@
+// Reliable delivery (MRBUS_RELIABLE) - see mrbus-reliable.h
+
+#include <string.h>
+
+#include "mrbus.h"
+
+#ifdef MRBUS_RELIABLE
+
+// MRBusReliablePeer flags
+#define MRBUS_RELIABLE_PEER_USED      0x01
+#define MRBUS_RELIABLE_PEER_TX_SYNC   0x02  // Our packets to it still carry MRBUS_RELIABLE_SEQ_SYNC
+#define MRBUS_RELIABLE_PEER_TX_ACKED  0x04  // It has acknowledged something of ours
+#define MRBUS_RELIABLE_PEER_RX_VALID  0x08  // rxHigh and rxSeen mean something
+#define MRBUS_RELIABLE_PEER_RX_SYNC   0x10  // Its last packet was marked MRBUS_RELIABLE_SEQ_SYNC
+
+typedef struct
+{
+	uint8_t addr;
+	uint8_t flags;
+	uint8_t txSeq;     // Sequence number of our next packet to it
+	uint8_t rxHigh;    // Highest sequence number heard from it
+	uint8_t rxSeen;    // Bit n set once rxHigh - n has been received
+	uint8_t lastUse;   // mrbusReliableClock when last looked up, for replacement
+} MRBusReliablePeer;
+
+typedef struct
+{
+	uint8_t pkt[MRBUS_BUFFER_SIZE];   // Wrapped packet, as pushed to the transmit queue - free if the length is 0
+	uint16_t deadline;                // Push it again once mrbusHalTicks() gets here
+	uint8_t sends;                    // Times pushed so far
+} MRBusReliableSlot;
+
+static MRBusPktQueue* mrbusReliableTxQueue;
+static MRBusReliableSlot mrbusReliableSlots[MRBUS_RELIABLE_SLOTS];
+static MRBusReliablePeer mrbusReliablePeers[MRBUS_RELIABLE_PEERS];
+static uint8_t mrbusReliableClock;
+
+// Last data packet received, unwrapped - the packet in the receive buffer is never changed, since
+// it may be a record in the receive queue that's released by its length
+uint8_t mrbusReliableRxBuffer[MRBUS_BUFFER_SIZE];
+
+void mrbusReliableInit(MRBusPktQueue* txQueue)
+{
+	mrbusReliableTxQueue = txQueue;
+	memset(mrbusReliableSlots, 0, sizeof(mrbusReliableSlots));
+	memset(mrbusReliablePeers, 0, sizeof(mrbusReliablePeers));
+}
+
+// Packets to dest still waiting for an ack (0xFF - to anyone), or just those marked with sync
+static uint8_t mrbusReliableOutstanding(uint8_t dest, uint8_t syncOnly)
+{
+	MRBusReliableSlot* slot;
+	uint8_t i, count = 0;
+
+	for (i=0; i<MRBUS_RELIABLE_SLOTS; i++)
+	{
+		slot = &mrbusReliableSlots[i];
+		if (0 == slot->pkt[MRBUS_PKT_LEN])
+			continue;
+		if (0xFF != dest && slot->pkt[MRBUS_PKT_DEST] != dest)
+			continue;
+		if (syncOnly && !(slot->pkt[6] & MRBUS_RELIABLE_SEQ_SYNC))
+			continue;
+		count++;
+	}
+	return(count);
+}
+
+// Finds the peer entry for addr.  With create, a new one replaces a free entry or failing that the
+// least recently used one with nothing outstanding - NULL if there's no such entry.
+static MRBusReliablePeer* mrbusReliablePeer(uint8_t addr, uint8_t create)
+{
+	MRBusReliablePeer* peer;
+	MRBusReliablePeer* victim = NULL;
+	uint8_t i, age, oldest = 0;
+
+	mrbusReliableClock++;
+	for (i=0; i<MRBUS_RELIABLE_PEERS; i++)
+	{
+		peer = &mrbusReliablePeers[i];
+		if ((peer->flags & MRBUS_RELIABLE_PEER_USED) && peer->addr == addr)
+		{
+			peer->lastUse = mrbusReliableClock;
+			return(peer);
+		}
+	}
+
+	if (!create)
+		return(NULL);
+
+	for (i=0; i<MRBUS_RELIABLE_PEERS; i++)
+	{
+		peer = &mrbusReliablePeers[i];
+		if (!(peer->flags & MRBUS_RELIABLE_PEER_USED))
+		{
+			victim = peer;
+			break;
+		}
+		age = mrbusReliableClock - peer->lastUse;
+		if (age >= oldest && !mrbusReliableOutstanding(peer->addr, 0))
+		{
+			oldest = age;
+			victim = peer;
+		}
+	}
+
+	if (NULL != victim)
+	{
+		memset(victim, 0, sizeof(MRBusReliablePeer));
+		victim->addr = addr;
+		victim->flags = MRBUS_RELIABLE_PEER_USED | MRBUS_RELIABLE_PEER_TX_SYNC;
+		victim->lastUse = mrbusReliableClock;
+	}
+	return(victim);
+}
+
+// Sync marks stop once the peer has acknowledged something and none of the marked packets are
+// left - so a marked retransmit can never follow an unmarked packet and reset the receiver
+static void mrbusReliableSyncCheck(uint8_t addr)
+{
+	MRBusReliablePeer* peer = mrbusReliablePeer(addr, 0);
+
+	if (NULL != peer && (peer->flags & MRBUS_RELIABLE_PEER_TX_ACKED) && !mrbusReliableOutstanding(addr, 1))
+		peer->flags &= ~MRBUS_RELIABLE_PEER_TX_SYNC;
+}
+
+// Pushes the slot's packet and sets the next deadline, doubling the wait each time.  If the
+// transmit queue is full, the deadline is left where it was to try again on the next poll.
+static void mrbusReliableXmit(MRBusReliableSlot* slot, uint16_t now)
+{
+	uint16_t timeout = MRBUS_RELIABLE_TIMEOUT;
+	uint8_t i;
+
+	if (!mrbusPktQueuePush(mrbusReliableTxQueue, slot->pkt, slot->pkt[MRBUS_PKT_LEN]))
+		return;
+
+	for (i=slot->sends; i && timeout < MRBUS_RELIABLE_TIMEOUT_MAX; i--)
+		timeout <<= 1;
+	if (timeout > MRBUS_RELIABLE_TIMEOUT_MAX)
+		timeout = MRBUS_RELIABLE_TIMEOUT_MAX;
+
+	slot->sends++;
+	slot->deadline = now + timeout + (now & MRBUS_RELIABLE_JITTER);
+}
+
+// Undoes the wrapping
+static void mrbusReliableUnwrap(uint8_t* dst, uint8_t* src)
+{
+	uint8_t len = src[MRBUS_PKT_LEN] - 2;
+	uint8_t type = src[7];
+
+	dst[MRBUS_PKT_DEST] = src[MRBUS_PKT_DEST];
+	dst[MRBUS_PKT_SRC] = src[MRBUS_PKT_SRC];
+	dst[MRBUS_PKT_LEN] = len;
+	dst[MRBUS_PKT_CRC_L] = src[MRBUS_PKT_CRC_L];
+	dst[MRBUS_PKT_CRC_H] = src[MRBUS_PKT_CRC_H];
+	dst[MRBUS_PKT_TYPE] = type;
+	memcpy(dst + 6, src + 8, len - 6);
+}
+
+// Queues pkt for reliable delivery to pkt[MRBUS_PKT_DEST].  Returns 0, and the packet isn't sent,
+// if it's a broadcast, too long to wrap, or the window or slots are full - try again later.
+uint8_t mrbusReliableSend(uint8_t* pkt)
+{
+	MRBusReliableSlot* slot = NULL;
+	MRBusReliablePeer* peer;
+	uint8_t i, len = pkt[MRBUS_PKT_LEN];
+
+	if (NULL == mrbusReliableTxQueue || 0xFF == pkt[MRBUS_PKT_DEST] || len <= MRBUS_PKT_TYPE || len > MRBUS_BUFFER_SIZE - 2)
+		return(0);
+
+	if (mrbusReliableOutstanding(pkt[MRBUS_PKT_DEST], 0) >= MRBUS_RELIABLE_WINDOW)
+		return(0);
+
+	for (i=0; i<MRBUS_RELIABLE_SLOTS && NULL == slot; i++)
+	{
+		if (0 == mrbusReliableSlots[i].pkt[MRBUS_PKT_LEN])
+			slot = &mrbusReliableSlots[i];
+	}
+	if (NULL == slot)
+		return(0);
+
+	peer = mrbusReliablePeer(pkt[MRBUS_PKT_DEST], 1);
+	if (NULL == peer)
+		return(0);
+
+	slot->pkt[MRBUS_PKT_DEST] = pkt[MRBUS_PKT_DEST];
+	slot->pkt[MRBUS_PKT_SRC] = pkt[MRBUS_PKT_SRC];
+	slot->pkt[MRBUS_PKT_LEN] = len + 2;
+	slot->pkt[MRBUS_PKT_CRC_L] = 0;
+	slot->pkt[MRBUS_PKT_CRC_H] = 0;
+	slot->pkt[MRBUS_PKT_TYPE] = MRBUS_RELIABLE_PKT_TYPE;
+	slot->pkt[6] = peer->txSeq | ((peer->flags & MRBUS_RELIABLE_PEER_TX_SYNC) ? MRBUS_RELIABLE_SEQ_SYNC : 0);
+	slot->pkt[7] = pkt[MRBUS_PKT_TYPE];
+	memcpy(slot->pkt + 8, pkt + 6, len - 6);
+	peer->txSeq = (peer->txSeq + 1) & MRBUS_RELIABLE_SEQ_MASK;
+
+	slot->sends = 0;
+	mrbusReliableXmit(slot, mrbusHalTicks());
+	return(1);
+}
+
+// Packets to dest still waiting for an ack - 0xFF counts them all
+uint8_t mrbusReliablePending(uint8_t dest)
+{
+	return(mrbusReliableOutstanding(dest, 0));
+}
+
+// Retransmits whatever has waited too long for its ack.  Returns 1 when a packet runs out of
+// retries, with the packet as it was given to mrbusReliableSend() in failedPkt (if not NULL),
+// otherwise 0.  One failure per call - keep calling.
+uint8_t mrbusReliablePoll(uint8_t* failedPkt)
+{
+	MRBusReliableSlot* slot;
+	uint16_t now = mrbusHalTicks();
+	uint8_t i, dest;
+
+	for (i=0; i<MRBUS_RELIABLE_SLOTS; i++)
+	{
+		slot = &mrbusReliableSlots[i];
+		if (0 == slot->pkt[MRBUS_PKT_LEN] || (int16_t)(now - slot->deadline) < 0)
+			continue;
+
+		if (slot->sends > MRBUS_RELIABLE_RETRIES)
+		{
+			if (NULL != failedPkt)
+				mrbusReliableUnwrap(failedPkt, slot->pkt);
+			dest = slot->pkt[MRBUS_PKT_DEST];
+			slot->pkt[MRBUS_PKT_LEN] = 0;
+			mrbusReliableSyncCheck(dest);
+			return(1);
+		}
+
+		mrbusReliableXmit(slot, now);
+	}
+	return(0);
+}
+
+// Acks every copy, then drops duplicates and hands the rest on unwrapped, in mrbusReliableRxBuffer
+uint8_t mrbusPktHandleReliable(uint8_t* rxBuffer, uint8_t* txBuffer, uint8_t mrbus_dev_addr)
+{
+	MRBusReliablePeer* peer;
+	uint8_t ack[7];
+	uint8_t seq, ahead, back, dup = 0;
+
+	if (0xFF == rxBuffer[MRBUS_PKT_DEST] || rxBuffer[MRBUS_PKT_LEN] < 8 || rxBuffer[MRBUS_PKT_LEN] > MRBUS_BUFFER_SIZE || MRBUS_RELIABLE_PKT_TYPE == rxBuffer[7])
+		return(0);
+
+	// Nowhere to track it - don't ack, it'll be back
+	peer = mrbusReliablePeer(rxBuffer[MRBUS_PKT_SRC], 1);
+	if (NULL == peer)
+		return(0);
+
+	seq = rxBuffer[6] & MRBUS_RELIABLE_SEQ_MASK;
+	if (!(peer->flags & MRBUS_RELIABLE_PEER_RX_VALID) || ((rxBuffer[6] & MRBUS_RELIABLE_SEQ_SYNC) && !(peer->flags & MRBUS_RELIABLE_PEER_RX_SYNC)))
+	{
+		// First we've heard from it, or it has restarted
+		peer->rxHigh = seq;
+		peer->rxSeen = 0x01;
+		peer->flags |= MRBUS_RELIABLE_PEER_RX_VALID;
+	}
+	else
+	{
+		// Newer than anything so far, or one of the 8 before the newest that we haven't had yet.
+		// Anything older than that is taken to be a duplicate.
+		ahead = (seq - peer->rxHigh) & MRBUS_RELIABLE_SEQ_MASK;
+		back = (peer->rxHigh - seq) & MRBUS_RELIABLE_SEQ_MASK;
+		if (ahead && ahead < 64)
+		{
+			peer->rxSeen = (ahead < 8) ? (peer->rxSeen << ahead) | 0x01 : 0x01;
+			peer->rxHigh = seq;
+		}
+		else if (back < 8 && !(peer->rxSeen & _BV(back)))
+			peer->rxSeen |= _BV(back);
+		else
+			dup = 1;
+	}
+
+	if (rxBuffer[6] & MRBUS_RELIABLE_SEQ_SYNC)
+		peer->flags |= MRBUS_RELIABLE_PEER_RX_SYNC;
+	else
+		peer->flags &= ~MRBUS_RELIABLE_PEER_RX_SYNC;
+
+	// A duplicate means our last ack went missing, so it gets one too
+	ack[MRBUS_PKT_DEST] = rxBuffer[MRBUS_PKT_SRC];
+	ack[MRBUS_PKT_SRC] = mrbus_dev_addr;
+	ack[MRBUS_PKT_LEN] = 7;
+	ack[MRBUS_PKT_CRC_L] = 0;
+	ack[MRBUS_PKT_CRC_H] = 0;
+	ack[MRBUS_PKT_TYPE] = MRBUS_RELIABLE_ACK_PKT_TYPE;
+	ack[6] = seq;
+	if (NULL != mrbusReliableTxQueue)
+		mrbusPktQueuePush(mrbusReliableTxQueue, ack, sizeof(ack));
+
+	if (dup)
+		return(0);
+
+	mrbusReliableUnwrap(mrbusReliableRxBuffer, rxBuffer);
+	return(mrbusPktHandlerInternal(mrbusReliableRxBuffer, txBuffer, mrbus_dev_addr, MRBUS_PKT_FLAG_CRC_VALID));
+}
+
+uint8_t mrbusPktHandleReliableAck(uint8_t* rxBuffer, uint8_t* txBuffer, uint8_t mrbus_dev_addr)
+{
+	MRBusReliableSlot* slot;
+	MRBusReliablePeer* peer;
+	uint8_t i;
+
+	if (0xFF == rxBuffer[MRBUS_PKT_DEST] || rxBuffer[MRBUS_PKT_LEN] < 7)
+		return(0);
+
+	for (i=0; i<MRBUS_RELIABLE_SLOTS; i++)
+	{
+		slot = &mrbusReliableSlots[i];
+		if (0 != slot->pkt[MRBUS_PKT_LEN] && slot->pkt[MRBUS_PKT_DEST] == rxBuffer[MRBUS_PKT_SRC]
+			&& (slot->pkt[6] & MRBUS_RELIABLE_SEQ_MASK) == rxBuffer[6])
+		{
+			slot->pkt[MRBUS_PKT_LEN] = 0;
+			peer = mrbusReliablePeer(rxBuffer[MRBUS_PKT_SRC], 0);
+			if (NULL != peer)
+				peer->flags |= MRBUS_RELIABLE_PEER_TX_ACKED;
+			mrbusReliableSyncCheck(rxBuffer[MRBUS_PKT_SRC]);
+			break;
+		}
+	}
+	return(0);
+}
+
+#endif
@@ -0,0 +1,123 @@
+#ifndef MRBUS_RELIABLE_H
+#define MRBUS_RELIABLE_H
+
+#include <stdint.h>
+#include "mrbus-hal.h"
+#include "mrbus-constants.h"
+#include "mrbus-queue.h"
+
+#ifdef MRBUS_RELIABLE
+
+// Reliable delivery (MRBUS_RELIABLE) - shared by the wired and XBee drivers
+// mrbusReliableSend() wraps a packet in an MRBUS_RELIABLE_PKT_TYPE packet with a per-destination
+// sequence number and keeps a copy until the destination acknowledges it.  Unacknowledged packets
+// go out again from mrbusReliablePoll(), each wait twice the one before, and are given up on after
+// MRBUS_RELIABLE_RETRIES retransmits.  Up to MRBUS_RELIABLE_WINDOW packets can be outstanding to
+// each destination at once.
+//
+// The receiving node's mrbusPktHandler() acknowledges the packet, drops it if it's a duplicate, and
+// otherwise unwraps it into mrbusReliableRxBuffer and handles that like any other packet - so a
+// reliable 'W' still gets its 'w', and a reliable application packet still returns
+// MRBUS_HANDLER_CUSTOM.  The packet passed in is left as it is (it may be a receive queue record,
+// released by its length), so whatever the handler returns, the application looks at the packet
+// mrbusReliableRxPkt(rxBuffer) gives it rather than rxBuffer itself:
+//
+//   if (MRBUS_HANDLER_CUSTOM == mrbusPktHandler(rxBuffer, txBuffer, addr))
+//       { handle mrbusReliableRxPkt(rxBuffer) }
+//
+// The unwrapped packet's CRC bytes are stale; it has already been checked.  Wrapping takes two
+// bytes, so reliable packets carry two bytes less than MRBUS_BUFFER_SIZE allows.
+//
+// The main loop calls mrbusReliablePoll() alongside the packet handler:
+//
+//   if (mrbusReliablePoll(failedPkt))
+//       { failedPkt was never acknowledged - deal with it }
+//
+// Retransmit timing comes from mrbusHalTicks(), so on the AVR the application keeps the 50kHz
+// ticks50kHz counter running (see mrbus-hal.h).  Times are in those 20uS ticks.
+//
+// Each peer in MRBUS_RELIABLE_PEERS holds both directions - our sequence numbers to it, and which
+// of its sequence numbers we've seen.  When the table is full the oldest idle peer is dropped, so
+// size it for every node this one exchanges reliable packets with.  A sender marks its packets with
+// MRBUS_RELIABLE_SEQ_SYNC until its first window is acknowledged, so receivers start afresh when
+// it restarts (unless it restarts again before then).
+
+// Data packet: [6] sequence number, [7] the wrapped packet's type, [8...] its data.  The ack is the
+// lower case type, with the sequence number in [6].
+#ifndef MRBUS_RELIABLE_PKT_TYPE
+#define MRBUS_RELIABLE_PKT_TYPE      'Y'
+#endif
+#ifndef MRBUS_RELIABLE_ACK_PKT_TYPE
+#define MRBUS_RELIABLE_ACK_PKT_TYPE  'y'
+#endif
+
+#define MRBUS_RELIABLE_SEQ_MASK      0x7F
+#define MRBUS_RELIABLE_SEQ_SYNC      0x80  // Sender has just started - receiver drops its old state
+
+// Packets waiting for an ack, across all destinations
+#ifndef MRBUS_RELIABLE_SLOTS
+#define MRBUS_RELIABLE_SLOTS         4
+#endif
+
+// Packets waiting for an ack, to any one destination
+#ifndef MRBUS_RELIABLE_WINDOW
+#define MRBUS_RELIABLE_WINDOW        2
+#endif
+
+#ifndef MRBUS_RELIABLE_PEERS
+#define MRBUS_RELIABLE_PEERS         4
+#endif
+
+#ifndef MRBUS_RELIABLE_RETRIES
+#define MRBUS_RELIABLE_RETRIES       4
+#endif
+
+// First ack timeout (50mS), the cap on its doubling (500mS), and a mask applied to the tick count
+// to spread out retransmits from nodes that lost packets at the same moment (up to 10mS)
+#ifndef MRBUS_RELIABLE_TIMEOUT
+#define MRBUS_RELIABLE_TIMEOUT       2500
+#endif
+#ifndef MRBUS_RELIABLE_TIMEOUT_MAX
+#define MRBUS_RELIABLE_TIMEOUT_MAX   25000
+#endif
+#ifndef MRBUS_RELIABLE_JITTER
+#define MRBUS_RELIABLE_JITTER        0x01FF
+#endif
+
+#if (MRBUS_RELIABLE_WINDOW < 1) || (MRBUS_RELIABLE_WINDOW > 8)
+#error "MRBUS_RELIABLE_WINDOW must be 1 to 8"
+#endif
+
+#if (MRBUS_RELIABLE_SLOTS < MRBUS_RELIABLE_WINDOW) || (MRBUS_RELIABLE_SLOTS > 32)
+#error "MRBUS_RELIABLE_SLOTS must be MRBUS_RELIABLE_WINDOW to 32"
+#endif
+
+#if (MRBUS_RELIABLE_PEERS < 1) || (MRBUS_RELIABLE_PEERS > 255)
+#error "MRBUS_RELIABLE_PEERS must be 1 to 255"
+#endif
+
+#if (MRBUS_RELIABLE_TIMEOUT < 1) || (MRBUS_RELIABLE_TIMEOUT > MRBUS_RELIABLE_TIMEOUT_MAX) || (MRBUS_RELIABLE_TIMEOUT_MAX + MRBUS_RELIABLE_JITTER > 32767)
+#error "MRBUS_RELIABLE_TIMEOUT must be at least 1 and no more than MRBUS_RELIABLE_TIMEOUT_MAX, which plus MRBUS_RELIABLE_JITTER must be under 32768"
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+extern uint8_t mrbusReliableRxBuffer[MRBUS_BUFFER_SIZE];
+
+// The packet the handler just dealt with - unwrapped if rxBuffer was a reliable data packet
+#define mrbusReliableRxPkt(rxBuffer) ((MRBUS_RELIABLE_PKT_TYPE == (rxBuffer)[MRBUS_PKT_TYPE]) ? mrbusReliableRxBuffer : (rxBuffer))
+
+void mrbusReliableInit(MRBusPktQueue* txQueue);
+uint8_t mrbusReliableSend(uint8_t* pkt);
+uint8_t mrbusReliablePending(uint8_t dest);
+uint8_t mrbusReliablePoll(uint8_t* failedPkt);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
+
+#endif
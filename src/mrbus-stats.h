@@ -0,0 +1,65 @@
+#ifndef MRBUS_STATS_H
+#define MRBUS_STATS_H
+
+#include <stdint.h>
+#include "mrbus-hal.h"
+#include "mrbus-queue.h"
+
+#if defined(MRBUS_LATENCY) && !defined(MRBUS_STATS)
+#error "MRBUS_LATENCY needs MRBUS_STATS"
+#endif
+
+#ifdef MRBUS_STATS
+
+// Driver statistics (MRBUS_STATS) - shared by the wired and XBee drivers, whichever is linked in
+// Counters are 16 bit and wrap.  Most are written by ISRs - read them with interrupts off, or
+// ask for them over the bus with an MRBUS_STATS_PKT_TYPE packet (see mrbusPktHandler()).
+// Queue high-water marks are kept in each queue - rxQueue and txQueue are the driver's own
+// queues, set by its init, so the stats reply can include them.
+typedef struct
+{
+	uint16_t rxPkts;          // Complete packets received, wherever they went
+	uint16_t txPkts;          // Packets sent
+	uint16_t rxQueueFull;     // Received packets lost to a full RX queue
+	uint16_t rxFrameErrors;   // UART errors that cut off a packet in progress
+	uint16_t rxOverlong;      // Packets longer than MRBUS_BUFFER_SIZE, truncated or dropped
+	uint16_t rxCrcErrors;     // MRBus CRC failures, in the RX ISR or the packet handler
+	uint16_t rxBadChecksum;   // XBee API frame checksum failures
+	uint16_t txArbLost;       // Lost arbitrations, including activity during the wait
+#ifdef MRBUS_LATENCY
+	// Latency histograms, in 20uS ticks - see MRBUS_LATENCY_BUCKETS
+	uint16_t txQueueWait[MRBUS_LATENCY_BUCKETS];  // Pushed to first arbitration attempt (XBee: to sent)
+	uint16_t txArbTime[MRBUS_LATENCY_BUCKETS];    // First arbitration attempt to winning the bus
+	uint16_t rxQueueWait[MRBUS_LATENCY_BUCKETS];  // Received to released by the application
+#endif
+	MRBusPktQueue* rxQueue;
+	MRBusPktQueue* txQueue;
+} MRBusStats;
+
+extern MRBusStats mrbusStats;
+
+#define mrbusStatsInc(counter) do { mrbusStats.counter++; } while(0)
+// For a counter that an ISR also increments, from outside it - a 16 bit increment isn't atomic on the AVR
+#define mrbusStatsIncAtomic(counter) do { ATOMIC_BLOCK(ATOMIC_RESTORESTATE) { mrbusStats.counter++; } } while(0)
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+void mrbusStatsClear(void);
+#ifdef MRBUS_LATENCY
+void mrbusLatencyRecord(uint16_t* histogram, uint16_t ticks);
+#endif
+
+#ifdef __cplusplus
+}
+#endif
+
+#else
+
+#define mrbusStatsInc(counter) do { } while(0)
+#define mrbusStatsIncAtomic(counter) do { } while(0)
+
+#endif
+
+#endif
@@ -28,41 +28,247 @@ LICENSE:
 #define MRBUS_H
 
 
-#ifdef __AVR__
 #include <stdlib.h>
-#include <avr/io.h>
-#include <avr/interrupt.h>
-#include <util/delay.h>
-#include <util/atomic.h>
+#include "mrbus-hal.h"
 #include "mrbus-constants.h"
 #include "mrbus-queue.h"
+#include "mrbus-stats.h"
+#include "mrbus-eeprom.h"
+#include "mrbus-reliable.h"
 #include "mrbus-macros.h"
+#ifdef __AVR__
 #include "mrbus-avr.h"
+#else
+#include "mrbus-host.h"
+#endif
+
+#ifndef MRBUS_TX_LANES
+#define MRBUS_TX_LANES 1
+#endif
+
+#if MRBUS_TX_LANES < 1
+#error "MRBUS_TX_LANES must be at least 1"
 #endif
 
 // Global variable externs, so everybody can see the public mrbus variables
 extern MRBusPktQueue mrbusRxQueue;
 extern MRBusPktQueue mrbusTxQueue;
 
+#if MRBUS_TX_LANES > 1
+// Transmit priority lanes - lane 0 is mrbusTxQueue, lanes 1 to MRBUS_TX_LANES-1 are progressively
+// more urgent.  mrbusTransmit() always sends from the highest non-empty lane, arbitrating at that
+// lane's priority.  Each lane queue is initialized by the application, the same as mrbusTxQueue.
+extern MRBusPktQueue mrbusTxLaneQueue[MRBUS_TX_LANES - 1];
+#define mrbusTxLane(lane) ((lane) ? &mrbusTxLaneQueue[(lane) - 1] : &mrbusTxQueue)
+#else
+#define mrbusTxLane(lane) (&mrbusTxQueue)
+#endif
+
+#ifdef MRBUS_RX_FILTER
+// Wired RX ISR filter - packets that fail are never queued
+// A packet passes the address stage if it's sent to addr, to broadcast (if enabled), or comes from a
+// source set in srcMask (promiscuous).  It then passes the type stage if its type is set in typeMask.
+// Packets taken by the MRBUS_RX_STATE table skip the filter and aren't counted as drops.
+// Counters are written by the RX ISR - read them with interrupts off.
+typedef struct
+{
+	uint8_t options;
+	uint8_t addr;
+	uint8_t srcMask[32];
+	uint8_t typeMask[32];
+	uint16_t dropOwnPkts;
+	uint16_t dropAddress;
+	uint16_t dropType;
+} MRBusRxFilter;
+
+extern MRBusRxFilter mrbusRxFilter;
+#endif
+
+#ifdef MRBUS_RX_STATE
+// Per-source last-value table - an RX sink alongside mrbusRxQueue for status packets, where only
+// the latest from each node matters.  Packets of a type set in typeMask from sources firstSrc to
+// firstSrc+count-1 are written by the RX ISR into table[src - firstSrc] instead of being queued,
+// and the source's bit is set in dirty.  A newer packet simply replaces one that hasn't been read
+// yet, so bursts can't crowd out the latest state.  The RX filter doesn't apply to these packets.
+// Without MRBUS_RX_ISR_CRC a corrupt packet can replace good state, so check the CRC when reading.
+// Counters are written by the RX ISR - read them with interrupts off.
+typedef struct
+{
+	MRBusPacket* table;
+	uint8_t firstSrc;
+	uint8_t count;
+	uint8_t next;
+	uint8_t typeMask[32];
+	uint8_t dirty[32];
+	uint16_t updates;
+	uint16_t overwrites;
+} MRBusRxState;
+
+extern MRBusRxState mrbusRxState;
+#endif
+
+// Packet handlers - built-in or application, all with the same signature and returning an
+// MRBUS_HANDLER_* code (or 0 for a packet that wasn't handled after all)
+typedef uint8_t (*MRBusPktHandlerFn)(uint8_t* rxBuffer, uint8_t* txBuffer, uint8_t mrbus_dev_addr);
+
+#ifdef MRBUS_PKT_DISPATCH
+// Dispatch table (MRBUS_PKT_DISPATCH) - mrbusPktHandler() looks up the handler for a packet type
+// in the application's PROGMEM table instead of testing for each built-in type in turn.  Types
+// without an entry return MRBUS_HANDLER_CUSTOM, as before.  Build it with MRBUS_PKT_HANDLER(),
+// starting from MRBUS_PKT_HANDLERS_BUILTIN (each entry, like the built-in ones, ends in a comma):
+//
+//   #define MRBUS_PKT_HANDLER_OVERRIDE_RESET    // No remote reset - leave 'X' to the application
+//   #include "mrbus.h"
+//
+//   const MRBusPktHandlerFn mrbusPktHandlers[MRBUS_PKT_HANDLER_TYPES] PROGMEM =
+//   {
+//       MRBUS_PKT_HANDLERS_BUILTIN
+//       MRBUS_PKT_HANDLER('C', appHandleCommand),
+//   };
+//
+// Each built-in entry is left out of the list when its MRBUS_PKT_HANDLER_OVERRIDE_* is defined
+// before mrbus.h is included, so the application can give that type its own handler or none.
+// A type is only ever initialized once, so the table builds cleanly with -Woverride-init.  The
+// table needs C99 designated initializers, so it goes in a C source file.
+extern const MRBusPktHandlerFn mrbusPktHandlers[MRBUS_PKT_HANDLER_TYPES] PROGMEM;
+
+#define MRBUS_PKT_HANDLER(type, fn) [(uint8_t)(type) - MRBUS_PKT_HANDLER_FIRST] = (fn)
+
+#ifndef MRBUS_PKT_HANDLER_OVERRIDE_PING
+#define MRBUS_PKT_HANDLERS_PING MRBUS_PKT_HANDLER('A', mrbusPktHandlePing),
+#else
+#define MRBUS_PKT_HANDLERS_PING
+#endif
+
+#ifndef MRBUS_PKT_HANDLER_OVERRIDE_EEPROM_WRITE
+#define MRBUS_PKT_HANDLERS_EEPROM_WRITE MRBUS_PKT_HANDLER('W', mrbusPktHandleEepromWrite),
+#else
+#define MRBUS_PKT_HANDLERS_EEPROM_WRITE
+#endif
+
+#ifndef MRBUS_PKT_HANDLER_OVERRIDE_EEPROM_READ
+#define MRBUS_PKT_HANDLERS_EEPROM_READ MRBUS_PKT_HANDLER('R', mrbusPktHandleEepromRead),
+#else
+#define MRBUS_PKT_HANDLERS_EEPROM_READ
+#endif
+
+#ifndef MRBUS_PKT_HANDLER_OVERRIDE_VERSION
+#define MRBUS_PKT_HANDLERS_VERSION MRBUS_PKT_HANDLER('V', mrbusPktHandleVersion),
+#else
+#define MRBUS_PKT_HANDLERS_VERSION
+#endif
+
+#ifndef MRBUS_PKT_HANDLER_OVERRIDE_RESET
+#define MRBUS_PKT_HANDLERS_RESET MRBUS_PKT_HANDLER('X', mrbusPktHandleReset),
+#else
+#define MRBUS_PKT_HANDLERS_RESET
+#endif
+
+#if defined(MRBUS_STATS) && !defined(MRBUS_PKT_HANDLER_OVERRIDE_STATS)
+#define MRBUS_PKT_HANDLERS_STATS MRBUS_PKT_HANDLER(MRBUS_STATS_PKT_TYPE, mrbusPktHandleStats),
+#else
+#define MRBUS_PKT_HANDLERS_STATS
+#endif
+
+#if defined(MRBUS_EEPROM_EXT) && !defined(MRBUS_PKT_HANDLER_OVERRIDE_EEPROM_EXT)
+#define MRBUS_PKT_HANDLERS_EEPROM_EXT MRBUS_PKT_HANDLER(MRBUS_EE_EXT_PKT_TYPE, mrbusPktHandleEepromExt),
+#else
+#define MRBUS_PKT_HANDLERS_EEPROM_EXT
+#endif
+
+#if defined(MRBUS_FAST_BAUD) && !defined(MRBUS_PKT_HANDLER_OVERRIDE_DATA_RATE)
+#define MRBUS_PKT_HANDLERS_DATA_RATE MRBUS_PKT_HANDLER(MRBUS_DATA_RATE_PKT_TYPE, mrbusPktHandleDataRate),
+#else
+#define MRBUS_PKT_HANDLERS_DATA_RATE
+#endif
+
+#if defined(MRBUS_RELIABLE) && !defined(MRBUS_PKT_HANDLER_OVERRIDE_RELIABLE)
+#define MRBUS_PKT_HANDLERS_RELIABLE MRBUS_PKT_HANDLER(MRBUS_RELIABLE_PKT_TYPE, mrbusPktHandleReliable),
+#else
+#define MRBUS_PKT_HANDLERS_RELIABLE
+#endif
+
+#if defined(MRBUS_RELIABLE) && !defined(MRBUS_PKT_HANDLER_OVERRIDE_RELIABLE_ACK)
+#define MRBUS_PKT_HANDLERS_RELIABLE_ACK MRBUS_PKT_HANDLER(MRBUS_RELIABLE_ACK_PKT_TYPE, mrbusPktHandleReliableAck),
+#else
+#define MRBUS_PKT_HANDLERS_RELIABLE_ACK
+#endif
+
+#define MRBUS_PKT_HANDLERS_BUILTIN \
+	MRBUS_PKT_HANDLERS_PING \
+	MRBUS_PKT_HANDLERS_EEPROM_WRITE \
+	MRBUS_PKT_HANDLERS_EEPROM_READ \
+	MRBUS_PKT_HANDLERS_VERSION \
+	MRBUS_PKT_HANDLERS_RESET \
+	MRBUS_PKT_HANDLERS_EEPROM_EXT \
+	MRBUS_PKT_HANDLERS_STATS \
+	MRBUS_PKT_HANDLERS_DATA_RATE \
+	MRBUS_PKT_HANDLERS_RELIABLE \
+	MRBUS_PKT_HANDLERS_RELIABLE_ACK
+#endif
+
 #ifdef __cplusplus
 extern "C" {
 #endif
 
-#ifdef __AVR__
 uint16_t mrbusCRC16Update(uint16_t crc, uint8_t a);
-#endif
 
 void mrbusInit(void);
 void mrbusSetPriority(uint8_t priority);
+#if MRBUS_TX_LANES > 1
+void mrbusTxLaneInit(uint8_t lane, uint8_t priority, uint8_t options);
+#endif
+#ifdef MRBUS_RX_FILTER
+void mrbusRxFilterInit(uint8_t mrbus_dev_addr, uint8_t options);
+void mrbusRxFilterSource(uint8_t src, uint8_t enable);
+void mrbusRxFilterType(uint8_t type, uint8_t enable);
+#endif
+#ifdef MRBUS_RX_STATE
+void mrbusRxStateInit(MRBusPacket* table, uint8_t firstSrc, uint8_t count);
+void mrbusRxStateType(uint8_t type, uint8_t enable);
+uint8_t mrbusRxStatePop(uint8_t* data, uint8_t dataLen);
+#endif
+#ifdef MRBUS_FAST_BAUD
+void mrbusSetDataRate(uint8_t rate);
+uint8_t mrbusGetDataRate(void);
+#endif
 uint8_t mrbusTxActive();
 uint8_t mrbusTransmit(void);
+#if defined(MRBUS_WAIT_TYPE) && (MRBUS_WAIT_TYPE == 2)
+uint8_t mrbusArbStatus(void);
+#endif
 uint8_t mrbusIsBusIdle();
 uint8_t mrbusIsCrcValid(uint8_t* pktBuffer);
 uint8_t mrbusPktHandler(uint8_t* rxBuffer, uint8_t* txBuffer, uint8_t mrbus_dev_addr);
+uint8_t mrbusPktHandlerInternal(uint8_t* rxBuffer, uint8_t* txBuffer, uint8_t mrbus_dev_addr, uint8_t pktFlags);
+uint8_t mrbusPktHandlePing(uint8_t* rxBuffer, uint8_t* txBuffer, uint8_t mrbus_dev_addr);
+uint8_t mrbusPktHandleEepromWrite(uint8_t* rxBuffer, uint8_t* txBuffer, uint8_t mrbus_dev_addr);
+uint8_t mrbusPktHandleEepromRead(uint8_t* rxBuffer, uint8_t* txBuffer, uint8_t mrbus_dev_addr);
+#ifdef MRBUS_EEPROM_EXT
+uint8_t mrbusPktHandleEepromExt(uint8_t* rxBuffer, uint8_t* txBuffer, uint8_t mrbus_dev_addr);
+#endif
+uint8_t mrbusPktHandleVersion(uint8_t* rxBuffer, uint8_t* txBuffer, uint8_t mrbus_dev_addr);
+uint8_t mrbusPktHandleReset(uint8_t* rxBuffer, uint8_t* txBuffer, uint8_t mrbus_dev_addr);
+#ifdef MRBUS_STATS
+uint8_t mrbusPktHandleStats(uint8_t* rxBuffer, uint8_t* txBuffer, uint8_t mrbus_dev_addr);
+#endif
+#ifdef MRBUS_FAST_BAUD
+uint8_t mrbusPktHandleDataRate(uint8_t* rxBuffer, uint8_t* txBuffer, uint8_t mrbus_dev_addr);
+#endif
+#ifdef MRBUS_RELIABLE
+uint8_t mrbusPktHandleReliable(uint8_t* rxBuffer, uint8_t* txBuffer, uint8_t mrbus_dev_addr);
+uint8_t mrbusPktHandleReliableAck(uint8_t* rxBuffer, uint8_t* txBuffer, uint8_t mrbus_dev_addr);
+#endif
+#ifdef MRBUS_PKT_DISPATCH
+uint8_t mrbusPktSubtypeDispatch(const MRBusPktHandlerFn* table, uint8_t tableSize, uint8_t progmem, uint8_t* rxBuffer, uint8_t* txBuffer, uint8_t mrbus_dev_addr);
+#endif
 
 #ifdef __cplusplus
 }
 #endif
 
+// Handles a packet in place from mrbusPktQueueFront() - release it with mrbusPktQueueRelease() when done
+#define mrbusPktHandlerFront(pktPtr, txBuffer, mrbus_dev_addr) mrbusPktHandlerInternal((pktPtr)->pkt, (txBuffer), (mrbus_dev_addr), (pktPtr)->flags)
+
 #endif
 
@@ -0,0 +1,688 @@
+// MRBus multi-node bus simulator
+// Runs N virtual nodes of the real wired MRBus driver (mrbusTransmit(), the arbitration timer ISR
+// and the UART ISRs, built for the host with MRBUS_WAIT_TYPE 2) against a shared wired-AND bus, in
+// virtual time.  Each node is its own copy of libmrbus-node.so, so each gets its own set of driver
+// statics and HAL registers.  The simulator plays the hardware for every node:
+//  - The bus is low if any node has its driver enabled (TXE) with its TX line low
+//  - UARTs shift bits onto and sample bits off the bus at whatever rate the driver set (MRBUS_BAUD,
+//    or MRBUS_FAST_BAUD once switched), so arbitration bits and collisions show up as framing
+//    errors and corrupt bytes just as they would on a real bus
+//  - The arbitration timer fires the timer ISR every 20uS while it's running
+// An extra listen-only node acts as the monitor that decides what got delivered.  Every other node
+// offers Poisson traffic and runs a typical main loop, polling mrbusTransmit() and backing off for
+// 10ms (or until something is received) after losing the bus.  Offered load is swept, and each
+// load point reports delivered throughput, arbitration losses, corrupt frames, fairness, latency
+// percentiles and the most starved address.  With a MRBUS_FAST_BAUD build, -f moves every node's
+// data phase to the fast rate, for comparison against the same build left at MRBUS_BAUD.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <math.h>
+#include <dlfcn.h>
+
+#include "mrbus.h"
+
+#define SIM_MAX_NODES   250
+#define SIM_QUEUE_LEN   4
+#define SIM_PKT_TYPE    'S'
+#define SIM_UART_FE     4       // Framing error bit in the host UART status register A
+
+typedef struct
+{
+	void* lib;
+	uint8_t addr;
+
+	// Entry points and registers of this node's private copy of the library
+	void (*init)(void);
+	void (*setPriority)(uint8_t priority);
+	uint8_t (*transmit)(void);
+	uint8_t (*txActive)(void);
+	uint8_t (*arbStatus)(void);
+	uint8_t (*isCrcValid)(uint8_t* pkt);
+	void (*queueInit)(MRBusPktQueue* q, MRBusPacket* pktBufferArray, uint8_t pktBufferArraySz);
+	uint8_t (*queuePush)(MRBusPktQueue* q, uint8_t* data, uint8_t dataLen);
+	uint8_t (*queuePop)(MRBusPktQueue* q, uint8_t* data, uint8_t dataLen, uint8_t snoop);
+	void (*rxIsr)(void);
+	void (*txIsr)(void);
+	void (*doneIsr)(void);
+	void (*timerIsr)(void);
+	MRBusPktQueue* rxQueue;
+	MRBusPktQueue* txQueue;
+	volatile uint8_t *port, *pin, *ddr, *uartScrA, *uartScrB, *uartData;
+	volatile uint8_t *timerScrB, *timerOcr, *timerImsk;
+	volatile uint32_t* micros;
+	volatile uint32_t* uartBaud;
+#ifdef MRBUS_FAST_BAUD
+	void (*setDataRate)(uint8_t rate);
+#endif
+	MRBusPacket rxBuffer[SIM_QUEUE_LEN];
+	MRBusPacket txBuffer[SIM_QUEUE_LEN];
+
+	// UART model
+	uint64_t bitNs;
+	uint8_t txBusy, txByte, txHold, txHoldValid;
+	uint64_t txStart;
+	uint8_t rxBusy, rxBit, rxByte, rxLastLine;
+	uint64_t rxStart;
+
+	// Arbitration timer model
+	uint8_t timerOn;
+	uint64_t timerNext, timerPeriod;
+
+	// Application model
+	uint64_t nextArrival, nextPoll, holdoffUntil;
+	uint8_t pending, lastArb, arbDrove, gotRx;
+	uint16_t seq;
+	uint64_t enqueueTime[256];
+
+	// Statistics for the current load point
+	uint32_t offered, sourceDrops, delivered, won, lostBusy, lostBits;
+	uint64_t latencyTotal;
+	uint32_t latencyMax;
+} SimNode;
+
+static SimNode nodes[SIM_MAX_NODES + 1];
+static int numNodes = 60;
+static SimNode* monitor;
+static uint64_t now;            // Virtual time, nS
+static int pktLen = 10;
+#ifdef MRBUS_FAST_BAUD
+static int fastRate;
+#endif
+static uint64_t warmupNs = 500000000ULL;
+static uint64_t stepNs = 1000;
+static uint64_t pollNs = 1000000;
+static uint64_t retryNs = 10000000;
+static double nodeRate;         // Packets per second per node
+static uint64_t rngState = 0x9E3779B97F4A7C15ULL;
+static uint8_t priorities[SIM_MAX_NODES + 1];
+
+static uint32_t* latencies;
+static uint32_t latencyCount, latencySize;
+static uint32_t corruptFrames;
+
+static uint64_t simRandom(void)
+{
+	rngState ^= rngState >> 12;
+	rngState ^= rngState << 25;
+	rngState ^= rngState >> 27;
+	return(rngState * 0x2545F4914F6CDD1DULL);
+}
+
+static uint64_t simExponentialNs(double rate)
+{
+	double u = (simRandom() >> 11) * (1.0 / 9007199254740992.0);
+	return((uint64_t)(-log(1.0 - u) / rate * 1e9));
+}
+
+static void* simSym(SimNode* n, const char* name)
+{
+	void* sym = dlsym(n->lib, name);
+	if (NULL == sym)
+	{
+		fprintf(stderr, "Node library is missing %s - it must be built with MRBUS_WAIT_TYPE 2\n", name);
+		exit(2);
+	}
+	return(sym);
+}
+
+// dlopen() hands back the same instance for the same file, so every node loads its own copy
+static void simLoad(SimNode* n, const char* libPath, const char* tmpDir, int idx)
+{
+	char copyPath[4096], buf[65536];
+	ssize_t len;
+	int in, out;
+
+	snprintf(copyPath, sizeof(copyPath), "%s/node%d.so", tmpDir, idx);
+	in = open(libPath, O_RDONLY);
+	out = open(copyPath, O_WRONLY | O_CREAT | O_TRUNC, 0700);
+	if (in < 0 || out < 0)
+	{
+		fprintf(stderr, "Can't copy %s to %s\n", libPath, copyPath);
+		exit(2);
+	}
+	while ((len = read(in, buf, sizeof(buf))) > 0)
+	{
+		if (write(out, buf, len) != len)
+		{
+			fprintf(stderr, "Can't copy %s to %s\n", libPath, copyPath);
+			exit(2);
+		}
+	}
+	close(in);
+	close(out);
+
+	n->lib = dlopen(copyPath, RTLD_NOW | RTLD_LOCAL);
+	unlink(copyPath);
+	if (NULL == n->lib)
+	{
+		fprintf(stderr, "%s\n", dlerror());
+		exit(2);
+	}
+
+	n->init = simSym(n, "mrbusInit");
+	n->setPriority = simSym(n, "mrbusSetPriority");
+	n->transmit = simSym(n, "mrbusTransmit");
+	n->txActive = simSym(n, "mrbusTxActive");
+	n->arbStatus = simSym(n, "mrbusArbStatus");
+	n->isCrcValid = simSym(n, "mrbusIsCrcValid");
+#if defined(MRBUS_PKT_QUEUE_POW2) || defined(MRBUS_PKT_QUEUE_RING)
+	n->queueInit = simSym(n, "mrbusPktQueueInitializeInternal");
+#else
+	n->queueInit = simSym(n, "mrbusPktQueueInitialize");
+#endif
+	n->queuePush = simSym(n, "mrbusPktQueuePush");
+	n->queuePop = simSym(n, "mrbusPktQueuePopInternal");
+	n->rxIsr = simSym(n, "mrbusHostUartRxIsr");
+	n->txIsr = simSym(n, "mrbusHostUartTxIsr");
+	n->doneIsr = simSym(n, "mrbusHostUartDoneIsr");
+	n->timerIsr = simSym(n, "mrbusHostTimerIsr");
+	n->rxQueue = simSym(n, "mrbusRxQueue");
+	n->txQueue = simSym(n, "mrbusTxQueue");
+	n->port = simSym(n, "mrbusHostPort");
+	n->pin = simSym(n, "mrbusHostPin");
+	n->ddr = simSym(n, "mrbusHostDdr");
+	n->uartScrA = simSym(n, "mrbusHostUartScrA");
+	n->uartScrB = simSym(n, "mrbusHostUartScrB");
+	n->uartData = simSym(n, "mrbusHostUartData");
+	n->timerScrB = simSym(n, "mrbusHostTimerScrB");
+	n->timerOcr = simSym(n, "mrbusHostTimerOcr");
+	n->timerImsk = simSym(n, "mrbusHostTimerImsk");
+	n->micros = simSym(n, "mrbusHostMicros");
+	n->uartBaud = simSym(n, "mrbusHostUartBaud");
+#ifdef MRBUS_FAST_BAUD
+	n->setDataRate = simSym(n, "mrbusSetDataRate");
+#endif
+}
+
+// Register side effects the real hardware would have, checked after every call into a node
+static void simPostCall(SimNode* n)
+{
+	uint8_t timerOn;
+
+	// TXC is cleared by writing a 1 to it
+	*n->uartScrA &= ~_BV(MRBUS_TXC);
+	n->bitNs = 1000000000ULL / *n->uartBaud;
+
+	timerOn = (0 != *n->timerScrB) && (*n->timerImsk & _BV(MRBUS_TIMER_OCIE));
+	if (timerOn && !n->timerOn)
+	{
+		n->timerPeriod = (uint64_t)(*n->timerOcr + 1) * 8 * 1000000000ULL / F_CPU;
+		n->timerNext = now + n->timerPeriod;
+	}
+	n->timerOn = timerOn;
+}
+
+static void simCall(SimNode* n, void (*fn)(void))
+{
+	*n->micros = now / 1000;
+	(*fn)();
+	simPostCall(n);
+}
+
+static uint8_t simCallU8(SimNode* n, uint8_t (*fn)(void))
+{
+	uint8_t result;
+	*n->micros = now / 1000;
+	result = (*fn)();
+	simPostCall(n);
+	return(result);
+}
+
+static uint8_t simTxLevel(SimNode* n)
+{
+	uint64_t bit;
+
+	if (!(*n->uartScrB & _BV(MRBUS_TXEN)))
+		return((*n->ddr & _BV(MRBUS_TX)) ? ((*n->port >> MRBUS_TX) & 0x01) : 1);
+
+	if (!n->txBusy)
+		return(1);
+
+	bit = (now - n->txStart) / n->bitNs;
+	if (0 == bit)
+		return(0);
+	if (bit <= 8)
+		return((n->txByte >> (bit - 1)) & 0x01);
+	return(1);
+}
+
+static uint8_t simBusLevel(void)
+{
+	int i;
+	for (i=0; i<=numNodes; i++)
+	{
+		if ((*nodes[i].port & _BV(MRBUS_TXE)) && !simTxLevel(&nodes[i]))
+			return(0);
+	}
+	return(1);
+}
+
+// Keep the UART data register fed for as long as the driver wants to send
+static void simUartTxService(SimNode* n)
+{
+	while ((*n->uartScrB & _BV(MRBUS_TXEN)) && (*n->uartScrB & _BV(MRBUS_UART_UDRIE)) && !n->txHoldValid)
+	{
+		simCall(n, n->txIsr);
+		n->txHold = *n->uartData;
+		n->txHoldValid = 1;
+		if (!n->txBusy)
+		{
+			n->txByte = n->txHold;
+			n->txHoldValid = 0;
+			n->txBusy = 1;
+			n->txStart = now;
+		}
+	}
+}
+
+static void simUartTx(SimNode* n)
+{
+	if (n->txBusy && now >= n->txStart + 10 * n->bitNs)
+	{
+		if (n->txHoldValid)
+		{
+			n->txByte = n->txHold;
+			n->txHoldValid = 0;
+			n->txStart += 10 * n->bitNs;
+		}
+		else
+		{
+			n->txBusy = 0;
+			if (*n->uartScrB & _BV(MRBUS_TXCIE))
+				simCall(n, n->doneIsr);
+		}
+	}
+	simUartTxService(n);
+}
+
+static void simUartRx(SimNode* n, uint8_t line)
+{
+	if (!(*n->uartScrB & _BV(MRBUS_RXEN)))
+	{
+		n->rxBusy = 0;
+	}
+	else if (!n->rxBusy)
+	{
+		if (n->rxLastLine && !line)
+		{
+			n->rxBusy = 1;
+			n->rxStart = now;
+			n->rxBit = 0;
+			n->rxByte = 0;
+		}
+	}
+	else if (now >= n->rxStart + n->rxBit * n->bitNs + n->bitNs / 2)
+	{
+		// Sample in the middle of each bit
+		if (0 == n->rxBit)
+		{
+			if (line)
+				n->rxBusy = 0;   // Glitch, not a start bit
+		}
+		else if (n->rxBit <= 8)
+		{
+			n->rxByte |= line << (n->rxBit - 1);
+		}
+		else
+		{
+			n->rxBusy = 0;
+			*n->uartData = n->rxByte;
+			*n->uartScrA = (*n->uartScrA & ~MRBUS_RX_ERR_MASK) | (line ? 0 : _BV(SIM_UART_FE));
+			if (*n->uartScrB & _BV(MRBUS_RXCIE))
+				simCall(n, n->rxIsr);
+		}
+		n->rxBit++;
+	}
+	n->rxLastLine = line;
+}
+
+static void simArbTrack(SimNode* n)
+{
+	uint8_t status = n->arbStatus();
+
+	if (MRBUS_ARB_ACTIVE == status && (*n->port & _BV(MRBUS_TXE)) && !(*n->uartScrB & _BV(MRBUS_TXEN)))
+		n->arbDrove = 1;
+
+	if (MRBUS_ARB_ACTIVE == n->lastArb && MRBUS_ARB_ACTIVE != status)
+	{
+		if (MRBUS_ARB_WON == status)
+		{
+			n->won++;
+			n->pending--;
+		}
+		else if (MRBUS_ARB_LOST == status)
+		{
+			if (n->arbDrove)
+				n->lostBits++;
+			else
+				n->lostBusy++;
+			n->holdoffUntil = now + retryNs;
+			n->gotRx = 0;
+		}
+	}
+	n->lastArb = status;
+}
+
+static void simTimer(SimNode* n, uint8_t line)
+{
+	if (!n->timerOn || now < n->timerNext)
+		return;
+
+	n->timerNext += n->timerPeriod;
+	*n->pin = line ? (*n->pin | _BV(MRBUS_RX)) : (*n->pin & ~_BV(MRBUS_RX));
+	simCall(n, n->timerIsr);
+	simArbTrack(n);
+}
+
+static void simLatency(uint32_t us)
+{
+	if (latencyCount == latencySize)
+	{
+		latencySize = latencySize ? latencySize * 2 : 4096;
+		latencies = realloc(latencies, latencySize * sizeof(uint32_t));
+	}
+	latencies[latencyCount++] = us;
+}
+
+static void simMonitorRx(uint8_t* pkt)
+{
+	SimNode* n;
+	uint64_t enqueued;
+	uint32_t us;
+
+	if (!monitor->isCrcValid(pkt))
+	{
+		if (now >= warmupNs)
+			corruptFrames++;
+		return;
+	}
+	if (SIM_PKT_TYPE != pkt[MRBUS_PKT_TYPE] || 0 == pkt[MRBUS_PKT_SRC] || pkt[MRBUS_PKT_SRC] > numNodes)
+		return;
+
+	if (now < warmupNs)
+		return;
+
+	n = &nodes[pkt[MRBUS_PKT_SRC] - 1];
+	enqueued = n->enqueueTime[pkt[6]];
+
+	us = (now - enqueued) / 1000;
+	n->delivered++;
+	n->latencyTotal += us;
+	if (us > n->latencyMax)
+		n->latencyMax = us;
+	simLatency(us);
+}
+
+static void simApp(SimNode* n)
+{
+	uint8_t pkt[MRBUS_BUFFER_SIZE];
+
+	if (n != monitor && now >= n->nextArrival)
+	{
+		memset(pkt, 0, sizeof(pkt));
+		pkt[MRBUS_PKT_DEST] = 0xFF;
+		pkt[MRBUS_PKT_SRC] = n->addr;
+		pkt[MRBUS_PKT_LEN] = pktLen;
+		pkt[MRBUS_PKT_TYPE] = SIM_PKT_TYPE;
+		pkt[6] = n->seq;
+		pkt[7] = n->seq >> 8;
+
+		if (now >= warmupNs)
+			n->offered++;
+		if (n->queuePush(n->txQueue, pkt, pktLen))
+		{
+			n->enqueueTime[n->seq & 0xFF] = now;
+			n->seq++;
+			n->pending++;
+		}
+		else if (now >= warmupNs)
+			n->sourceDrops++;
+		n->nextArrival = now + simExponentialNs(nodeRate);
+	}
+
+	if (now < n->nextPoll)
+		return;
+	n->nextPoll += pollNs;
+
+	while (n->queuePop(n->rxQueue, pkt, sizeof(pkt), 0))
+	{
+		n->gotRx = 1;
+		if (n == monitor)
+			simMonitorRx(pkt);
+	}
+
+	// After losing the bus, wait 10ms or until something's received before trying again
+	if (n->pending && !simCallU8(n, n->txActive) && (now >= n->holdoffUntil || n->gotRx))
+	{
+		n->arbDrove = 0;
+		simCallU8(n, n->transmit);
+		n->lastArb = n->arbStatus();
+	}
+}
+
+static int simCompareU32(const void* a, const void* b)
+{
+	uint32_t x = *(const uint32_t*)a, y = *(const uint32_t*)b;
+	return((x > y) - (x < y));
+}
+
+static double simPercentileMs(double p)
+{
+	if (0 == latencyCount)
+		return(0);
+	return(latencies[(uint32_t)(p * (latencyCount - 1))] / 1000.0);
+}
+
+static void simRun(const char* libPath, const char* tmpDir, double load, double seconds, FILE* addrCsv)
+{
+	uint64_t endNs = warmupNs + (uint64_t)(seconds * 1e9);
+	uint32_t offered = 0, drops = 0, delivered = 0, won = 0, lostBusy = 0, lostBits = 0;
+	double worstRatio = 2.0, span = seconds, sum = 0, sumSq = 0;
+	SimNode* worst = NULL;
+	int i, starved = 0;
+
+	memset(nodes, 0, sizeof(nodes));
+	latencyCount = 0;
+	corruptFrames = 0;
+	now = 0;
+	nodeRate = load / numNodes;
+	monitor = &nodes[numNodes];
+
+	for (i=0; i<=numNodes; i++)
+	{
+		SimNode* n = &nodes[i];
+		simLoad(n, libPath, tmpDir, i);
+		n->addr = (n == monitor) ? 0xFE : i + 1;
+		n->queueInit(n->rxQueue, n->rxBuffer, SIM_QUEUE_LEN);
+		n->queueInit(n->txQueue, n->txBuffer, SIM_QUEUE_LEN);
+		*n->pin = _BV(MRBUS_RX);
+		simCall(n, n->init);
+#ifdef MRBUS_FAST_BAUD
+		if (fastRate)
+		{
+			n->setDataRate(MRBUS_DATA_RATE_FAST);
+			simPostCall(n);
+		}
+#endif
+		if (n != monitor && priorities[n->addr])
+			n->setPriority(priorities[n->addr] - 1);
+		n->rxLastLine = 1;
+		n->lastArb = MRBUS_ARB_IDLE;
+		n->nextArrival = (n == monitor) ? UINT64_MAX : simExponentialNs(nodeRate);
+		n->nextPoll = simRandom() % pollNs;
+	}
+
+	while (now < endNs)
+	{
+		uint8_t line = simBusLevel();
+		uint64_t next = UINT64_MAX;
+		int idle = line;
+
+		for (i=0; i<=numNodes; i++)
+		{
+			SimNode* n = &nodes[i];
+			*n->pin = line ? (*n->pin | _BV(MRBUS_RX)) : (*n->pin & ~_BV(MRBUS_RX));
+			simUartRx(n, line);
+			simTimer(n, line);
+			simUartTx(n);
+			simApp(n);
+
+			if (n->rxBusy || n->txBusy || n->timerOn)
+				idle = 0;
+			if (n->nextArrival < next)
+				next = n->nextArrival;
+			if (n->nextPoll < next)
+				next = n->nextPoll;
+		}
+
+		// Nothing on the bus and nothing running - skip ahead to the next application event
+		if (idle && next > now + stepNs)
+			now = next;
+		else
+			now += stepNs;
+	}
+
+	qsort(latencies, latencyCount, sizeof(uint32_t), simCompareU32);
+
+	for (i=0; i<numNodes; i++)
+	{
+		SimNode* n = &nodes[i];
+		double ratio = n->offered ? (double)n->delivered / n->offered : 1.0;
+
+		offered += n->offered;
+		drops += n->sourceDrops;
+		delivered += n->delivered;
+		won += n->won;
+		lostBusy += n->lostBusy;
+		lostBits += n->lostBits;
+		sum += n->delivered;
+		sumSq += (double)n->delivered * n->delivered;
+		if (ratio < 0.5)
+			starved++;
+		if (ratio < worstRatio)
+		{
+			worstRatio = ratio;
+			worst = n;
+		}
+
+		if (NULL != addrCsv)
+			fprintf(addrCsv, "%.1f,%d,%u,%u,%u,%u,%u,%u,%.2f,%.2f\n", load, n->addr, n->offered, n->delivered,
+				n->sourceDrops, n->won, n->lostBusy, n->lostBits,
+				n->delivered ? n->latencyTotal / 1000.0 / n->delivered : 0.0, n->latencyMax / 1000.0);
+	}
+
+	// Jain's fairness index of the per-node delivered packets - 1.0 when every node got the same share
+	printf("%8.1f %8.1f %9.1f %7.1f %8.1f %8.1f %7u %5.2f %7.2f %7.2f %7.2f %8.2f %7d %5d %5.0f%%\n",
+		load, offered / span, delivered / span, drops / span, lostBusy / span, lostBits / span, corruptFrames,
+		sumSq ? sum * sum / (numNodes * sumSq) : 1.0,
+		simPercentileMs(0.5), simPercentileMs(0.9), simPercentileMs(0.99), simPercentileMs(1.0),
+		starved, worst ? worst->addr : 0, worst ? worstRatio * 100.0 : 100.0);
+	fflush(stdout);
+
+	for (i=0; i<=numNodes; i++)
+		dlclose(nodes[i].lib);
+}
+
+static void usage(const char* prog)
+{
+	fprintf(stderr, "Usage: %s [-n nodes] [-l start:stop:step] [-d seconds] [-s stepNs] [-r seed] [-P addr:priority] [-a addr.csv] [-p bytes] [-f] node-library.so\n", prog);
+	fprintf(stderr, "  -n  Number of transmitting nodes (default 60, max %d)\n", SIM_MAX_NODES);
+	fprintf(stderr, "  -l  Offered load sweep, total packets/s across all nodes (default 20:400:20)\n");
+	fprintf(stderr, "  -d  Simulated seconds per load point, after a 0.5s warmup (default 5)\n");
+	fprintf(stderr, "  -s  Simulation step in nS (default 1000)\n");
+	fprintf(stderr, "  -r  Random seed\n");
+	fprintf(stderr, "  -P  Set the arbitration priority of one node (repeatable, default %d)\n", MRBUS_PRIORITY_DEFAULT);
+	fprintf(stderr, "  -a  Also write per-address results to this CSV file\n");
+	fprintf(stderr, "  -p  Packet length, 8 to %d (default 10)\n", MRBUS_BUFFER_SIZE);
+#ifdef MRBUS_FAST_BAUD
+	fprintf(stderr, "  -f  Run the data phase at MRBUS_FAST_BAUD (%u) - use a smaller -s at 500000\n", MRBUS_FAST_BAUD);
+#endif
+	exit(2);
+}
+
+int main(int argc, char* argv[])
+{
+	double loadStart = 20, loadStop = 400, loadStep = 20, seconds = 5, load;
+	char tmpDir[] = "/tmp/mrbus-sim-XXXXXX";
+	FILE* addrCsv = NULL;
+	int opt, addr, priority;
+
+	while (-1 != (opt = getopt(argc, argv, "n:l:d:s:r:P:a:p:f")))
+	{
+		switch(opt)
+		{
+			case 'n':
+				numNodes = atoi(optarg);
+				break;
+			case 'l':
+				if (3 != sscanf(optarg, "%lf:%lf:%lf", &loadStart, &loadStop, &loadStep) || loadStep <= 0)
+					usage(argv[0]);
+				break;
+			case 'd':
+				seconds = atof(optarg);
+				break;
+			case 's':
+				stepNs = strtoull(optarg, NULL, 0);
+				break;
+			case 'r':
+				rngState = (strtoull(optarg, NULL, 0) << 1) | 1;
+				break;
+			case 'P':
+				if (2 != sscanf(optarg, "%d:%d", &addr, &priority) || addr < 1 || addr > SIM_MAX_NODES || priority < 0 || priority > 11)
+					usage(argv[0]);
+				priorities[addr] = priority + 1;
+				break;
+			case 'a':
+				if (NULL == (addrCsv = fopen(optarg, "w")))
+				{
+					fprintf(stderr, "Can't write %s\n", optarg);
+					return(2);
+				}
+				fprintf(addrCsv, "load,addr,offered,delivered,drops,won,lost_busy,lost_bits,latency_avg_ms,latency_max_ms\n");
+				break;
+			case 'p':
+				pktLen = atoi(optarg);
+				if (pktLen < 8 || pktLen > MRBUS_BUFFER_SIZE)
+					usage(argv[0]);
+				break;
+#ifdef MRBUS_FAST_BAUD
+			case 'f':
+				fastRate = 1;
+				break;
+#endif
+			default:
+				usage(argv[0]);
+		}
+	}
+	if (optind != argc - 1 || numNodes < 1 || numNodes > SIM_MAX_NODES || 0 == stepNs || seconds <= 0)
+		usage(argv[0]);
+
+	if (NULL == mkdtemp(tmpDir))
+	{
+		fprintf(stderr, "Can't create %s\n", tmpDir);
+		return(2);
+	}
+
+	printf("%d nodes, %d byte packets, %u baud data phase, %.1fs per point\n", numNodes, pktLen,
+#ifdef MRBUS_FAST_BAUD
+		fastRate ? MRBUS_FAST_BAUD : MRBUS_BAUD,
+#else
+		MRBUS_BAUD,
+#endif
+		seconds);
+	printf("%8s %8s %9s %7s %8s %8s %7s %5s %7s %7s %7s %8s %7s %5s %6s\n", "load", "offered", "delivered", "drops",
+		"lostBusy", "lostBits", "corrupt", "fair", "p50ms", "p90ms", "p99ms", "maxms", "starved", "worst", "ratio");
+
+	for (load=loadStart; load<=loadStop + loadStep/2; load+=loadStep)
+		simRun(argv[optind], tmpDir, load, seconds, addrCsv);
+
+	rmdir(tmpDir);
+	if (NULL != addrCsv)
+		fclose(addrCsv);
+	return(0);
+}
@@ -0,0 +1,125 @@
+// CRC engine tests - built once per engine that runs on the host (see the test target in the
+// Makefile).  The AVR assembly engine gets the same check in the benchmark firmware.
+
+#include <stdint.h>
+#include <string.h>
+
+#include "mrbus.h"
+#include "mrbus-test.h"
+
+// MRBus CRC16 a bit at a time, MSB first, polynomial 0xA001 - what every engine's tables encode
+static uint16_t testCrcReference(uint16_t crc, uint8_t a)
+{
+	uint8_t bit;
+
+	crc ^= (uint16_t)a << 8;
+	for (bit=0; bit<8; bit++)
+		crc = (crc & 0x8000) ? (crc << 1) ^ 0xA001 : (crc << 1);
+	return(crc);
+}
+
+static uint32_t testRandom(uint32_t* seed)
+{
+	*seed = *seed * 1103515245UL + 12345;
+	return(*seed >> 8);
+}
+
+// Every CRC value with every byte
+static void testCrcExhaustive(void)
+{
+	uint32_t crc, mismatches = 0;
+	uint16_t a;
+
+	for (crc=0; crc<0x10000; crc++)
+		for (a=0; a<0x100; a++)
+			if (mrbusCRC16Update(crc, a) != testCrcReference(crc, a))
+				mismatches++;
+	TEST_CHECK(0 == mismatches);
+}
+
+// Random packets of every length get the reference CRC, pass mrbusIsCrcValid(), and fail it
+// with any single bit flipped
+static void testCrcPackets(void)
+{
+	uint8_t pkt[MRBUS_BUFFER_SIZE];
+	uint32_t seed = 1;
+	uint16_t n, crc;
+	uint8_t len, i, bit;
+
+	for (n=0; n<2000; n++)
+	{
+		len = MRBUS_PKT_TYPE + 1 + testRandom(&seed) % (MRBUS_BUFFER_SIZE - MRBUS_PKT_TYPE);
+		for (i=0; i<len; i++)
+			pkt[i] = testRandom(&seed);
+		pkt[MRBUS_PKT_LEN] = len;
+
+		crc = 0;
+		for (i=0; i<len; i++)
+			if (MRBUS_PKT_CRC_L != i && MRBUS_PKT_CRC_H != i)
+				crc = testCrcReference(crc, pkt[i]);
+		pkt[MRBUS_PKT_CRC_L] = UINT16_LOW_BYTE(crc);
+		pkt[MRBUS_PKT_CRC_H] = UINT16_HIGH_BYTE(crc);
+		TEST_CHECK(mrbusIsCrcValid(pkt));
+
+		// Not the length byte - that changes which bytes are covered
+		do
+		{
+			i = testRandom(&seed) % len;
+		} while (MRBUS_PKT_LEN == i);
+		bit = 1 << (testRandom(&seed) & 0x07);
+		pkt[i] ^= bit;
+		TEST_CHECK(!mrbusIsCrcValid(pkt));
+	}
+}
+
+#ifdef MRBUS_RX_ISR_CRC
+// A packet popped from the queue keeps the CRC verdict the RX ISR gave it, for one handler call on
+// the buffer it was popped into - here the CRC bytes are wrong, so only the flags can pass it
+static void testCrcPopped(void)
+{
+	static MRBusPktQueue queue;
+	static MRBusPacket queueBuffer[4];
+	uint8_t pkt[MRBUS_BUFFER_SIZE], other[MRBUS_BUFFER_SIZE], txBuffer[MRBUS_BUFFER_SIZE];
+	MRBusPktHandlerFn handler = &mrbusPktHandler;
+
+	memset(pkt, 0, sizeof(pkt));
+	pkt[MRBUS_PKT_DEST] = 0x03;
+	pkt[MRBUS_PKT_SRC] = 0x09;
+	pkt[MRBUS_PKT_LEN] = 8;
+	pkt[MRBUS_PKT_CRC_L] = 0x5A;
+	pkt[MRBUS_PKT_TYPE] = 'C';
+	TEST_CHECK(!mrbusIsCrcValid(pkt));
+
+	mrbusPktQueueInitialize(&queue, queueBuffer, 4);
+	TEST_CHECK(mrbusPktQueuePushInternal(&queue, pkt, 8, 0, MRBUS_PKT_FLAG_CRC_VALID));
+	TEST_CHECK(mrbusPktQueuePushInternal(&queue, pkt, 8, 0, 0));
+	TEST_CHECK(mrbusPktQueuePushInternal(&queue, pkt, 8, 0, MRBUS_PKT_FLAG_CRC_VALID));
+
+	TEST_CHECK(mrbusPktQueuePop(&queue, pkt, sizeof(pkt)));
+	TEST_CHECK(MRBUS_HANDLER_CUSTOM == (*handler)(pkt, txBuffer, 0x03));
+	TEST_CHECK(0 == mrbusPktHandler(pkt, txBuffer, 0x03));
+
+	// Popped without the flag
+	TEST_CHECK(mrbusPktQueuePop(&queue, pkt, sizeof(pkt)));
+	TEST_CHECK(0 == mrbusPktHandler(pkt, txBuffer, 0x03));
+
+	// A copy, or the buffer once it holds some other packet, doesn't get the flags
+	TEST_CHECK(mrbusPktQueuePop(&queue, pkt, sizeof(pkt)));
+	memcpy(other, pkt, sizeof(other));
+	TEST_CHECK(0 == mrbusPktHandler(other, txBuffer, 0x03));
+	TEST_CHECK(mrbusPktQueuePushInternal(&queue, pkt, 8, 0, MRBUS_PKT_FLAG_CRC_VALID));
+	TEST_CHECK(mrbusPktQueuePop(&queue, pkt, sizeof(pkt)));
+	pkt[MRBUS_PKT_CRC_H] = 0xA5;
+	TEST_CHECK(0 == mrbusPktHandler(pkt, txBuffer, 0x03));
+}
+#endif
+
+int main(void)
+{
+	testCrcExhaustive();
+	testCrcPackets();
+#ifdef MRBUS_RX_ISR_CRC
+	testCrcPopped();
+#endif
+	return(mrbusTestResult("crc"));
+}
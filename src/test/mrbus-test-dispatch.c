@@ -0,0 +1,104 @@
+// Dispatch table tests (MRBUS_PKT_DISPATCH) - built once per variant (see the test target in the
+// Makefile), with -Werror=override-init so a type initialized twice fails the build.  The file
+// itself also builds cleanly with -Wextra.
+
+#include <stdint.h>
+#include <string.h>
+
+// The application's own ping, and no remote reset
+#define MRBUS_PKT_HANDLER_OVERRIDE_PING
+#define MRBUS_PKT_HANDLER_OVERRIDE_RESET
+
+#include "mrbus.h"
+#include "mrbus-test.h"
+
+#define TEST_ADDR  0x03
+#define TEST_HOST  0xFE
+
+#define testHandlerEntry(type) (mrbusPktHandlers[(uint8_t)(type) - MRBUS_PKT_HANDLER_FIRST])
+
+static uint8_t testHandled;
+
+// Both reply with the lower case type
+static uint8_t testHandlePing(uint8_t* rxBuffer, uint8_t* txBuffer, uint8_t mrbus_dev_addr)
+{
+	testHandled = rxBuffer[MRBUS_PKT_TYPE];
+	txBuffer[MRBUS_PKT_DEST] = rxBuffer[MRBUS_PKT_SRC];
+	txBuffer[MRBUS_PKT_SRC] = mrbus_dev_addr;
+	txBuffer[MRBUS_PKT_LEN] = 6;
+	txBuffer[MRBUS_PKT_TYPE] = 'a';
+	return (MRBUS_HANDLER_DONE);
+}
+
+static uint8_t testHandleCommand(uint8_t* rxBuffer, uint8_t* txBuffer, uint8_t mrbus_dev_addr)
+{
+	testHandled = rxBuffer[MRBUS_PKT_TYPE];
+	txBuffer[MRBUS_PKT_DEST] = rxBuffer[MRBUS_PKT_SRC];
+	txBuffer[MRBUS_PKT_SRC] = mrbus_dev_addr;
+	txBuffer[MRBUS_PKT_LEN] = 6;
+	txBuffer[MRBUS_PKT_TYPE] = 'c';
+	return (MRBUS_HANDLER_DONE);
+}
+
+const MRBusPktHandlerFn mrbusPktHandlers[MRBUS_PKT_HANDLER_TYPES] PROGMEM =
+{
+	MRBUS_PKT_HANDLERS_BUILTIN
+	MRBUS_PKT_HANDLER('A', testHandlePing),
+	MRBUS_PKT_HANDLER('C', testHandleCommand),
+};
+
+static uint8_t testDispatch(uint8_t type)
+{
+	uint8_t rxBuffer[MRBUS_BUFFER_SIZE], txBuffer[MRBUS_BUFFER_SIZE];
+	uint16_t crc = 0;
+	uint8_t i;
+
+	memset(rxBuffer, 0, sizeof(rxBuffer));
+	rxBuffer[MRBUS_PKT_DEST] = TEST_ADDR;
+	rxBuffer[MRBUS_PKT_SRC] = TEST_HOST;
+	rxBuffer[MRBUS_PKT_LEN] = 6;
+	rxBuffer[MRBUS_PKT_TYPE] = type;
+	for (i=0; i<6; i++)
+		if (MRBUS_PKT_CRC_L != i && MRBUS_PKT_CRC_H != i)
+			crc = mrbusCRC16Update(crc, rxBuffer[i]);
+	rxBuffer[MRBUS_PKT_CRC_L] = UINT16_LOW_BYTE(crc);
+	rxBuffer[MRBUS_PKT_CRC_H] = UINT16_HIGH_BYTE(crc);
+
+	testHandled = 0;
+	return(mrbusPktHandler(rxBuffer, txBuffer, TEST_ADDR));
+}
+
+// Overridden and added types go to the application, the rest of the built-ins stay where they were
+static void testDispatchTable(void)
+{
+	TEST_CHECK(testHandlePing == testHandlerEntry('A'));
+	TEST_CHECK(NULL == testHandlerEntry('X'));
+	TEST_CHECK(mrbusPktHandleEepromWrite == testHandlerEntry('W'));
+	TEST_CHECK(mrbusPktHandleEepromRead == testHandlerEntry('R'));
+	TEST_CHECK(mrbusPktHandleVersion == testHandlerEntry('V'));
+#ifdef MRBUS_EEPROM_EXT
+	TEST_CHECK(mrbusPktHandleEepromExt == testHandlerEntry(MRBUS_EE_EXT_PKT_TYPE));
+#endif
+#ifdef MRBUS_STATS
+	TEST_CHECK(mrbusPktHandleStats == testHandlerEntry(MRBUS_STATS_PKT_TYPE));
+#endif
+#ifdef MRBUS_FAST_BAUD
+	TEST_CHECK(mrbusPktHandleDataRate == testHandlerEntry(MRBUS_DATA_RATE_PKT_TYPE));
+#endif
+#ifdef MRBUS_RELIABLE
+	TEST_CHECK(mrbusPktHandleReliable == testHandlerEntry(MRBUS_RELIABLE_PKT_TYPE));
+	TEST_CHECK(mrbusPktHandleReliableAck == testHandlerEntry(MRBUS_RELIABLE_ACK_PKT_TYPE));
+#endif
+
+	TEST_CHECK(MRBUS_HANDLER_DONE == testDispatch('A') && 'A' == testHandled);
+	TEST_CHECK(MRBUS_HANDLER_DONE == testDispatch('C') && 'C' == testHandled);
+	TEST_CHECK(MRBUS_HANDLER_CUSTOM == testDispatch('X') && 0 == testHandled);
+	TEST_CHECK(MRBUS_HANDLER_CUSTOM == testDispatch('Z') && 0 == testHandled);
+	TEST_CHECK(MRBUS_HANDLER_VERSION == testDispatch('V'));
+}
+
+int main(void)
+{
+	testDispatchTable();
+	return(mrbusTestResult("dispatch"));
+}
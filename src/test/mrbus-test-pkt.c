@@ -0,0 +1,79 @@
+// Built-in packet handler tests - built once per variant (see the test target in the Makefile)
+
+#include <stdint.h>
+#include <string.h>
+
+#include "mrbus.h"
+#include "mrbus-test.h"
+
+#define TEST_ADDR  0x03
+#define TEST_HOST  0xFE
+
+static void testPktCrc(uint8_t* pkt)
+{
+	uint16_t crc = 0;
+	uint8_t i;
+	for (i=0; i<pkt[MRBUS_PKT_LEN]; i++)
+		if (MRBUS_PKT_CRC_L != i && MRBUS_PKT_CRC_H != i)
+			crc = mrbusCRC16Update(crc, pkt[i]);
+	pkt[MRBUS_PKT_CRC_L] = UINT16_LOW_BYTE(crc);
+	pkt[MRBUS_PKT_CRC_H] = UINT16_HIGH_BYTE(crc);
+}
+
+static void testPktMake(uint8_t* pkt, uint8_t len, uint8_t type)
+{
+	memset(pkt, 0, MRBUS_BUFFER_SIZE);
+	pkt[MRBUS_PKT_DEST] = TEST_ADDR;
+	pkt[MRBUS_PKT_SRC] = TEST_HOST;
+	pkt[MRBUS_PKT_LEN] = len;
+	pkt[MRBUS_PKT_TYPE] = type;
+}
+
+// The usual 'v' reply stops after the description, whatever the build - anything past [15] is
+// shown as description text by older hosts.  Sizes and rates only come back for a capability query.
+static void testPktVersion(void)
+{
+	uint8_t rxBuffer[MRBUS_BUFFER_SIZE], txBuffer[MRBUS_BUFFER_SIZE];
+	uint8_t flags = MRBUS_VERSION_WIRED;
+
+#if MRBUS_BUFFER_SIZE > MRBUS_BUFFER_SIZE_STANDARD
+	flags |= MRBUS_VERSION_EXT_FRAME;
+#endif
+#ifdef MRBUS_FAST_BAUD
+	flags |= MRBUS_VERSION_FAST_BAUD;
+#endif
+
+	// Left over from a longer packet, past the end of this one
+	testPktMake(rxBuffer, 6, 'V');
+	rxBuffer[6] = MRBUS_VERSION_CAPS;
+	testPktCrc(rxBuffer);
+	TEST_CHECK(MRBUS_HANDLER_VERSION == mrbusPktHandler(rxBuffer, txBuffer, TEST_ADDR));
+	TEST_CHECK('v' == txBuffer[MRBUS_PKT_TYPE] && 16 == txBuffer[MRBUS_PKT_LEN]);
+	TEST_CHECK(TEST_HOST == txBuffer[MRBUS_PKT_DEST] && TEST_ADDR == txBuffer[MRBUS_PKT_SRC]);
+	TEST_CHECK(flags == txBuffer[6]);
+
+	testPktMake(rxBuffer, 7, 'V');
+	rxBuffer[6] = MRBUS_VERSION_CAPS;
+	testPktCrc(rxBuffer);
+	TEST_CHECK(MRBUS_HANDLER_DONE == mrbusPktHandler(rxBuffer, txBuffer, TEST_ADDR));
+	TEST_CHECK('v' == txBuffer[MRBUS_PKT_TYPE] && 9 == txBuffer[MRBUS_PKT_LEN]);
+	TEST_CHECK((flags | MRBUS_VERSION_CAPS) == txBuffer[6]);
+	TEST_CHECK(MRBUS_BUFFER_SIZE == txBuffer[7]);
+#ifdef MRBUS_FAST_BAUD
+	TEST_CHECK(MRBUS_DATA_RATE_FAST == txBuffer[8]);
+#else
+	TEST_CHECK(MRBUS_DATA_RATE_STANDARD == txBuffer[8]);
+#endif
+
+	// Any other query byte gets the usual reply
+	testPktMake(rxBuffer, 7, 'V');
+	testPktCrc(rxBuffer);
+	TEST_CHECK(MRBUS_HANDLER_VERSION == mrbusPktHandler(rxBuffer, txBuffer, TEST_ADDR));
+	TEST_CHECK(16 == txBuffer[MRBUS_PKT_LEN] && flags == txBuffer[6]);
+}
+
+int main(void)
+{
+	testPktVersion();
+	return(mrbusTestResult("pkt"));
+}
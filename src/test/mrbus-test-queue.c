@@ -0,0 +1,247 @@
+// Queue regression tests - built once per queue backend (see the test target in the Makefile)
+
+#include <stdint.h>
+#include <string.h>
+
+#include "mrbus.h"
+#include "mrbus-test.h"
+
+#ifdef MRBUS_PKT_QUEUE_RING
+// Bursts of two packets of any length need room for two full size records and a byte
+#define TEST_QUEUE_LEN  (MRBUS_PKT_QUEUE_RING_MIN + 1)
+#else
+#define TEST_QUEUE_LEN  4
+#endif
+
+static MRBusPktQueue queue;
+static MRBusPacket queueBuffer[TEST_QUEUE_LEN];
+#ifdef MRBUS_PKT_QUEUE_RING
+static MRBusPacket ringSizesBuffer[MRBUS_PKT_QUEUE_RING_MIN + 1];
+#endif
+
+static void testPktFill(uint8_t* pkt, uint8_t len, uint8_t seed)
+{
+	uint8_t i;
+	memset(pkt, 0, MRBUS_BUFFER_SIZE);
+	for (i=0; i<len; i++)
+		pkt[i] = seed + i;
+	pkt[MRBUS_PKT_LEN] = len;
+}
+
+// Packets of every length through the smallest queue, one at a time and in bursts, and they all
+// come out intact and in order
+static void testQueueCycle(void)
+{
+	uint8_t in[TEST_QUEUE_LEN][MRBUS_BUFFER_SIZE], out[MRBUS_BUFFER_SIZE];
+	uint16_t round;
+	uint8_t i, burst, len;
+
+	mrbusPktQueueInitialize(&queue, queueBuffer, TEST_QUEUE_LEN);
+	for (round=0; round<1000; round++)
+	{
+		burst = 1 + round % 2;
+		for (i=0; i<burst; i++)
+		{
+			len = 6 + (round * 7 + i) % (MRBUS_BUFFER_SIZE - 5);
+			testPktFill(in[i], len, round + i);
+			TEST_CHECK(mrbusPktQueuePush(&queue, in[i], len));
+		}
+		for (i=0; i<burst; i++)
+		{
+			TEST_CHECK(mrbusPktQueuePop(&queue, out, sizeof(out)));
+			TEST_CHECK(0 == memcmp(in[i], out, in[i][MRBUS_PKT_LEN]));
+		}
+		TEST_CHECK(mrbusPktQueueEmpty(&queue));
+	}
+}
+
+// The zero-copy consumer interface, with a bogus packet length in the middle of the queue
+static void testQueueFrontRelease(void)
+{
+	uint8_t in[MRBUS_BUFFER_SIZE];
+	MRBusPacket* pkt;
+	uint8_t i;
+
+	mrbusPktQueueInitialize(&queue, queueBuffer, TEST_QUEUE_LEN);
+	for (i=0; i<100; i++)
+	{
+		testPktFill(in, 8, i);
+		if (i % 3 == 1)
+			in[MRBUS_PKT_LEN] = i % 6;
+		TEST_CHECK(mrbusPktQueuePush(&queue, in, MRBUS_BUFFER_SIZE));
+		pkt = mrbusPktQueueFront(&queue);
+		TEST_CHECK(NULL != pkt && pkt->pkt[MRBUS_PKT_TYPE] == (uint8_t)(i + MRBUS_PKT_TYPE));
+		TEST_CHECK(mrbusPktQueueRelease(&queue));
+		TEST_CHECK(NULL == mrbusPktQueueFront(&queue));
+	}
+}
+
+// A packet the RX ISR gives up on part way in is aborted - the queue must still drain and take a
+// full size packet afterwards, and the ring must rewind as if nothing had been reserved
+static void testQueueAbort(void)
+{
+	uint8_t in[MRBUS_BUFFER_SIZE], out[MRBUS_BUFFER_SIZE];
+	MRBusPacket* slot;
+
+	mrbusPktQueueInitialize(&queue, queueBuffer, TEST_QUEUE_LEN);
+	testPktFill(in, 10, 1);
+	TEST_CHECK(mrbusPktQueuePush(&queue, in, 10));
+
+	slot = mrbusPktQueueReserve(&queue);
+	TEST_CHECK(NULL != slot);
+	testPktFill(slot->pkt, 12, 2);
+	mrbusPktQueueAbort(&queue);
+
+	TEST_CHECK(mrbusPktQueuePop(&queue, out, sizeof(out)));
+	TEST_CHECK(0 == memcmp(in, out, 10));
+	TEST_CHECK(mrbusPktQueueEmpty(&queue));
+#if defined(MRBUS_PKT_QUEUE_RING)
+	TEST_CHECK(0 == queue.headIdx && 0 == queue.tailIdx);
+#endif
+
+	testPktFill(in, MRBUS_BUFFER_SIZE, 3);
+	TEST_CHECK(mrbusPktQueuePush(&queue, in, MRBUS_BUFFER_SIZE));
+	TEST_CHECK(mrbusPktQueuePop(&queue, out, sizeof(out)));
+	TEST_CHECK(0 == memcmp(in, out, MRBUS_BUFFER_SIZE));
+	TEST_CHECK(mrbusPktQueueEmpty(&queue));
+}
+
+#if defined(MRBUS_PKT_QUEUE_POW2)
+// Sizes only known at run time get past the compile time check, and are rounded down
+static void testPow2RuntimeSize(void)
+{
+	static MRBusPacket buffer[5];
+	volatile uint8_t size = 5;
+	uint8_t in[MRBUS_BUFFER_SIZE];
+	uint8_t i;
+
+	testPktFill(in, 8, 0);
+	mrbusPktQueueInitialize(&queue, buffer, size);
+	TEST_CHECK(4 == queue.pktBufferArraySz);
+	for (i=0; i<4; i++)
+		TEST_CHECK(mrbusPktQueuePush(&queue, in, 8));
+	TEST_CHECK(!mrbusPktQueuePush(&queue, in, 8));
+
+	size = 0;
+	mrbusPktQueueInitialize(&queue, buffer, size);
+	TEST_CHECK(!mrbusPktQueuePush(&queue, in, 8));
+	TEST_CHECK(mrbusPktQueueEmpty(&queue));
+}
+#endif
+
+#if defined(MRBUS_PKT_QUEUE_RING)
+// Full size packets through the smallest rings
+static void testRingSizes(void)
+{
+	uint8_t in[MRBUS_BUFFER_SIZE];
+	uint8_t n;
+
+	testPktFill(in, MRBUS_BUFFER_SIZE, 0);
+	for (n=1; n<=MRBUS_PKT_QUEUE_RING_MIN + 1; n++)
+	{
+		mrbusPktQueueInitializeInternal(&queue, ringSizesBuffer, n);
+		if (n < MRBUS_PKT_QUEUE_RING_MIN)
+		{
+			TEST_CHECK(!mrbusPktQueuePush(&queue, in, MRBUS_BUFFER_SIZE));
+			TEST_CHECK(mrbusPktQueueEmpty(&queue));
+			continue;
+		}
+		TEST_CHECK(mrbusPktQueuePush(&queue, in, MRBUS_BUFFER_SIZE));
+		TEST_CHECK(mrbusPktQueueDrop(&queue));
+		TEST_CHECK(0 == queue.headIdx && 0 == queue.tailIdx);
+		TEST_CHECK(mrbusPktQueuePush(&queue, in, MRBUS_BUFFER_SIZE));
+	}
+}
+
+// Random reserves, commits, aborts and drops of random lengths through the smallest rings - a
+// drained queue must never be left without room for the next packet, and nothing is reordered
+static void testRingLockup(void)
+{
+	MRBusPacket* slot = NULL;
+	uint8_t out[MRBUS_BUFFER_SIZE];
+	uint8_t n, pushSeed = 0, popSeed = 0;
+	uint32_t i, rnd = 1;
+
+	for (n=MRBUS_PKT_QUEUE_RING_MIN; n<=MRBUS_PKT_QUEUE_RING_MIN + 1; n++)
+	{
+		mrbusPktQueueInitializeInternal(&queue, ringSizesBuffer, n);
+		for (i=0; i<100000; i++)
+		{
+			rnd = rnd * 1103515245 + 12345;
+			switch((rnd >> 16) % 4)
+			{
+				case 0:
+					if (NULL == slot)
+					{
+						slot = mrbusPktQueueReserve(&queue);
+						TEST_CHECK(NULL != slot || !mrbusPktQueueEmpty(&queue));
+					}
+					break;
+				case 1:
+					if (NULL == slot)
+						break;
+					if ((rnd >> 24) & 0x01)
+					{
+						testPktFill(slot->pkt, 6 + (rnd >> 8) % (MRBUS_BUFFER_SIZE - 5), pushSeed++);
+						slot->flags = slot->rssi = 0;
+						mrbusPktQueueCommit(&queue);
+					}
+					else
+						mrbusPktQueueAbort(&queue);
+					slot = NULL;
+					break;
+				default:
+					if (mrbusPktQueuePop(&queue, out, sizeof(out)))
+						TEST_CHECK(popSeed++ == out[0]);
+					break;
+			}
+		}
+		if (NULL != slot)
+			mrbusPktQueueAbort(&queue);
+		slot = NULL;
+		pushSeed = popSeed = 0;
+	}
+}
+
+// The consumer draining the queue mustn't rewind the ring under a packet being received
+static void testRingDrainWhileReserved(void)
+{
+	uint8_t in[MRBUS_BUFFER_SIZE], out[MRBUS_BUFFER_SIZE];
+	MRBusPacket* slot;
+
+	mrbusPktQueueInitialize(&queue, queueBuffer, TEST_QUEUE_LEN);
+	testPktFill(in, 10, 1);
+	TEST_CHECK(mrbusPktQueuePush(&queue, in, 10));
+
+	slot = mrbusPktQueueReserve(&queue);
+	TEST_CHECK(NULL != slot);
+	testPktFill(slot->pkt, 12, 2);
+	slot->flags = slot->rssi = 0;
+
+	TEST_CHECK(mrbusPktQueueDrop(&queue));
+	TEST_CHECK(0 != queue.headIdx);
+	mrbusPktQueueCommit(&queue);
+
+	testPktFill(in, 12, 2);
+	TEST_CHECK(mrbusPktQueuePop(&queue, out, sizeof(out)));
+	TEST_CHECK(0 == memcmp(in, out, 12));
+	TEST_CHECK(mrbusPktQueueEmpty(&queue));
+	TEST_CHECK(0 == queue.headIdx && 0 == queue.tailIdx);
+}
+#endif
+
+int main(void)
+{
+	testQueueCycle();
+	testQueueFrontRelease();
+	testQueueAbort();
+#if defined(MRBUS_PKT_QUEUE_POW2)
+	testPow2RuntimeSize();
+#endif
+#if defined(MRBUS_PKT_QUEUE_RING)
+	testRingSizes();
+	testRingLockup();
+	testRingDrainWhileReserved();
+#endif
+	return(mrbusTestResult("queue"));
+}
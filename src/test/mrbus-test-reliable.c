@@ -0,0 +1,375 @@
+// Reliable delivery regression tests - built once per queue backend (see the test target in the Makefile)
+
+#include <stdint.h>
+#include <string.h>
+
+#include "mrbus.h"
+#include "mrbus-test.h"
+
+#define TEST_QUEUE_LEN  4
+#define TEST_ADDR       0x03
+#define TEST_PEER       0x09
+
+static MRBusPktQueue rxQueue, txQueue;
+static MRBusPacket rxQueueBuffer[TEST_QUEUE_LEN], txQueueBuffer[TEST_QUEUE_LEN];
+
+static void testPktCrc(uint8_t* pkt)
+{
+	uint16_t crc = 0;
+	uint8_t i;
+	for (i=0; i<pkt[MRBUS_PKT_LEN]; i++)
+		if (MRBUS_PKT_CRC_L != i && MRBUS_PKT_CRC_H != i)
+			crc = mrbusCRC16Update(crc, pkt[i]);
+	pkt[MRBUS_PKT_CRC_L] = UINT16_LOW_BYTE(crc);
+	pkt[MRBUS_PKT_CRC_H] = UINT16_HIGH_BYTE(crc);
+}
+
+static void testPktMake(uint8_t* pkt, uint8_t len, uint8_t type)
+{
+	uint8_t i;
+	memset(pkt, 0, MRBUS_BUFFER_SIZE);
+	pkt[MRBUS_PKT_DEST] = TEST_ADDR;
+	pkt[MRBUS_PKT_SRC] = TEST_PEER;
+	pkt[MRBUS_PKT_LEN] = len;
+	pkt[MRBUS_PKT_TYPE] = type;
+	for (i=6; i<len; i++)
+		pkt[i] = 0x40 + i;
+	testPktCrc(pkt);
+}
+
+// Wrapped as the peer's mrbusReliableSend() would - type and data move up two bytes
+static void testPktWrap(uint8_t* pkt, uint8_t seq)
+{
+	uint8_t i, len = pkt[MRBUS_PKT_LEN];
+	for (i=len+1; i>7; i--)
+		pkt[i] = pkt[i-2];
+	pkt[7] = pkt[MRBUS_PKT_TYPE];
+	pkt[6] = seq;
+	pkt[MRBUS_PKT_TYPE] = MRBUS_RELIABLE_PKT_TYPE;
+	pkt[MRBUS_PKT_LEN] = len + 2;
+	testPktCrc(pkt);
+}
+
+// A reliable packet handled where it sits in the receive queue, then released.  Unwrapping it in
+// place used to shrink its length, so a byte ring released the wrong number of bytes and the
+// next packet came out as garbage.
+static void testReliableFrontRelease(void)
+{
+	uint8_t pkt[MRBUS_BUFFER_SIZE], wrapped[MRBUS_BUFFER_SIZE], txBuffer[MRBUS_BUFFER_SIZE];
+	MRBusPacket* front;
+	uint8_t i;
+
+	for (i=0; i<20; i++)
+	{
+		testPktMake(pkt, 8, 'A');
+		testPktWrap(pkt, MRBUS_RELIABLE_SEQ_SYNC | i);
+		memcpy(wrapped, pkt, sizeof(wrapped));
+		TEST_CHECK(mrbusPktQueuePush(&rxQueue, pkt, pkt[MRBUS_PKT_LEN]));
+		testPktMake(pkt, 8, 'A');
+		TEST_CHECK(mrbusPktQueuePush(&rxQueue, pkt, pkt[MRBUS_PKT_LEN]));
+
+		front = mrbusPktQueueFront(&rxQueue);
+		TEST_CHECK(NULL != front);
+		TEST_CHECK(0 != mrbusPktHandlerFront(front, txBuffer, TEST_ADDR));
+		TEST_CHECK(0 == memcmp(front->pkt, wrapped, wrapped[MRBUS_PKT_LEN]));
+		TEST_CHECK(mrbusPktQueueRelease(&rxQueue));
+
+		front = mrbusPktQueueFront(&rxQueue);
+		TEST_CHECK(NULL != front && 0 == memcmp(front->pkt, pkt, 8));
+		TEST_CHECK(mrbusPktQueueRelease(&rxQueue));
+		TEST_CHECK(mrbusPktQueueEmpty(&rxQueue));
+
+		// Its ack
+		TEST_CHECK(mrbusPktQueuePop(&txQueue, pkt, sizeof(pkt)));
+		TEST_CHECK(MRBUS_RELIABLE_ACK_PKT_TYPE == pkt[MRBUS_PKT_TYPE] && i == pkt[6]);
+		TEST_CHECK(0 == pkt[MRBUS_PKT_CRC_L] && 0 == pkt[MRBUS_PKT_CRC_H]);
+	}
+}
+
+// An application packet comes back as MRBUS_HANDLER_CUSTOM, unwrapped by mrbusReliableRxPkt(),
+// and a second copy is acked again but not handed on
+static void testReliableCustom(void)
+{
+	uint8_t pkt[MRBUS_BUFFER_SIZE], rxBuffer[MRBUS_BUFFER_SIZE], txBuffer[MRBUS_BUFFER_SIZE];
+	uint8_t* unwrapped;
+
+	testPktMake(pkt, 12, 'C');
+	memcpy(rxBuffer, pkt, sizeof(rxBuffer));
+	testPktWrap(rxBuffer, 0x40);
+
+	TEST_CHECK(MRBUS_HANDLER_CUSTOM == mrbusPktHandler(rxBuffer, txBuffer, TEST_ADDR));
+	TEST_CHECK(MRBUS_RELIABLE_PKT_TYPE == rxBuffer[MRBUS_PKT_TYPE] && 14 == rxBuffer[MRBUS_PKT_LEN]);
+	unwrapped = mrbusReliableRxPkt(rxBuffer);
+	TEST_CHECK(12 == unwrapped[MRBUS_PKT_LEN] && 'C' == unwrapped[MRBUS_PKT_TYPE]);
+	TEST_CHECK(0 == memcmp(unwrapped + 6, pkt + 6, 6));
+	TEST_CHECK(&pkt[0] == &mrbusReliableRxPkt(pkt)[0]);
+
+	TEST_CHECK(0 == mrbusPktHandler(rxBuffer, txBuffer, TEST_ADDR));
+	TEST_CHECK(2 == mrbusPktQueueDepth(&txQueue));
+}
+
+// Sets mrbusHalTicks()
+static void testTicks(uint16_t ticks)
+{
+	mrbusHostMicros = (uint32_t)ticks * 20;
+}
+
+// Starts each test with no peers, nothing outstanding, empty queues and the clock at 0
+static void testReliableReset(void)
+{
+	mrbusPktQueueInitialize(&rxQueue, rxQueueBuffer, TEST_QUEUE_LEN);
+	mrbusPktQueueInitialize(&txQueue, txQueueBuffer, TEST_QUEUE_LEN);
+	mrbusReliableInit(&txQueue);
+	testTicks(0);
+}
+
+// Our packet to dest, as the application would pass it to mrbusReliableSend()
+static void testPktOut(uint8_t* pkt, uint8_t dest, uint8_t len, uint8_t type)
+{
+	testPktMake(pkt, len, type);
+	pkt[MRBUS_PKT_DEST] = dest;
+	pkt[MRBUS_PKT_SRC] = TEST_ADDR;
+}
+
+// src acknowledging our packet with sequence number seq
+static uint8_t testAck(uint8_t src, uint8_t seq)
+{
+	uint8_t pkt[MRBUS_BUFFER_SIZE], txBuffer[MRBUS_BUFFER_SIZE];
+
+	testPktMake(pkt, 7, MRBUS_RELIABLE_ACK_PKT_TYPE);
+	pkt[MRBUS_PKT_SRC] = src;
+	pkt[6] = seq;
+	testPktCrc(pkt);
+	return(mrbusPktHandler(pkt, txBuffer, TEST_ADDR));
+}
+
+// The peer's wrapped packet with sequence byte seq, through the handler - checks the ack that
+// every copy gets, and returns what the handler did with it
+static uint8_t testRxSeq(uint8_t seq)
+{
+	uint8_t pkt[MRBUS_BUFFER_SIZE], txBuffer[MRBUS_BUFFER_SIZE];
+	uint8_t status;
+
+	testPktMake(pkt, 9, 'C');
+	pkt[8] = seq;
+	testPktWrap(pkt, seq);
+	status = mrbusPktHandler(pkt, txBuffer, TEST_ADDR);
+
+	TEST_CHECK(mrbusPktQueuePop(&txQueue, pkt, sizeof(pkt)));
+	TEST_CHECK(MRBUS_RELIABLE_ACK_PKT_TYPE == pkt[MRBUS_PKT_TYPE] && TEST_PEER == pkt[MRBUS_PKT_DEST]);
+	TEST_CHECK((seq & MRBUS_RELIABLE_SEQ_MASK) == pkt[6]);
+	TEST_CHECK(mrbusPktQueueEmpty(&txQueue));
+	if (MRBUS_HANDLER_CUSTOM == status)
+		TEST_CHECK(seq == mrbusReliableRxBuffer[8] && 9 == mrbusReliableRxBuffer[MRBUS_PKT_LEN]);
+	return(status);
+}
+
+// Sequence byte of the next packet on the transmit queue, or 0xFF if it's empty
+static uint8_t testTxSeq(void)
+{
+	uint8_t pkt[MRBUS_BUFFER_SIZE];
+
+	if (!mrbusPktQueuePop(&txQueue, pkt, sizeof(pkt)))
+		return(0xFF);
+	return(pkt[6]);
+}
+
+// What goes on the transmit queue, and what can't be wrapped
+static void testReliableSendWrap(void)
+{
+	uint8_t pkt[MRBUS_BUFFER_SIZE], wrapped[MRBUS_BUFFER_SIZE];
+
+	testReliableReset();
+	testPktOut(pkt, TEST_PEER, 10, 'Q');
+	TEST_CHECK(mrbusReliableSend(pkt));
+	TEST_CHECK(1 == mrbusReliablePending(TEST_PEER) && 1 == mrbusReliablePending(0xFF));
+	TEST_CHECK(mrbusPktQueuePop(&txQueue, wrapped, sizeof(wrapped)));
+	TEST_CHECK(TEST_PEER == wrapped[MRBUS_PKT_DEST] && TEST_ADDR == wrapped[MRBUS_PKT_SRC]);
+	TEST_CHECK(12 == wrapped[MRBUS_PKT_LEN] && MRBUS_RELIABLE_PKT_TYPE == wrapped[MRBUS_PKT_TYPE]);
+	TEST_CHECK(0 == wrapped[MRBUS_PKT_CRC_L] && 0 == wrapped[MRBUS_PKT_CRC_H]);
+	TEST_CHECK(MRBUS_RELIABLE_SEQ_SYNC == wrapped[6] && 'Q' == wrapped[7]);
+	TEST_CHECK(0 == memcmp(wrapped + 8, pkt + 6, 4));
+
+	// Longest that still fits once wrapped, then one more
+	testPktOut(pkt, 0x0A, MRBUS_BUFFER_SIZE - 2, 'Q');
+	TEST_CHECK(mrbusReliableSend(pkt));
+	TEST_CHECK(mrbusPktQueuePop(&txQueue, wrapped, sizeof(wrapped)));
+	TEST_CHECK(MRBUS_BUFFER_SIZE == wrapped[MRBUS_PKT_LEN]);
+	TEST_CHECK(0 == memcmp(wrapped + 8, pkt + 6, MRBUS_BUFFER_SIZE - 8));
+	testPktOut(pkt, 0x0B, MRBUS_BUFFER_SIZE - 1, 'Q');
+	TEST_CHECK(!mrbusReliableSend(pkt));
+
+	// Broadcasts and packets without a type
+	testPktOut(pkt, 0xFF, 10, 'Q');
+	TEST_CHECK(!mrbusReliableSend(pkt));
+	testPktOut(pkt, 0x0B, MRBUS_PKT_TYPE, 'Q');
+	TEST_CHECK(!mrbusReliableSend(pkt));
+	TEST_CHECK(2 == mrbusReliablePending(0xFF) && mrbusPktQueueEmpty(&txQueue));
+}
+
+// MRBUS_RELIABLE_WINDOW per destination, MRBUS_RELIABLE_SLOTS in all
+static void testReliableLimits(void)
+{
+	uint8_t pkt[MRBUS_BUFFER_SIZE];
+	uint8_t i;
+
+	testReliableReset();
+	for (i=0; i<MRBUS_RELIABLE_SLOTS; i++)
+	{
+		testPktOut(pkt, 0x10 + i / MRBUS_RELIABLE_WINDOW, 8, 'Q');
+		TEST_CHECK(mrbusReliableSend(pkt));
+		TEST_CHECK(i % MRBUS_RELIABLE_WINDOW == (testTxSeq() & MRBUS_RELIABLE_SEQ_MASK));
+		if (MRBUS_RELIABLE_WINDOW - 1 == i % MRBUS_RELIABLE_WINDOW)
+			TEST_CHECK(!mrbusReliableSend(pkt));
+	}
+	TEST_CHECK(MRBUS_RELIABLE_SLOTS == mrbusReliablePending(0xFF));
+	TEST_CHECK(MRBUS_RELIABLE_WINDOW == mrbusReliablePending(0x10));
+
+	// Slots all taken, even for a destination with nothing outstanding
+	testPktOut(pkt, 0x20, 8, 'Q');
+	TEST_CHECK(!mrbusReliableSend(pkt));
+
+	// An ack frees a slot, and the window for that destination
+	TEST_CHECK(0 == testAck(0x10, 0));
+	TEST_CHECK(MRBUS_RELIABLE_WINDOW - 1 == mrbusReliablePending(0x10));
+	TEST_CHECK(mrbusReliableSend(pkt));
+	TEST_CHECK(0 == (testTxSeq() & MRBUS_RELIABLE_SEQ_MASK));
+	TEST_CHECK(mrbusPktQueueEmpty(&txQueue));
+}
+
+// Acks only match the source and sequence number of an outstanding packet, and sync marks stop
+// once the peer has acked something and no marked packet is still outstanding
+static void testReliableAck(void)
+{
+	uint8_t pkt[MRBUS_BUFFER_SIZE];
+
+	testReliableReset();
+	testPktOut(pkt, TEST_PEER, 8, 'Q');
+	TEST_CHECK(mrbusReliableSend(pkt));
+	TEST_CHECK(mrbusReliableSend(pkt));
+	TEST_CHECK((MRBUS_RELIABLE_SEQ_SYNC | 0) == testTxSeq());
+	TEST_CHECK((MRBUS_RELIABLE_SEQ_SYNC | 1) == testTxSeq());
+
+	testAck(TEST_PEER + 1, 0);
+	testAck(TEST_PEER, 2);
+	testAck(TEST_PEER, MRBUS_RELIABLE_SEQ_SYNC | 0);
+	TEST_CHECK(2 == mrbusReliablePending(TEST_PEER));
+
+	// Only the second acked - the first is still marked, so the next is too
+	testAck(TEST_PEER, 1);
+	testAck(TEST_PEER, 1);
+	TEST_CHECK(1 == mrbusReliablePending(TEST_PEER));
+	TEST_CHECK(mrbusReliableSend(pkt));
+	TEST_CHECK((MRBUS_RELIABLE_SEQ_SYNC | 2) == testTxSeq());
+
+	// The first acked, but the third is marked and outstanding
+	testAck(TEST_PEER, 0);
+	TEST_CHECK(1 == mrbusReliablePending(TEST_PEER));
+	TEST_CHECK(mrbusReliableSend(pkt));
+	TEST_CHECK((MRBUS_RELIABLE_SEQ_SYNC | 3) == testTxSeq());
+
+	// Now no marked packet is left
+	testAck(TEST_PEER, 2);
+	testAck(TEST_PEER, 3);
+	TEST_CHECK(0 == mrbusReliablePending(TEST_PEER));
+	TEST_CHECK(mrbusReliableSend(pkt));
+	TEST_CHECK(4 == testTxSeq());
+	TEST_CHECK(mrbusPktQueueEmpty(&txQueue));
+}
+
+// Retransmits at each deadline and not before, the wait doubling up to MRBUS_RELIABLE_TIMEOUT_MAX,
+// then the give up after MRBUS_RELIABLE_RETRIES with the packet as it was sent
+static void testReliableRetransmit(void)
+{
+	uint8_t pkt[MRBUS_BUFFER_SIZE], failed[MRBUS_BUFFER_SIZE], wrapped[MRBUS_BUFFER_SIZE];
+	uint16_t now = 0x1234, deadline;
+	uint32_t wait = MRBUS_RELIABLE_TIMEOUT;
+	uint8_t sends;
+
+	testReliableReset();
+	testTicks(now);
+	testPktOut(pkt, TEST_PEER, 11, 'Q');
+	TEST_CHECK(mrbusReliableSend(pkt));
+	TEST_CHECK(mrbusPktQueuePop(&txQueue, wrapped, sizeof(wrapped)));
+
+	for (sends=1; sends<=MRBUS_RELIABLE_RETRIES; sends++)
+	{
+		deadline = now + wait + (now & MRBUS_RELIABLE_JITTER);
+
+		testTicks(deadline - 1);
+		TEST_CHECK(0 == mrbusReliablePoll(failed));
+		TEST_CHECK(mrbusPktQueueEmpty(&txQueue));
+
+		now = deadline;
+		testTicks(now);
+		TEST_CHECK(0 == mrbusReliablePoll(failed));
+		TEST_CHECK(mrbusPktQueuePop(&txQueue, pkt, sizeof(pkt)));
+		TEST_CHECK(0 == memcmp(pkt, wrapped, wrapped[MRBUS_PKT_LEN]));
+		TEST_CHECK(mrbusPktQueueEmpty(&txQueue));
+
+		wait = (wait * 2 > MRBUS_RELIABLE_TIMEOUT_MAX) ? MRBUS_RELIABLE_TIMEOUT_MAX : wait * 2;
+	}
+	TEST_CHECK(MRBUS_RELIABLE_TIMEOUT_MAX == wait);
+
+	deadline = now + wait + (now & MRBUS_RELIABLE_JITTER);
+	testTicks(deadline - 1);
+	TEST_CHECK(0 == mrbusReliablePoll(failed));
+	testTicks(deadline);
+	memset(failed, 0, sizeof(failed));
+	TEST_CHECK(1 == mrbusReliablePoll(failed));
+	TEST_CHECK(mrbusPktQueueEmpty(&txQueue));
+	TEST_CHECK(0 == mrbusReliablePending(0xFF));
+
+	// Back as it was handed to mrbusReliableSend(), apart from the CRC bytes
+	testPktOut(pkt, TEST_PEER, 11, 'Q');
+	pkt[MRBUS_PKT_CRC_L] = pkt[MRBUS_PKT_CRC_H] = 0;
+	TEST_CHECK(0 == memcmp(failed, pkt, 11));
+	TEST_CHECK(0 == mrbusReliablePoll(failed));
+}
+
+// Sequence numbers wrapping from 127 to 0, and the 8 packet duplicate window behind the newest
+static void testReliableRxSeq(void)
+{
+	uint8_t seq;
+
+	testReliableReset();
+	TEST_CHECK(MRBUS_HANDLER_CUSTOM == testRxSeq(MRBUS_RELIABLE_SEQ_SYNC | 125));
+	for (seq=126; seq!=2; seq=(seq + 1) & MRBUS_RELIABLE_SEQ_MASK)
+		TEST_CHECK(MRBUS_HANDLER_CUSTOM == testRxSeq(seq));
+	TEST_CHECK(0 == testRxSeq(127));
+	TEST_CHECK(0 == testRxSeq(1));
+
+	// Out of order within the window
+	TEST_CHECK(MRBUS_HANDLER_CUSTOM == testRxSeq(3));
+	TEST_CHECK(MRBUS_HANDLER_CUSTOM == testRxSeq(2));
+	TEST_CHECK(0 == testRxSeq(2));
+
+	// 8 ahead moves the window past everything before - 3 is now too old, 4 is still new
+	TEST_CHECK(MRBUS_HANDLER_CUSTOM == testRxSeq(11));
+	TEST_CHECK(0 == testRxSeq(3));
+	TEST_CHECK(MRBUS_HANDLER_CUSTOM == testRxSeq(4));
+	TEST_CHECK(0 == testRxSeq(4));
+
+	// Half the sequence space or more ahead is taken to be old
+	TEST_CHECK(0 == testRxSeq(11 + 64));
+	TEST_CHECK(MRBUS_HANDLER_CUSTOM == testRxSeq(11 + 63));
+
+	// Restarted - the sync mark starts it afresh, but only on the first marked packet
+	TEST_CHECK(MRBUS_HANDLER_CUSTOM == testRxSeq(MRBUS_RELIABLE_SEQ_SYNC | 0));
+	TEST_CHECK(0 == testRxSeq(MRBUS_RELIABLE_SEQ_SYNC | 0));
+	TEST_CHECK(MRBUS_HANDLER_CUSTOM == testRxSeq(MRBUS_RELIABLE_SEQ_SYNC | 1));
+	TEST_CHECK(MRBUS_HANDLER_CUSTOM == testRxSeq(2));
+}
+
+int main(void)
+{
+	testReliableReset();
+	testReliableFrontRelease();
+	testReliableCustom();
+	testReliableSendWrap();
+	testReliableLimits();
+	testReliableAck();
+	testReliableRetransmit();
+	testReliableRxSeq();
+	return(mrbusTestResult("reliable"));
+}
@@ -0,0 +1,28 @@
+// Minimal checking for the host regression tests (make test)
+// Each test program exits non-zero if any check failed, after reporting every failing one.
+
+#ifndef MRBUS_TEST_H
+#define MRBUS_TEST_H
+
+#include <stdio.h>
+
+static unsigned int mrbusTestChecks, mrbusTestFailures;
+
+#define TEST_CHECK(cond) \
+	do { \
+		mrbusTestChecks++; \
+		if (!(cond)) \
+		{ \
+			mrbusTestFailures++; \
+			fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+		} \
+	} while(0)
+
+// Returns the exit status for main()
+static inline int mrbusTestResult(const char* name)
+{
+	printf("%s: %u checks, %u failed\n", name, mrbusTestChecks, mrbusTestFailures);
+	return(mrbusTestFailures ? 1 : 0);
+}
+
+#endif